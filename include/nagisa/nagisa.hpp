@@ -22,11 +22,18 @@
 
 #pragma once
 #include <memory>
+#include <string>
 #include <string_view>
 #include <vector>
 #include <algorithm>
+#include <functional>
 #include <optional>
+#include <tuple>
 #include <array>
+#include <cstdio>
+#include <cstdlib>
+#include <cstdint>
+#include <cstring>
 #define NGS_ASSERT(expr)                                                                                               \
     do {                                                                                                               \
         if (!(expr)) {                                                                                                 \
@@ -36,14 +43,71 @@
     } while (0)
 namespace nagisa {
     class Node;
-    enum class Type { none, boolean, f32, i32 };
-    void nagisa_init();
+    // f16 is a storage type, its values are computed as f32 and rounded to half precision when stored
+    enum class Type { none, boolean, f32, i32, f64, f16, u32, i64, u64 };
+    // automatic picks NAGISA_BACKEND (cpu/opencl) if set, else OpenCL with a CPU fallback
+    enum class BackendType { automatic, cpu, opencl };
+    enum class DeviceType { gpu, cpu, accelerator, all };
+    /*
+    How the OpenCL backend splits the ThreadIdx range of a launch: over every matching device of the platform from
+    the selected one on, over `sub_devices` equal sub-devices of the selected device, or over its NUMA nodes
+    */
+    enum class ShardMode { none, devices, sub_devices, numa };
+    /*
+    The OpenCL device nagisa_init picks: the index-th device of the given type on the first platform that has one.
+    platform is a platform index or a part of its name, empty for any. NAGISA_OPENCL_PLATFORM,
+    NAGISA_OPENCL_DEVICE (type[:index], such as cpu or gpu:1) and NAGISA_OPENCL_SHARDS (devices, numa or a number
+    of sub-devices) override the fields
+    */
+    struct OpenCLDevice {
+        std::string platform;
+        DeviceType type = DeviceType::gpu;
+        int index = 0;
+        ShardMode shards = ShardMode::none;
+        int sub_devices = 2;
+    };
+    // takes effect at the next nagisa_init
+    void nagisa_set_opencl_device(const OpenCLDevice &device);
+    // a line per platform ("platform 0: name") followed by a line per device ("  device 0: name, type, units")
+    std::vector<std::string> nagisa_opencl_devices();
+    // creates the device and a context current on the calling thread
+    void nagisa_init(BackendType backend = BackendType::automatic);
+    // destroys the context of nagisa_init and the device, after every other context
     void nagisa_destroy();
+    /*
+    A tracing context: a trace, its buffers and a queue of device commands of its own, on the device of nagisa_init
+    that all contexts share with their kernel cache and buffer pool. Every function here works on the context
+    current on the calling thread, so threads with a context each trace and evaluate concurrently. Arrays belong
+    to the context they were created in, see ThreadContext
+    */
+    class Context;
+    Context *nagisa_create_context();
+    // the context must not be current on any thread, its arrays have to be gone
+    void nagisa_destroy_context(Context *c);
+    // makes c (or no context) current on the calling thread and returns the previous one
+    Context *nagisa_set_context(Context *c);
+    Context *nagisa_get_context();
     void nagisa_eval();
+    // makes the next nagisa_eval write idx into a buffer, even where the cost model would recompute it
+    void nagisa_schedule(int idx);
+    /*
+    nagisa_eval writes a pending array with external references into a buffer only if recomputing it in
+    the kernels that use it would cost more ALU ops than `ops` per byte the buffer moves (written once and
+    read back once). Cheap expressions are left to be fused into their users. 0 writes every array,
+    NAGISA_OPS_PER_BYTE sets the initial value (4)
+    */
+    void nagisa_set_ops_per_byte(float ops);
+    /*
+    Kernels are built on a pool of NAGISA_COMPILE_THREADS workers, every kernel of an eval at once. nagisa_precompile
+    starts building the kernels the next nagisa_eval would launch for what is traced so far, without evaluating.
+    With nagisa_set_background_compile(n) (or NAGISA_BACKGROUND_COMPILE) it runs on its own every n appended trace
+    nodes, so building overlaps tracing at the price of kernels for traces that grow further. 0 turns it off
+    */
+    void nagisa_precompile();
+    void nagisa_set_background_compile(size_t nodes);
     class DeviceBuffer;
     std::pair<DeviceBuffer *, int32_t> nagisa_alloc(size_t, Type);
     void nagisa_free(DeviceBuffer *);
-    void nagisa_set_var_size(int idx, size_t);
     void nagisa_inc_int(int idx);
     void nagisa_dec_int(int idx);
     void nagisa_inc_ext(int idx);
@@ -51,6 +115,182 @@ namespace nagisa {
     int nagisa_buffer_id(int idx);
     void nagisa_copy_to_host(int idx, void *);
     int nagisa_ref_ext(int idx);
+    // a var over `count` elements of host memory, which is borrowed rather than copied where the device allows
+    int nagisa_from_host(const void *p, size_t count, Type type);
+    // evaluates idx and exposes its contents to the host until nagisa_unmap
+    const void *nagisa_map(int idx);
+    void nagisa_unmap(int idx, const void *p);
+    /*
+    Queues target[index] = value (or an atomic += when add is set) over `size` lanes where mask is set
+    and returns the var holding the result, which is target itself unless it had to be copied first.
+    Any later use of the result waits for the store
+    */
+    int nagisa_scatter(int target, int index, int value, int mask, size_t size, bool add);
+    // recorded control flow, see loop() and if_(). state holds n vars, phis receives the vars standing in for them
+    void nagisa_loop_begin(const int *state, int *phis, size_t n, size_t size);
+    void nagisa_loop_cond(int cond);
+    void nagisa_if_begin(int cond, const int *state, size_t n, size_t size);
+    // state holds the values at the end of the body, on return the values after the region, which run over size lanes
+    void nagisa_region_end(int *state, size_t n, size_t size);
+    // records a Function over n Argument vars of the given types, see Function
+    void nagisa_function_begin(const Type *types, int *args, size_t n);
+    // a native function and the shared object holding it, which is unloaded once the last copy of `library` is gone
+    struct NativeFunction {
+        void *fn = nullptr;
+        std::shared_ptr<void> library;
+    };
+    // compiles what result computes from the arguments into a native function over `lanes` values of each
+    NativeFunction nagisa_function_end(int result, size_t lanes);
+    // an evaluated var of `count` elements with undefined contents
+    int nagisa_empty(size_t count, Type type);
+    // an evaluated var holding a copy of the `count` elements at p
+    int nagisa_upload(const void *p, size_t count, Type type);
+    // evaluates idx over `size` lanes, broadcasting a single element, and returns a new var with its running sum
+    int nagisa_prefix_sum(int idx, size_t size, bool exclusive);
+    // when enabled every scalar literal is passed as a kernel argument, as if it were opaque
+    void nagisa_lift_constants(bool enable);
+    /*
+    Graph capture, see Graph. Evaluates the n inputs and records every command the evals until nagisa_capture_end
+    send to the device (launches, copies, uploads) with its buffers, params and size. The cost model is off
+    meanwhile, so every array with an external reference is written
+    */
+    void nagisa_capture_begin(const int *inputs, size_t n);
+    // evaluates what is pending and returns the id of the graph
+    int nagisa_capture_end();
+    // sends the commands of the graph again, over the buffers of `inputs` in place of those of its inputs
+    void nagisa_graph_replay(int graph, const int *inputs, size_t n);
+    void nagisa_graph_free(int graph);
+    // bumped by every replay, which rewrites evaluated arrays in place
+    uint64_t nagisa_graph_epoch();
+
+    struct KernelCacheStats {
+        size_t memory_hits = 0;
+        size_t disk_hits = 0;
+        size_t misses = 0;
+        size_t writes = 0;
+        size_t evictions = 0;
+        size_t disk_bytes = 0;
+    };
+    KernelCacheStats nagisa_kernel_cache_stats();
+
+    // device memory held by the buffer pool, sizes are rounded up to their size class
+    struct MemoryStats {
+        size_t live_bytes = 0;
+        size_t cached_bytes = 0;
+        // of live + cached
+        size_t peak_bytes = 0;
+        size_t allocations = 0;
+        size_t reuses = 0;
+        size_t trimmed_bytes = 0;
+        // host memory holding the outputs of tiled evals, see nagisa_set_tile_budget
+        size_t spilled_bytes = 0;
+    };
+    MemoryStats nagisa_memory_stats();
+    // returns cached buffers to the device until at most `bytes` stay cached
+    void nagisa_trim_memory(size_t bytes = 0);
+    /*
+    Out-of-core evaluation. A kernel whose full-size outputs (plus the spilled arrays it reads) would take more
+    than `bytes` runs over tiles of its range instead, with tile-sized device buffers, and its outputs are streamed
+    into host memory while the next tile computes. A kernel with no such buffers counts a byte per lane, so a
+    reduction over more lanes than `bytes` runs in tiles too. 0 disables tiling, the default unless
+    NAGISA_TILE_BUDGET is set
+    */
+    void nagisa_set_tile_budget(size_t bytes);
+
+    /*
+    Runtime counters and timings, collected only while profiling is enabled (nagisa_set_profiling or
+    NAGISA_PROFILE=1), otherwise every probe is a test of one flag. Times are in seconds. `device_time` sums the
+    kernels as the device ran them, from the workers of the CPU backend or the profiling events of OpenCL,
+    which are only available if profiling was enabled before nagisa_init
+    */
+    struct ProfileStats {
+        size_t trace_nodes = 0;
+        size_t kernels_generated = 0;
+        // launches that found their compiled kernel in memory, or had to compile (or load) it
+        size_t kernel_cache_hits = 0;
+        size_t kernel_cache_misses = 0;
+        size_t launches = 0;
+        // new device allocations, not buffers reused from the pool
+        size_t bytes_allocated = 0;
+        size_t bytes_uploaded = 0;
+        size_t bytes_downloaded = 0;
+        // device to device, such as the tiles of an out-of-core eval
+        size_t bytes_copied = 0;
+        double schedule_time = 0;
+        double codegen_time = 0;
+        double compile_time = 0;
+        // queuing launches, compiling excluded
+        double launch_time = 0;
+        // copying results to the host, including the wait for the kernels producing them
+        double readback_time = 0;
+        double device_time = 0;
+    };
+    void nagisa_set_profiling(bool enable);
+    ProfileStats nagisa_profile_stats();
+    void nagisa_reset_profile();
+    /*
+    Starts recording every timed step as an event of a Chrome trace (chrome://tracing or Perfetto), which enables
+    profiling. nagisa_write_trace stores the events recorded so far as JSON and stops. NAGISA_TRACE=<path> traces
+    from nagisa_init and writes the file in nagisa_destroy, or at exit
+    */
+    void nagisa_start_trace();
+    void nagisa_write_trace(const char *path);
+    // prints the source of every kernel the backend compiles to stderr, also enabled by NAGISA_DUMP_KERNELS=1
+    void nagisa_set_dump_kernels(bool enable);
+    // prints the backend and devices nagisa_init picks to stderr, also enabled by NAGISA_LOG=1
+    void nagisa_set_log(bool enable);
+
+    // IEEE binary16 bits, rounded to nearest even from a float
+    inline uint16_t nagisa_float_to_half(float f) {
+        uint32_t x;
+        std::memcpy(&x, &f, sizeof(x));
+        uint32_t sign = (x >> 16) & 0x8000u, m = x & 0x7fffffu;
+        int e = (int)((x >> 23) & 0xff) - 112;
+        if (e == 0xff - 112) {
+            return (uint16_t)(sign | 0x7c00u | (m ? 0x200u : 0u));
+        }
+        if (e >= 0x1f) {
+            return (uint16_t)(sign | 0x7c00u);
+        }
+        uint32_t shift = 13;
+        if (e <= 0) {
+            if (e < -10) {
+                return (uint16_t)sign;
+            }
+            // subnormal, the implicit bit becomes explicit
+            m |= 0x800000u;
+            shift = 14 - e;
+            e = 0;
+        }
+        uint32_t r = ((uint32_t)e << 10) + (m >> shift), rest = m & ((1u << shift) - 1), half = 1u << (shift - 1);
+        // a carry out of the mantissa correctly bumps the exponent, up to infinity
+        if (rest > half || (rest == half && (r & 1))) {
+            r++;
+        }
+        return (uint16_t)(sign | r);
+    }
+    inline float nagisa_half_to_float(uint16_t h) {
+        uint32_t sign = (uint32_t)(h & 0x8000u) << 16, e = (h >> 10) & 0x1f, m = h & 0x3ffu, x;
+        if (e == 0x1f) {
+            x = sign | 0x7f800000u | (m << 13);
+        } else if (e != 0) {
+            x = sign | ((e + 112) << 23) | (m << 13);
+        } else {
+            // zero or subnormal, m * 2^-24
+            float f = (float)m * 5.9604645e-8f;
+            return sign ? -f : f;
+        }
+        float f;
+        std::memcpy(&f, &x, sizeof(f));
+        return f;
+    }
+    // host side of an f16 element
+    struct half {
+        uint16_t bits = 0;
+        half() = default;
+        explicit half(float f) : bits(nagisa_float_to_half(f)) {}
+        operator float() const { return nagisa_half_to_float(bits); }
+    };
 
     template <typename Value>
     constexpr Type get_type() {
@@ -61,7 +301,15 @@ namespace nagisa {
         } else if constexpr (std::is_same_v<Value, float>) {
             return Type::f32;
         } else if constexpr (std::is_same_v<Value, double>) {
-            return Type::f32;
+            return Type::f64;
+        } else if constexpr (std::is_same_v<Value, half>) {
+            return Type::f16;
+        } else if constexpr (std::is_same_v<Value, uint32_t>) {
+            return Type::u32;
+        } else if constexpr (std::is_same_v<Value, int64_t>) {
+            return Type::i64;
+        } else if constexpr (std::is_same_v<Value, uint64_t>) {
+            return Type::u64;
         } else {
             return Type::none;
         }
@@ -70,13 +318,24 @@ namespace nagisa {
     inline size_t get_typesize(Type type) {
         switch (type) {
         case Type::i32:
+        case Type::u32:
         case Type::f32:
             return 4;
+        case Type::i64:
+        case Type::u64:
+        case Type::f64:
+            return 8;
+        case Type::f16:
+            return 2;
         case Type::boolean:
             return 1;
+        default:
+            break;
         }
         NGS_ASSERT(false);
+        return 0;
     }
+    inline bool nagisa_is_float(Type type) { return type == Type::f32 || type == Type::f64 || type == Type::f16; }
     enum Opcode {
         Select,
         FAdd,
@@ -96,22 +355,38 @@ namespace nagisa {
         Load,
         Sin,
         Cos,
-        Sqrt
+        Sqrt,
+        Neg,
+        // a value that lives in a buffer from the start, see nagisa_from_host
+        Input,
+        // Store with an atomic += instead of the assignment
+        ScatterAdd,
+        // fold every lane of the operand into a single element
+        ReduceAdd,
+        ReduceMax,
+        ReduceMin,
+        // recorded control flow, see loop() and if_(). A Phi is the value of a state var inside a loop,
+        // Loop and If own the vars recorded in them and RegionOut is the value of a state var after one
+        Phi,
+        Loop,
+        If,
+        RegionOut,
+        // parameter ival of a recorded Function
+        Argument,
+        // the operand converted to the type of the var, as a C cast
+        Cast
     };
     struct Instruction {
         Opcode op;
         union {
-            int ival;
+            // the bits of the value for u64
+            int64_t ival;
             double fval;
-            int operand[3] = {-1};
-            struct {
-                int buffer_id;
-                int idx;
-                int value;
-                int mask;
-            } store_inst;
+            int operand[3] = {-1, -1, -1};
         };
-        std::array<int, 3> deps = {-1};
+        std::array<int, 3> deps = {-1, -1, -1};
+        // constants marked opaque are passed to kernels as arguments instead of literals
+        bool opaque = false;
         static Instruction ternary(Opcode op, int a, int b, int c) {
             Instruction i;
             i.op = op;
@@ -139,42 +414,43 @@ namespace nagisa {
             i.deps[0] = a;
             return i;
         }
-        static Instruction const_int(int x) {
+        static Instruction const_int(int64_t x, bool opaque = false) {
             Instruction i;
             i.op = ConstantInt;
             i.ival = x;
+            i.opaque = opaque;
             return i;
         }
-        static Instruction const_float(double x) {
+        static Instruction const_float(double x, bool opaque = false) {
             Instruction i;
             i.op = ConstantFloat;
             i.fval = x;
+            i.opaque = opaque;
             return i;
         }
-        static Instruction store(int buffer, int idx, int value, int mask) {
-            Instruction i;
-            i.op = Store;
-            i.store_inst.buffer_id = buffer;
-            i.store_inst.idx = idx;
-            i.store_inst.value = value;
-            i.store_inst.mask = mask;
-            i.deps[0] = idx;
-            i.deps[1] = value;
-            i.deps[2] = mask;
-            return i;
+        // the target buffer is not an operand, see nagisa_scatter
+        static Instruction store(int idx, int value, int mask, bool add = false) {
+            return ternary(add ? ScatterAdd : Store, idx, value, mask);
         }
     };
 
-    int nagisa_trace_append(const Instruction &i, Type type);
+    // appends i to the trace as a var over `size` lanes, or returns an existing var that is equal to it
+    int nagisa_trace_append(const Instruction &i, Type type, size_t size);
+    // a var over `count` lanes holding the index of each lane as `type`
+    int nagisa_range(size_t count, Type type = Type::i32);
     enum class Predefined { ThreadIdx = 0, Total };
     class DeviceBuffer {
       public:
-        const Type type;
+        // pooled buffers are retyped when handed out again
+        Type type;
         DeviceBuffer(Type type) : type(type) {}
         virtual ~DeviceBuffer() = default;
         virtual size_t size() = 0;
         virtual void write(const uint8_t *p, size_t bytes, size_t offset) = 0;
         virtual void read(uint8_t *p, size_t bytes, size_t offset) = 0;
+        // waits for pending writes, the pointer stays valid until unmap
+        virtual const void *map(size_t bytes) = 0;
+        virtual void unmap(const void *p) = 0;
         virtual void *get() = 0;
     };
 
@@ -220,6 +496,32 @@ namespace nagisa {
         }
     };
     /*
+    Read-only view of an evaluated array mapped into host memory, without a copy
+    where the device allows. Keeps the array alive and unmaps it on destruction
+    */
+    template <typename T>
+    class HostSpan {
+        Index index;
+        const T *p = nullptr;
+        size_t n = 0;
+
+      public:
+        HostSpan(const Index &i, size_t n) : index(i), n(n) { p = static_cast<const T *>(nagisa_map(index.i)); }
+        HostSpan(const HostSpan &) = delete;
+        HostSpan &operator=(const HostSpan &) = delete;
+        HostSpan(HostSpan &&rhs) : index(std::move(rhs.index)), p(rhs.p), n(rhs.n) { rhs.p = nullptr; }
+        ~HostSpan() {
+            if (p) {
+                nagisa_unmap(index.i, p);
+            }
+        }
+        const T *data() const { return p; }
+        size_t size() const { return n; }
+        const T &operator[](size_t i) const { return p[i]; }
+        const T *begin() const { return p; }
+        const T *end() const { return p + n; }
+    };
+    /*
     A GPUArray holds an index to the SSA value used in backend
     */
     template <typename Value>
@@ -234,30 +536,51 @@ namespace nagisa {
         size_t _size = 1;
         // std::optional<Buffer<Value>> _buffer;
         mutable std::vector<Value> _buffer;
-        mutable bool need_sync = false;
+        // _buffer is stale, an evaluated var only changes on reassignment or when a Graph is replayed
+        mutable bool need_sync = true;
+        mutable uint64_t synced_epoch = 0;
 
       public:
         static const Type type = get_type<Value>();
+        using value_type = Value;
         using Mask = GPUArray<bool>;
         const Index &index() const { return _index; }
         size_t size() const { return _size; }
         GPUArray(const Value v = Value()) : GPUArray(v, 1) {}
-        GPUArray(const Value v, size_t s) : _size(s) {
+        GPUArray(const Value v, size_t s, bool opaque = false) : _size(s) {
             if constexpr (std::is_integral_v<Value>) {
-                _index = nagisa_trace_append(Instruction::const_int(v), type);
+                _index = nagisa_trace_append(Instruction::const_int((int64_t)v, opaque), type, s);
             } else {
-                _index = nagisa_trace_append(Instruction::const_float(v), type);
+                _index = nagisa_trace_append(Instruction::const_float(v, opaque), type, s);
             }
         }
+        /*
+        Uses the n values at p without copying them where the device allows (always on the CPU backend).
+        The memory has to stay alive and unchanged until this array and every array computed
+        from it is evaluated or destroyed
+        */
+        static GPUArray from_host(const Value *p, size_t n) { return from_index(nagisa_from_host(p, n, type), n); }
+        // copies the n values at p into a buffer of their own, p may be released on return
+        static GPUArray upload(const Value *p, size_t n) { return from_index(nagisa_upload(p, n, type), n); }
+        // n elements in a buffer of their own, left undefined until they are scattered to
+        static GPUArray empty(size_t n) { return from_index(nagisa_empty(n, type), n); }
+        // a scalar whose value is not baked into the kernel, so changing it doesn't trigger a recompile
+        static GPUArray opaque(const Value v, size_t s = 1) { return GPUArray(v, s, true); }
+        // converts the elements to Value as a C cast would
         template <typename U>
         GPUArray(const GPUArray<U> &rhs) {
             _size = rhs._size;
-            _index = rhs._index;
+            if constexpr (get_type<U>() == get_type<Value>()) {
+                _index = rhs._index;
+            } else {
+                _index = nagisa_trace_append(Instruction::unary(Cast, rhs.index()), type, _size);
+            }
         }
         GPUArray(const GPUArray &other) : _index(other._index), _size(other._size) {}
         GPUArray &operator=(const GPUArray &other) {
             _index = (other._index);
             _size = (other._size);
+            need_sync = true;
             return *this;
         }
         static GPUArray from_index(const Index &i, size_t sz) { return GPUArray(i, sz, from_index_tag{}); }
@@ -268,135 +591,173 @@ namespace nagisa {
         }
         GPUArray add_(const GPUArray &rhs) const {
             auto sz = check_size(rhs);
-            auto a = from_index(nagisa_trace_append(Instruction::binary(FAdd, index(), rhs.index()), type), sz);
-            nagisa_set_var_size(a.index(), sz);
-            return a;
+            return from_index(nagisa_trace_append(Instruction::binary(FAdd, index(), rhs.index()), type, sz), sz);
         }
         GPUArray sub_(const GPUArray &rhs) const {
             auto sz = check_size(rhs);
-            auto a = from_index(nagisa_trace_append(Instruction::binary(FSub, index(), rhs.index()), type), sz);
-            nagisa_set_var_size(a.index(), sz);
-            return a;
+            return from_index(nagisa_trace_append(Instruction::binary(FSub, index(), rhs.index()), type, sz), sz);
         }
         GPUArray mul_(const GPUArray &rhs) const {
             auto sz = check_size(rhs);
-            auto a = from_index(nagisa_trace_append(Instruction::binary(FMul, index(), rhs.index()), type), sz);
-            nagisa_set_var_size(a.index(), sz);
-            return a;
+            return from_index(nagisa_trace_append(Instruction::binary(FMul, index(), rhs.index()), type, sz), sz);
         }
         GPUArray div_(const GPUArray &rhs) const {
             auto sz = check_size(rhs);
-            auto a = from_index(nagisa_trace_append(Instruction::binary(FDiv, index(), rhs.index()), type), sz);
-            nagisa_set_var_size(a.index(), sz);
-            return a;
+            return from_index(nagisa_trace_append(Instruction::binary(FDiv, index(), rhs.index()), type, sz), sz);
         }
         GPUArray mod_(const GPUArray &rhs) const {
             auto sz = check_size(rhs);
-            auto a = from_index(nagisa_trace_append(Instruction::binary(Mod, index(), rhs.index()), type), sz);
-            nagisa_set_var_size(a.index(), sz);
-            return a;
+            return from_index(nagisa_trace_append(Instruction::binary(Mod, index(), rhs.index()), type, sz), sz);
         }
         Mask lt_(const GPUArray &rhs) const {
             auto sz = check_size(rhs);
-            auto a =
-                Mask::from_index(nagisa_trace_append(Instruction::binary(CmpLt, index(), rhs.index()), Mask::type), sz);
-            nagisa_set_var_size(a.index(), sz);
-            return a;
+            return Mask::from_index(
+                nagisa_trace_append(Instruction::binary(CmpLt, index(), rhs.index()), Mask::type, sz), sz);
         }
         Mask le_(const GPUArray &rhs) const {
             auto sz = check_size(rhs);
-            auto a =
-                Mask::from_index(nagisa_trace_append(Instruction::binary(CmpLe, index(), rhs.index()), Mask::type), sz);
-            nagisa_set_var_size(a.index(), sz);
-            return a;
+            return Mask::from_index(
+                nagisa_trace_append(Instruction::binary(CmpLe, index(), rhs.index()), Mask::type, sz), sz);
         }
         GPUArray<bool> gt_(const GPUArray &rhs) const {
             auto sz = check_size(rhs);
-            auto a =
-                Mask::from_index(nagisa_trace_append(Instruction::binary(CmpGt, index(), rhs.index()), Mask::type), sz);
-            nagisa_set_var_size(a.index(), sz);
-            return a;
+            return Mask::from_index(
+                nagisa_trace_append(Instruction::binary(CmpGt, index(), rhs.index()), Mask::type, sz), sz);
         }
         GPUArray<bool> ge_(const GPUArray &rhs) const {
             auto sz = check_size(rhs);
-            auto a =
-                Mask::from_index(nagisa_trace_append(Instruction::binary(CmpGe, index(), rhs.index()), Mask::type), sz);
-            nagisa_set_var_size(a.index(), sz);
-            return a;
+            return Mask::from_index(
+                nagisa_trace_append(Instruction::binary(CmpGe, index(), rhs.index()), Mask::type, sz), sz);
         }
         GPUArray<bool> eq_(const GPUArray &rhs) const {
             auto sz = check_size(rhs);
-            auto a =
-                Mask::from_index(nagisa_trace_append(Instruction::binary(CmpEq, index(), rhs.index()), Mask::type), sz);
-            nagisa_set_var_size(a.index(), sz);
-            return a;
+            return Mask::from_index(
+                nagisa_trace_append(Instruction::binary(CmpEq, index(), rhs.index()), Mask::type, sz), sz);
         }
         GPUArray<bool> ne_(const GPUArray &rhs) const {
             auto sz = check_size(rhs);
-            auto a =
-                Mask::from_index(nagisa_trace_append(Instruction::binary(CmpNe, index(), rhs.index()), Mask::type), sz);
-            nagisa_set_var_size(a.index(), sz);
-            return a;
+            return Mask::from_index(
+                nagisa_trace_append(Instruction::binary(CmpNe, index(), rhs.index()), Mask::type, sz), sz);
+        }
+        GPUArray operator-() const {
+            return from_index(nagisa_trace_append(Instruction::unary(Neg, index()), type, size()), size());
         }
-        GPUArray operator-() const { return GPUArray(Value(-1)) * (*this); }
         friend GPUArray sin(const GPUArray &v) {
-            auto a = GPUArray::from_index(nagisa_trace_append(Instruction::unary(Sin, v.index()), GPUArray::type), sz);
-            nagisa_set_var_size(a.index(), v.size());
-            return a;
+            return GPUArray::from_index(
+                nagisa_trace_append(Instruction::unary(Sin, v.index()), GPUArray::type, v.size()), v.size());
         }
         friend GPUArray cos(const GPUArray &v) {
-            auto a = GPUArray::from_index(nagisa_trace_append(Instruction::unary(Cos, v.index()), GPUArray::type), v.size());
-            nagisa_set_var_size(a.index(), v.size());
-            return a;
+            return GPUArray::from_index(
+                nagisa_trace_append(Instruction::unary(Cos, v.index()), GPUArray::type, v.size()), v.size());
         }
         friend GPUArray sqrt(const GPUArray &v) {
-            auto a = GPUArray::from_index(nagisa_trace_append(Instruction::unary(Sqrt, v.index()), GPUArray::type), v.size());
-            nagisa_set_var_size(a.index(), v.size());
-            return a;
+            return GPUArray::from_index(
+                nagisa_trace_append(Instruction::unary(Sqrt, v.index()), GPUArray::type, v.size()), v.size());
         }
+        // any of cond, a and b may be a single element broadcast over the others
         static GPUArray select_(const Mask &cond, const GPUArray &a, const GPUArray &b) {
-            auto sz = a.check_size(cond);
-            NGS_ASSERT(sz == b.check_size(cond));
-            auto o = from_index(
-                nagisa_trace_append(Instruction::ternary(Select, cond.index(), a.index(), b.index()), a.type), sz);
-            nagisa_set_var_size(o.index(), sz);
-            return o;
+            auto sz = std::max(a.check_size(cond), b.check_size(cond));
+            NGS_ASSERT(a.check_size(b) == std::max(a.size(), b.size()));
+            return from_index(
+                nagisa_trace_append(Instruction::ternary(Select, cond.index(), a.index(), b.index()), a.type, sz), sz);
         }
         static GPUArray range_(size_t count) {
-            GPUArray a;
-            a._size = count;
-            a._index = (int)Predefined::ThreadIdx;
-            nagisa_set_var_size(a._index, count);
-            return a;
+            if constexpr (std::is_integral_v<Value>) {
+                return from_index(nagisa_range(count, type), count);
+            } else {
+                return GPUArray(GPUArray<int32_t>::range_(count));
+            }
         }
-        // template <size_t Stride>
-        // template <typename I, typename M>
-        // static void store(const GPUArray &buffer, const I &idx, const M &mask, const GPUArray &value) {
-        //     (void)nagisa_trace_append(
-        //         Instruction::store(nagisa_buffer_id(buffer.index()), idx.index(), value.index(), mask.index()),
-        //         Type::none);
-        // }
-
+        // folds every lane of v, the result holds a single element that stays on the device
+        template <typename U>
+        static GPUArray reduce_(Opcode op, const GPUArray<U> &v) {
+            // the var runs over the lanes of v
+            return from_index(nagisa_trace_append(Instruction::unary(op, v.index()), type, v.size()), 1);
+        }
+        // lanes where mask is false read 0
         template <typename I>
-        GPUArray load(const Mask &mask, const GPUArray<I> &index) {
-            auto a = from_index(
-                nagisa_trace_append(Instruction::ternary(Load, value.index(), mask.index(), index.index()), type));
-            a._size = index.size();
-            nagisa_set_var_size(a.index(), index.size());
-            return a;
+        GPUArray gather(const GPUArray<I> &index, const Mask &mask = Mask(true)) const {
+            auto sz = index.check_size(mask);
+            if (size() == 1) {
+                // broadcast over the lanes of index rather than reading from a single element
+                return select_(mask, *this, GPUArray(Value(), sz));
+            }
+            return from_index(
+                nagisa_trace_append(Instruction::ternary(Load, this->index(), mask.index(), index.index()), type, sz),
+                sz);
+        }
+        template <typename I>
+        GPUArray load(const Mask &mask, const GPUArray<I> &index) const {
+            return gather(index, mask);
+        }
+        template <typename I>
+        void scatter(const GPUArray<I> &index, const GPUArray &value, const Mask &mask = Mask(true), bool add = false) {
+            auto sz = std::max({index.size(), value.size(), mask.size()});
+            NGS_ASSERT(index.size() == sz && (value.size() == 1 || value.size() == sz));
+            NGS_ASSERT(mask.size() == 1 || mask.size() == sz);
+            Index result = nagisa_scatter(this->index(), index.index(), value.index(), mask.index(), sz, add);
+            *this = from_index(result, _size);
         }
         void sync() const {
-            _buffer.resize(_size);
-            nagisa_copy_to_host(index(), _buffer.data());
+            if (!need_sync && synced_epoch == nagisa_graph_epoch()) {
+                return;
+            }
+            if constexpr (std::is_same_v<Value, bool>) {
+                // vector<bool> is packed, booleans are stored one per byte
+                std::vector<uint8_t> bytes(_size);
+                nagisa_copy_to_host(index(), bytes.data());
+                _buffer.assign(bytes.begin(), bytes.end());
+            } else {
+                _buffer.resize(_size);
+                nagisa_copy_to_host(index(), _buffer.data());
+            }
+            need_sync = false;
+            synced_epoch = nagisa_graph_epoch();
         }
+        // the evaluated contents without a copy, prefer it over data() for large arrays
+        HostSpan<Value> map() const { return HostSpan<Value>(index(), _size); }
         const std::vector<Value> &data() const {
             sync();
             return _buffer;
         }
     };
+    // source[index] where mask is set, 0 elsewhere
+    template <typename Value, typename I>
+    GPUArray<Value> gather(const GPUArray<Value> &source, const GPUArray<I> &index,
+                           const GPUArray<bool> &mask = GPUArray<bool>(true)) {
+        return source.gather(index, mask);
+    }
+    /*
+    target[index] = value where mask is set. Lanes storing to the same element race
+    and one of them wins. Copies that share target with others are left untouched
+    */
+    template <typename Value, typename I>
+    void scatter(GPUArray<Value> &target, const GPUArray<I> &index, const GPUArray<Value> &value,
+                 const GPUArray<bool> &mask = GPUArray<bool>(true)) {
+        target.scatter(index, value, mask);
+    }
+    // target[index] += value where mask is set, atomic so colliding lanes all count
+    template <typename Value, typename I>
+    void scatter_add(GPUArray<Value> &target, const GPUArray<I> &index, const GPUArray<Value> &value,
+                     const GPUArray<bool> &mask = GPUArray<bool>(true)) {
+        static_assert(!std::is_same_v<Value, bool> && !std::is_same_v<Value, half>,
+                      "scatter_add needs an arithmetic type that is not a storage type");
+        target.scatter(index, value, mask, true);
+    }
     template <typename Value, typename Index, typename Mask>
-    void store(const GPUArray<Value> &buffer, const Index &idx, const Mask &m, const GPUArray<Value> &v) {
-        GPUArray<Value>::store(buffer, idx, m, v);
+    void store(GPUArray<Value> &buffer, const Index &idx, const Mask &m, const GPUArray<Value> &v) {
+        scatter(buffer, idx, v, m);
+    }
+    // writes the arrays into buffers at the next nagisa_eval, see nagisa_set_ops_per_byte
+    template <typename... Ts>
+    void schedule(const GPUArray<Ts> &...xs) {
+        (nagisa_schedule(xs.index()), ...);
+    }
+    // evaluates everything pending, writing the arrays into buffers
+    template <typename... Ts>
+    void eval(const GPUArray<Ts> &...xs) {
+        schedule(xs...);
+        nagisa_eval();
     }
 
     template <class Array>
@@ -413,23 +774,36 @@ namespace nagisa {
     struct is_array : std::false_type {};
     template <typename T>
     struct is_array<GPUArray<T>> : std::true_type {};
+    // half values are computed in single precision
+    template <typename T>
+    using compute_t = std::conditional_t<std::is_same_v<T, half>, float, T>;
+    // arrays of T1 and T2 are combined in their common type, as C++ would
+    template <typename T1, typename T2>
+    using promote_t = std::common_type_t<compute_t<T1>, compute_t<T2>>;
+    // a scalar takes the type of the array it is combined with, unless it brings floats to an integer array
+    template <typename T, typename S>
+    using promote_scalar_t =
+        std::conditional_t<std::is_floating_point_v<S> && !std::is_floating_point_v<compute_t<T>>, float, compute_t<T>>;
 #define NGS_OP(op, func)                                                                                               \
     template <typename T1, typename T2>                                                                                \
     auto operator op(const GPUArray<T1> &a, const GPUArray<T2> &b) {                                                   \
-        using R = decltype(std::declval<T1>() op std::declval<T2>());                                                  \
-        GPUArray<R> r = a.func(b);                                                                                     \
+        using C = promote_t<T1, T2>;                                                                                   \
+        using R = decltype(std::declval<C>() op std::declval<C>());                                                    \
+        GPUArray<R> r = GPUArray<C>(a).func(GPUArray<C>(b));                                                           \
         return r;                                                                                                      \
     }                                                                                                                  \
     template <typename T1, typename T2, typename = std::enable_if_t<!is_array<T2>::value>>                             \
     auto operator op(const GPUArray<T1> &a, const T2 &b) {                                                             \
-        using R = decltype(std::declval<T1>() op std::declval<T2>());                                                  \
-        GPUArray<R> r = a.func(GPUArray<T1>(b));                                                                       \
+        using C = promote_scalar_t<T1, T2>;                                                                            \
+        using R = decltype(std::declval<C>() op std::declval<C>());                                                    \
+        GPUArray<R> r = GPUArray<C>(a).func(GPUArray<C>((C)b));                                                        \
         return r;                                                                                                      \
     }                                                                                                                  \
     template <typename T1, typename T2, typename = std::enable_if_t<!is_array<T1>::value>>                             \
     auto operator op(const T1 &a, const GPUArray<T2> &b) {                                                             \
-        using R = decltype(std::declval<T1>() op std::declval<T2>());                                                  \
-        GPUArray<R> r = GPUArray<T1>(a).func(GPUArray<T2>(b));                                                         \
+        using C = promote_scalar_t<T2, T1>;                                                                            \
+        using R = decltype(std::declval<C>() op std::declval<C>());                                                    \
+        GPUArray<R> r = GPUArray<C>((C)a).func(GPUArray<C>(b));                                                        \
         return r;                                                                                                      \
     }
     NGS_OP(+, add_)
@@ -443,4 +817,475 @@ namespace nagisa {
     NGS_OP(==, eq_)
     NGS_OP(!=, ne_)
     NGS_OP(%, mod_)
-} // namespace nagisa
\ No newline at end of file
+    // the elements of v converted to T as a C cast would
+    template <typename T, typename U>
+    GPUArray<T> cast(const GPUArray<U> &v) {
+        return GPUArray<T>(v);
+    }
+    // horizontal reductions, the single element result can be used by later traces without a host sync
+    template <typename Value>
+    GPUArray<Value> hsum(const GPUArray<Value> &v) {
+        static_assert(!std::is_same_v<Value, bool>, "use count() on masks");
+        static_assert(!std::is_same_v<Value, half>, "reduce cast<float>() of a half array");
+        return GPUArray<Value>::reduce_(ReduceAdd, v);
+    }
+    template <typename Value>
+    GPUArray<Value> hmax(const GPUArray<Value> &v) {
+        static_assert(!std::is_same_v<Value, bool>, "use any() on masks");
+        static_assert(!std::is_same_v<Value, half>, "reduce cast<float>() of a half array");
+        return GPUArray<Value>::reduce_(ReduceMax, v);
+    }
+    template <typename Value>
+    GPUArray<Value> hmin(const GPUArray<Value> &v) {
+        static_assert(!std::is_same_v<Value, bool>, "use all() on masks");
+        static_assert(!std::is_same_v<Value, half>, "reduce cast<float>() of a half array");
+        return GPUArray<Value>::reduce_(ReduceMin, v);
+    }
+    /*
+    Records cond and body once and runs them as a loop inside the kernel, each lane until its cond is false.
+    state lists every array the body assigns to, anything else the body reads is loop invariant.
+    Recorded code can't evaluate: gathers need an evaluated source, scatters and reductions are not allowed
+    */
+    template <class... Ts, class Cond, class Body>
+    void loop(std::tuple<GPUArray<Ts> &...> state, Cond &&cond, Body &&body) {
+        constexpr size_t n = sizeof...(Ts);
+        std::array<int, n> vars{}, phis{};
+        size_t size = 1;
+        std::apply([&](auto &...s) { size = std::max({size, s.size()...}); }, state);
+        std::apply([&](auto &...s) { vars = {s.index().i...}; }, state);
+        nagisa_loop_begin(vars.data(), phis.data(), n, size);
+        std::apply([&](auto &...s) {
+            size_t k = 0;
+            ((s = std::decay_t<decltype(s)>::from_index(phis[k++], size)), ...);
+        }, state);
+        Mask c = cond();
+        nagisa_loop_cond(c.index().i);
+        body();
+        // lanes diverge as soon as the condition or the body depends on them
+        std::apply([&](auto &...s) { size = std::max({size, c.size(), s.size()...}); }, state);
+        std::apply([&](auto &...s) { vars = {s.index().i...}; }, state);
+        nagisa_region_end(vars.data(), n, size);
+        std::apply([&](auto &...s) {
+            size_t k = 0;
+            ((s = std::decay_t<decltype(s)>::from_index(vars[k++], size)), ...);
+        }, state);
+    }
+    // runs body only for the lanes where cond is set, the state arrays keep their value elsewhere
+    template <class... Ts, class Body>
+    void if_(const Mask &cond, std::tuple<GPUArray<Ts> &...> state, Body &&body) {
+        constexpr size_t n = sizeof...(Ts);
+        std::array<int, n> vars{};
+        size_t size = cond.size();
+        std::apply([&](auto &...s) { size = std::max({size, s.size()...}); }, state);
+        std::apply([&](auto &...s) { vars = {s.index().i...}; }, state);
+        nagisa_if_begin(cond.index().i, vars.data(), n, size);
+        body();
+        std::apply([&](auto &...s) { size = std::max({size, s.size()...}); }, state);
+        std::apply([&](auto &...s) { vars = {s.index().i...}; }, state);
+        nagisa_region_end(vars.data(), n, size);
+        std::apply([&](auto &...s) {
+            size_t k = 0;
+            ((s = std::decay_t<decltype(s)>::from_index(vars[k++], size)), ...);
+        }, state);
+    }
+    // element i sums v[0, i), or v[0, i] if exclusive is false
+    template <typename Value>
+    GPUArray<Value> prefix_sum(const GPUArray<Value> &v, bool exclusive = true) {
+        static_assert(!std::is_same_v<Value, bool> && !std::is_same_v<Value, half>,
+                      "prefix_sum needs an arithmetic type");
+        return GPUArray<Value>::from_index(nagisa_prefix_sum(v.index(), v.size(), exclusive), v.size());
+    }
+    /*
+    Indices of the set lanes of m in increasing order, for running later traces over the active lanes only.
+    Reads the number of set lanes back to the host
+    */
+    inline GPUArray<int32_t> compress(const Mask &m) {
+        using Int = GPUArray<int32_t>;
+        auto n = m.size();
+        if (n == 0) {
+            return Int::empty(0);
+        }
+        Int slot = prefix_sum(select(m, Int(1, n), Int(0, n)), false);
+        int32_t total = slot.gather(Int((int32_t)n - 1)).data()[0];
+        Int indices = Int::empty((size_t)total);
+        scatter(indices, slot - 1, range<Int>(n), m);
+        return indices;
+    }
+    // number of set lanes
+    inline GPUArray<int32_t> count(const Mask &m) { return GPUArray<int32_t>::reduce_(ReduceAdd, m); }
+    // false for an empty mask
+    inline Mask any(const Mask &m) { return GPUArray<int32_t>::reduce_(ReduceMax, m) > 0; }
+    // true for an empty mask
+    inline Mask all(const Mask &m) { return GPUArray<int32_t>::reduce_(ReduceMin, m) > 0; }
+
+    // a parameter or the result of a Function
+    template <typename T>
+    using Var = GPUArray<T>;
+    // N values of T, how a vectorized Function takes and returns its values
+    template <typename T, size_t N>
+    struct vec {
+        using value_type = T;
+        static constexpr size_t size = N;
+        T v[N];
+        T &operator[](size_t i) { return v[i]; }
+        const T &operator[](size_t i) const { return v[i]; }
+    };
+    template <typename Sig>
+    class Function;
+    /*
+    Records f once over Var parameters and builds it with the host compiler into a native function,
+    which runs without the runtime or a launch. compile() gives a R(*)(Args...) and vectorize<N>().compile()
+    a function over N lanes of each value. f can't read evaluated arrays, scatter or reduce.
+    The pointers stay valid while the Function, or any copy or Vectorized made from it, lives
+    */
+    template <typename R, typename... Args>
+    class Function<Var<R>(Var<Args>...)> {
+        std::function<Var<R>(Var<Args>...)> f;
+        // the functions built so far by their number of lanes, shared by every copy
+        std::shared_ptr<std::vector<std::pair<size_t, NativeFunction>>> built =
+            std::make_shared<std::vector<std::pair<size_t, NativeFunction>>>();
+
+        template <size_t... I>
+        void *compile_(size_t lanes, std::index_sequence<I...>) const {
+            for (auto &[n, native] : *built) {
+                if (n == lanes) {
+                    return native.fn;
+                }
+            }
+            std::array<Type, sizeof...(Args)> types{get_type<Args>()...};
+            std::array<int, sizeof...(Args)> args{};
+            nagisa_function_begin(types.data(), args.data(), args.size());
+            Var<R> r = f(Var<Args>::from_index(args[I], lanes)...);
+            built->emplace_back(lanes, nagisa_function_end(r.index().i, lanes));
+            return built->back().second.fn;
+        }
+
+      public:
+        template <size_t N>
+        class Vectorized {
+            Function fn;
+
+          public:
+            explicit Vectorized(Function fn) : fn(std::move(fn)) {}
+            auto compile() const {
+                using Fn = vec<R, N> (*)(vec<Args, N>...);
+                return reinterpret_cast<Fn>(fn.compile_(N, std::index_sequence_for<Args...>{}));
+            }
+        };
+        template <typename F>
+        explicit Function(F f) : f(std::move(f)) {}
+        auto compile() const {
+            using Fn = R (*)(Args...);
+            return reinterpret_cast<Fn>(compile_(1, std::index_sequence_for<Args...>{}));
+        }
+        template <size_t N>
+        Vectorized<N> vectorize() const {
+            static_assert(N > 0, "a vectorized Function needs at least one lane");
+            return Vectorized<N>(*this);
+        }
+    };
+    template <typename R, typename... Args>
+    Function(Var<R> (*)(Var<Args>...)) -> Function<Var<R>(Var<Args>...)>;
+    /*
+    A sequence of evals recorded once and replayed without tracing, scheduling or generating code.
+    capture(f, inputs...) runs f, which may evaluate and read back as usual, and records the kernels it launches.
+    replay(args...) launches them again with each input rebound to the matching argument, an array of the same
+    type and size; size-1 inputs act as scalar parameters. Everything else keeps the buffers it had when captured:
+    the arrays f computed are overwritten in place by every replay, so their new contents are read from the same
+    Vars. Host reads inside f are not replayed, and host memory behind from_host arrays has to outlive the graph
+    */
+    class Graph {
+        std::shared_ptr<const int> id;
+
+      public:
+        Graph() = default;
+        explicit Graph(int graph)
+            : id(new int(graph), [](const int *p) {
+                  nagisa_graph_free(*p);
+                  delete p;
+              }) {}
+        template <typename... Ts>
+        void replay(const GPUArray<Ts> &...args) const {
+            std::array<int, sizeof...(Ts)> idx{args.index().i...};
+            nagisa_graph_replay(*id, idx.data(), idx.size());
+        }
+    };
+    template <typename F, typename... Ts>
+    Graph capture(F &&f, const GPUArray<Ts> &...inputs) {
+        std::array<int, sizeof...(Ts)> idx{inputs.index().i...};
+        nagisa_capture_begin(idx.data(), idx.size());
+        f();
+        return Graph(nagisa_capture_end());
+    }
+    // a context of its own for the calling thread while in scope, declared before the arrays it holds
+    class ThreadContext {
+        Context *c, *prev;
+
+      public:
+        ThreadContext() : c(nagisa_create_context()), prev(nagisa_set_context(c)) {}
+        ThreadContext(const ThreadContext &) = delete;
+        ThreadContext &operator=(const ThreadContext &) = delete;
+        ~ThreadContext() {
+            nagisa_set_context(prev);
+            nagisa_destroy_context(c);
+        }
+    };
+
+    template <typename T>
+    struct is_vec : std::false_type {};
+    template <typename T, size_t N>
+    struct is_vec<vec<T, N>> : std::true_type {};
+    // the tuple of references to the fields of an NGS_STRUCT
+    template <typename T>
+    using fields_t = decltype(nagisa_fields(std::declval<T &>()));
+    /*
+    soa_t<T> is the traced counterpart of a host type: GPUArray<T> for a scalar, vec<soa_t<T>, N> for a vec
+    and the struct of arrays NGS_STRUCT declares for a reflected struct
+    */
+    template <typename T, typename = void>
+    struct soa {
+        using type = decltype(nagisa_soa_of(std::declval<const T *>()));
+    };
+    template <typename T>
+    struct soa<T, std::enable_if_t<std::is_arithmetic_v<T>>> {
+        using type = GPUArray<T>;
+    };
+    template <typename T, size_t N>
+    struct soa<vec<T, N>> {
+        using type = vec<typename soa<T>::type, N>;
+    };
+    template <typename T>
+    using soa_t = typename soa<T>::type;
+    // type of the first scalar of T
+    template <typename T, typename = void>
+    struct leaf {
+        using type = typename leaf<std::remove_reference_t<std::tuple_element_t<0, fields_t<T>>>>::type;
+    };
+    template <typename T>
+    struct leaf<T, std::enable_if_t<std::is_arithmetic_v<T>>> {
+        using type = T;
+    };
+    template <typename T, size_t N>
+    struct leaf<vec<T, N>> {
+        using type = typename leaf<T>::type;
+    };
+    // whether every scalar of T is an S
+    template <typename S, typename T>
+    constexpr bool leaves_are();
+    template <typename S, typename... Fs>
+    constexpr bool fields_are(std::tuple<Fs...> *) {
+        return (leaves_are<S, std::remove_reference_t<Fs>>() && ...);
+    }
+    template <typename S, typename T>
+    constexpr bool leaves_are() {
+        if constexpr (std::is_arithmetic_v<T>) {
+            return std::is_same_v<T, S>;
+        } else if constexpr (is_vec<T>::value) {
+            return leaves_are<S, typename T::value_type>();
+        } else {
+            return fields_are<S>((fields_t<T> *)nullptr);
+        }
+    }
+
+    template <typename F, typename T, typename... Ts>
+    void for_each_leaf(F &&f, T &x, Ts &...xs);
+    template <size_t I, typename F, typename T, typename... Ts>
+    void for_field(F &f, T &x, Ts &...xs) {
+        for_each_leaf(f, std::get<I>(nagisa_fields(x)), std::get<I>(nagisa_fields(xs))...);
+    }
+    template <size_t... I, typename F, typename T, typename... Ts>
+    void for_each_field(std::index_sequence<I...>, F &f, T &x, Ts &...xs) {
+        (for_field<I>(f, x, xs...), ...);
+    }
+    /*
+    Calls f on the scalars (or arrays) of x in declaration order, vec elements one by one, along with
+    the matching leaves of xs, which have the same shape as x
+    */
+    template <typename F, typename T, typename... Ts>
+    void for_each_leaf(F &&f, T &x, Ts &...xs) {
+        using U = std::remove_const_t<T>;
+        if constexpr (std::is_arithmetic_v<U> || is_array<U>::value) {
+            f(x, xs...);
+        } else if constexpr (is_vec<U>::value) {
+            for (size_t i = 0; i < U::size; i++) {
+                for_each_leaf(f, x.v[i], xs.v[i]...);
+            }
+        } else {
+            for_each_field(std::make_index_sequence<std::tuple_size_v<fields_t<U>>>{}, f, x, xs...);
+        }
+    }
+
+    enum class Layout {
+        // an array per scalar of the struct
+        soa,
+        // the scalars of an element next to each other, a vec<float, 3> is read as a float3
+        aos,
+        // aos padded to a multiple of 4 scalars, a vec<float, 3> is read as a float4
+        aos4
+    };
+    /*
+    n elements of a host struct T (declared with NGS_STRUCT) in device memory, gathered and scattered
+    a whole struct at a time as a soa_t<T>. The aos layouts keep the scalars of an element in a single
+    buffer, which needs all of them to have the same type, and scatter into it one scalar at a time
+    */
+    template <typename T>
+    class StructArray {
+        using Scalar = typename leaf<T>::type;
+        // whether the aos layouts are available
+        static constexpr bool uniform = leaves_are<Scalar, T>();
+        using Int = GPUArray<int32_t>;
+        Layout _layout = Layout::soa;
+        size_t _size = 0;
+        // scalars per element in the aos layouts
+        size_t stride = 0;
+        // the arrays of Layout::soa
+        soa_t<T> fields;
+        // the single buffer of the aos layouts
+        GPUArray<Scalar> packed;
+
+        static size_t num_leaves() {
+            T t{};
+            size_t n = 0;
+            for_each_leaf([&](const auto &) { n++; }, t);
+            return n;
+        }
+
+      public:
+        using Value = soa_t<T>;
+        // copies the n elements at p to the device, p may be released on return
+        static StructArray upload(const T *p, size_t n, Layout layout = Layout::soa) {
+            StructArray a;
+            a._layout = layout;
+            a._size = n;
+            size_t leaves = num_leaves();
+            if (layout == Layout::soa) {
+                std::vector<std::vector<uint8_t>> staging(leaves);
+                for (size_t i = 0; i < n; i++) {
+                    size_t k = 0;
+                    for_each_leaf(
+                        [&](const auto &x) {
+                            staging[k].resize(n * sizeof(x));
+                            std::memcpy(staging[k].data() + i * sizeof(x), &x, sizeof(x));
+                            k++;
+                        },
+                        p[i]);
+                }
+                size_t k = 0;
+                for_each_leaf(
+                    [&](auto &field) {
+                        using A = std::remove_reference_t<decltype(field)>;
+                        using V = typename A::value_type;
+                        field = A::upload(reinterpret_cast<const V *>(staging[k++].data()), n);
+                    },
+                    a.fields);
+            } else if constexpr (uniform) {
+                a.stride = layout == Layout::aos4 ? (leaves + 3) / 4 * 4 : leaves;
+                std::vector<Scalar> staging(n * a.stride, Scalar());
+                for (size_t i = 0; i < n; i++) {
+                    size_t k = 0;
+                    for_each_leaf([&](const Scalar &x) { staging[i * a.stride + k++] = x; }, p[i]);
+                }
+                a.packed = GPUArray<Scalar>::upload(staging.data(), staging.size());
+            } else {
+                fprintf(stderr, "the aos layouts need every scalar of the struct to have the same type\n");
+                exit(1);
+            }
+            return a;
+        }
+        size_t size() const { return _size; }
+        Layout layout() const { return _layout; }
+        // the elements at index where mask is set, zero elsewhere
+        Value gather(const Int &index, const Mask &mask = Mask(true)) const {
+            Value r;
+            if (_layout == Layout::soa) {
+                for_each_leaf([&](auto &out, const auto &field) { out = field.gather(index, mask); }, r, fields);
+            } else if constexpr (uniform) {
+                Int base = index * (int32_t)stride;
+                int32_t k = 0;
+                for_each_leaf([&](auto &out) { out = packed.gather(base + k++, mask); }, r);
+            }
+            return r;
+        }
+        // stores value to the elements at index where mask is set
+        void scatter(const Int &index, const Value &value, const Mask &mask = Mask(true)) {
+            if (_layout == Layout::soa) {
+                for_each_leaf([&](auto &field, const auto &v) { field.scatter(index, v, mask); }, fields, value);
+            } else if constexpr (uniform) {
+                Int base = index * (int32_t)stride;
+                int32_t k = 0;
+                for_each_leaf([&](const auto &v) { packed.scatter(base + k++, v, mask); }, value);
+            }
+        }
+        std::vector<T> to_host() const {
+            std::vector<T> r(_size);
+            if (_layout == Layout::soa) {
+                for (size_t i = 0; i < _size; i++) {
+                    for_each_leaf([&](auto &x, const auto &field) { x = field.data()[i]; }, r[i], fields);
+                }
+            } else if constexpr (uniform) {
+                const auto &data = packed.data();
+                for (size_t i = 0; i < _size; i++) {
+                    size_t k = 0;
+                    for_each_leaf([&](Scalar &x) { x = data[i * stride + k++]; }, r[i]);
+                }
+            }
+            return r;
+        }
+    };
+    template <typename T>
+    soa_t<T> gather(const StructArray<T> &source, const GPUArray<int32_t> &index,
+                    const GPUArray<bool> &mask = GPUArray<bool>(true)) {
+        return source.gather(index, mask);
+    }
+    template <typename T>
+    void scatter(StructArray<T> &target, const GPUArray<int32_t> &index, const soa_t<T> &value,
+                 const GPUArray<bool> &mask = GPUArray<bool>(true)) {
+        target.scatter(index, value, mask);
+    }
+} // namespace nagisa
+
+#define NGS_EXPAND(x) x
+#define NGS_FE_1(m, a, x) m(a, x)
+#define NGS_FE_2(m, a, x, ...) m(a, x) NGS_EXPAND(NGS_FE_1(m, a, __VA_ARGS__))
+#define NGS_FE_3(m, a, x, ...) m(a, x) NGS_EXPAND(NGS_FE_2(m, a, __VA_ARGS__))
+#define NGS_FE_4(m, a, x, ...) m(a, x) NGS_EXPAND(NGS_FE_3(m, a, __VA_ARGS__))
+#define NGS_FE_5(m, a, x, ...) m(a, x) NGS_EXPAND(NGS_FE_4(m, a, __VA_ARGS__))
+#define NGS_FE_6(m, a, x, ...) m(a, x) NGS_EXPAND(NGS_FE_5(m, a, __VA_ARGS__))
+#define NGS_FE_7(m, a, x, ...) m(a, x) NGS_EXPAND(NGS_FE_6(m, a, __VA_ARGS__))
+#define NGS_FE_8(m, a, x, ...) m(a, x) NGS_EXPAND(NGS_FE_7(m, a, __VA_ARGS__))
+#define NGS_FE_9(m, a, x, ...) m(a, x) NGS_EXPAND(NGS_FE_8(m, a, __VA_ARGS__))
+#define NGS_FE_10(m, a, x, ...) m(a, x) NGS_EXPAND(NGS_FE_9(m, a, __VA_ARGS__))
+#define NGS_FE_11(m, a, x, ...) m(a, x) NGS_EXPAND(NGS_FE_10(m, a, __VA_ARGS__))
+#define NGS_FE_12(m, a, x, ...) m(a, x) NGS_EXPAND(NGS_FE_11(m, a, __VA_ARGS__))
+#define NGS_FE_13(m, a, x, ...) m(a, x) NGS_EXPAND(NGS_FE_12(m, a, __VA_ARGS__))
+#define NGS_FE_14(m, a, x, ...) m(a, x) NGS_EXPAND(NGS_FE_13(m, a, __VA_ARGS__))
+#define NGS_FE_15(m, a, x, ...) m(a, x) NGS_EXPAND(NGS_FE_14(m, a, __VA_ARGS__))
+#define NGS_FE_16(m, a, x, ...) m(a, x) NGS_EXPAND(NGS_FE_15(m, a, __VA_ARGS__))
+#define NGS_FE_PICK(_1, _2, _3, _4, _5, _6, _7, _8, _9, _10, _11, _12, _13, _14, _15, _16, name, ...) name
+// m(a, x) for each x of up to 16 arguments
+#define NGS_FOR_EACH(m, a, ...)                                                                                        \
+    NGS_EXPAND(NGS_FE_PICK(__VA_ARGS__, NGS_FE_16, NGS_FE_15, NGS_FE_14, NGS_FE_13, NGS_FE_12, NGS_FE_11, NGS_FE_10, \
+                           NGS_FE_9, NGS_FE_8, NGS_FE_7, NGS_FE_6, NGS_FE_5, NGS_FE_4, NGS_FE_3, NGS_FE_2,             \
+                           NGS_FE_1)(m, a, __VA_ARGS__))
+#define NGS_SOA_FIELD(Name, x) ::nagisa::soa_t<decltype(Name::x)> x;
+#define NGS_TIE_FIELD(s, x) , std::tie(s.x)
+#define NGS_FIELDS(Type, ...)                                                                                          \
+    inline auto nagisa_fields(Type &s) {                                                                               \
+        return std::tuple_cat(std::tuple<>() NGS_FOR_EACH(NGS_TIE_FIELD, s, __VA_ARGS__));                             \
+    }                                                                                                                  \
+    inline auto nagisa_fields(const Type &s) {                                                                         \
+        return std::tuple_cat(std::tuple<>() NGS_FOR_EACH(NGS_TIE_FIELD, s, __VA_ARGS__));                             \
+    }
+/*
+Reflects the listed fields (scalars, vecs or other NGS_STRUCTs) of a struct declared in the current namespace,
+for StructArray and NGS_VECTORIZE_STRUCT. Place it right after the struct, at namespace scope
+*/
+#define NGS_STRUCT(Name, ...)                                                                                          \
+    struct nagisa_soa_##Name {                                                                                         \
+        NGS_FOR_EACH(NGS_SOA_FIELD, Name, __VA_ARGS__)                                                                 \
+    };                                                                                                                 \
+    NGS_FIELDS(Name, __VA_ARGS__)                                                                                      \
+    NGS_FIELDS(nagisa_soa_##Name, __VA_ARGS__)                                                                         \
+    nagisa_soa_##Name nagisa_soa_of(const Name *)
+// names the traced struct of arrays of an NGS_STRUCT, whose fields are the soa_t of the host fields
+#define NGS_VECTORIZE_STRUCT(TName, Name) using TName = nagisa_soa_##Name
\ No newline at end of file
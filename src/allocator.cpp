@@ -0,0 +1,116 @@
+// MIT License
+//
+// Copyright (c) 2020 椎名深雪
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include "allocator.h"
+#include "profiler.h"
+#include <algorithm>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <sys/mman.h>
+#include <unistd.h>
+namespace nagisa {
+    BufferAllocator::BufferAllocator(Backend *backend) : backend(backend) {
+        high_water = size_t(1) << 30;
+        if (auto env = std::getenv("NAGISA_POOL_SIZE")) {
+            high_water = std::strtoull(env, nullptr, 10);
+        }
+    }
+    size_t BufferAllocator::size_class(size_t bytes) {
+        size_t s = 256;
+        while (s < bytes) {
+            s *= 2;
+        }
+        return s;
+    }
+    std::unique_ptr<DeviceBuffer> BufferAllocator::alloc(size_t bytes, Type type) {
+        auto s = size_class(bytes);
+        std::lock_guard<std::mutex> lock(mutex);
+        std::unique_ptr<DeviceBuffer> buffer;
+        auto it = cache.find(s);
+        if (it != cache.end() && !it->second.empty()) {
+            buffer = std::move(it->second.back());
+            it->second.pop_back();
+            _stats.cached_bytes -= s;
+            _stats.reuses++;
+            buffer->type = type;
+        } else {
+            buffer = backend->alloc(s, type);
+            _stats.allocations++;
+            nagisa_count(Counter::BytesAllocated, s);
+        }
+        _stats.live_bytes += s;
+        _stats.peak_bytes = std::max(_stats.peak_bytes, _stats.live_bytes + _stats.cached_bytes);
+        return buffer;
+    }
+    void BufferAllocator::release(std::unique_ptr<DeviceBuffer> buffer) {
+        auto s = buffer->size();
+        std::lock_guard<std::mutex> lock(mutex);
+        NGS_ASSERT(s == size_class(s) && _stats.live_bytes >= s);
+        _stats.live_bytes -= s;
+        if (s > high_water) {
+            return;
+        }
+        cache[s].push_back(std::move(buffer));
+        _stats.cached_bytes += s;
+        if (_stats.cached_bytes > high_water) {
+            trim_locked(high_water);
+        }
+    }
+    void BufferAllocator::trim(size_t bytes) {
+        std::lock_guard<std::mutex> lock(mutex);
+        trim_locked(bytes);
+    }
+    void BufferAllocator::trim_locked(size_t bytes) {
+        for (auto it = cache.rbegin(); it != cache.rend() && _stats.cached_bytes > bytes; it++) {
+            auto &list = it->second;
+            while (!list.empty() && _stats.cached_bytes > bytes) {
+                list.pop_back();
+                _stats.cached_bytes -= it->first;
+                _stats.trimmed_bytes += it->first;
+            }
+        }
+    }
+    HostSpill::HostSpill(size_t bytes) : _size(std::max<size_t>(bytes, 1)) {
+        int fd = -1;
+        if (auto dir = std::getenv("NAGISA_SPILL_DIR")) {
+            std::string path = std::string(dir) + "/nagisa_spill_XXXXXX";
+            fd = mkstemp(path.data());
+            if (fd < 0 || ftruncate(fd, (off_t)_size) != 0) {
+                std::cerr << "can't create a spill file in " << dir << std::endl;
+                exit(1);
+            }
+            // the pages stay reachable through the mapping
+            unlink(path.c_str());
+        }
+        int flags = fd >= 0 ? MAP_SHARED : MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE;
+        _data = mmap(nullptr, _size, PROT_READ | PROT_WRITE, flags, fd, 0);
+        if (fd >= 0) {
+            close(fd);
+        }
+        if (_data == MAP_FAILED) {
+            std::cerr << "can't map " << _size << " bytes of spill memory" << std::endl;
+            exit(1);
+        }
+    }
+    HostSpill::~HostSpill() { munmap(_data, _size); }
+} // namespace nagisa
@@ -0,0 +1,76 @@
+// MIT License
+//
+// Copyright (c) 2020 椎名深雪
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#pragma once
+#include <nagisa/nagisa.hpp>
+#include "backend.h"
+#include <map>
+#include <memory>
+#include <mutex>
+#include <vector>
+namespace nagisa {
+    /*
+    Pools device buffers in power-of-two size classes, so iterative workloads
+    reuse the buffers of freed vars instead of going back to the driver on every
+    eval. Released buffers may still be used by queued launches, the backends
+    order any later access after them.
+    Once the cached bytes exceed the high-water mark the largest classes are trimmed.
+    Shared by every context, so all of it is guarded by a mutex
+    */
+    class BufferAllocator {
+        Backend *backend;
+        mutable std::mutex mutex;
+        std::map<size_t, std::vector<std::unique_ptr<DeviceBuffer>>> cache;
+        size_t high_water;
+        MemoryStats _stats;
+        void trim_locked(size_t bytes);
+
+      public:
+        // NAGISA_POOL_SIZE overrides the high-water mark in bytes (0 disables pooling)
+        explicit BufferAllocator(Backend *backend);
+        static size_t size_class(size_t bytes);
+        std::unique_ptr<DeviceBuffer> alloc(size_t bytes, Type type);
+        void release(std::unique_ptr<DeviceBuffer> buffer);
+        // frees cached buffers, largest first, until at most `bytes` are cached
+        void trim(size_t bytes);
+        MemoryStats stats() const {
+            std::lock_guard<std::mutex> lock(mutex);
+            return _stats;
+        }
+    };
+    /*
+    Host memory the outputs of a tiled eval are streamed into, see nagisa_set_tile_budget. Anonymous pages
+    by default, or an unlinked file under NAGISA_SPILL_DIR so outputs larger than RAM are paged to disk
+    */
+    class HostSpill {
+        void *_data = nullptr;
+        size_t _size;
+
+      public:
+        explicit HostSpill(size_t bytes);
+        HostSpill(const HostSpill &) = delete;
+        HostSpill &operator=(const HostSpill &) = delete;
+        ~HostSpill();
+        void *data() const { return _data; }
+        size_t size() const { return _size; }
+    };
+} // namespace nagisa
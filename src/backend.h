@@ -0,0 +1,213 @@
+// MIT License
+//
+// Copyright (c) 2020 椎名深雪
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#pragma once
+#include <nagisa/nagisa.hpp>
+#include "hash.h"
+#include <string>
+#include <utility>
+#include <vector>
+namespace nagisa {
+    // C type of a value, f16 values are computed as float
+    std::string type_to_str(Type type);
+    // C type of a buffer element, `half` holds the bits of an f16 (the CPU preludes define it)
+    std::string buffer_type_str(Type type);
+    // params travel as 32-bit values, booleans and f16 included, or as 64-bit values for the 64-bit types
+    std::string param_type_str(Type type);
+    size_t param_size(Type type);
+    // names the per type helpers of the backends, such as atomic_add_<suffix>
+    const char *nagisa_type_suffix(Type type);
+    // C literal of a constant of the given type
+    std::string nagisa_const_str(const Instruction &inst, Type type);
+    // calls f with a value of the C++ type that holds the computed values of `type`
+    template <class F>
+    void nagisa_dispatch_type(Type type, F &&f) {
+        switch (type) {
+        case Type::f32:
+        case Type::f16:
+            f(float());
+            break;
+        case Type::f64:
+            f(double());
+            break;
+        case Type::i32:
+        case Type::boolean:
+            f(int32_t());
+            break;
+        case Type::u32:
+            f(uint32_t());
+            break;
+        case Type::i64:
+            f(int64_t());
+            break;
+        case Type::u64:
+            f(uint64_t());
+            break;
+        default:
+            NGS_ASSERT(false);
+        }
+    }
+
+    // writes into the buffer of another var instead of defining a value
+    inline bool nagisa_is_store(Opcode op) { return op == Store || op == ScatterAdd; }
+    // accumulates into the single element buffer of its own var
+    inline bool nagisa_is_reduction(Opcode op) { return op == ReduceAdd || op == ReduceMax || op == ReduceMin; }
+    // recorded control flow, see nagisa_loop_begin
+    inline bool nagisa_is_control(Opcode op) { return op == Phi || op == Loop || op == If || op == RegionOut; }
+    inline bool nagisa_is_region(Opcode op) { return op == Loop || op == If; }
+
+    enum class StmtKind {
+        // v = thread idx converted to `type`, plus the i64 p<param> in a tiled kernel
+        ThreadIdx,
+        Compute,
+        // v = buffer[thread idx]
+        Read,
+        // buffer[thread idx] = v
+        Write,
+        // v = p<param>, a lifted constant
+        Param,
+        // v = buffer[0], an evaluated var with a single element read by every thread
+        ReadUniform,
+        /*
+        Recorded control flow, nested like braces and closed by RegionEnd. v<var> of LoopBegin and IfBegin
+        is the mask of the lanes running the region, which the SIMD backend tracks, and inst.operand[1] of
+        LoopCond and PhiUpdate names it.
+        LoopBegin starts `while (true)`, LoopCond leaves it once v<inst.operand[0]> is false,
+        IfBegin runs the region if v<inst.operand[0]>, PhiUpdate assigns v<inst.operand[0]> to v<var>.
+        Phi values are declared before the region as a Compute of op Phi, a copy of its operand
+        */
+        LoopBegin,
+        LoopCond,
+        IfBegin,
+        PhiUpdate,
+        RegionEnd
+    };
+    /*
+    One statement of a fused kernel. Operands of `inst` are renumbered to kernel
+    local variables, so v<var> is the name of the value it defines
+    */
+    struct KernelStmt {
+        StmtKind kind = StmtKind::Compute;
+        int var = -1;
+        Type type = Type::none;
+        Instruction inst;
+        // index into Kernel::buffers
+        int buffer = -1;
+        int param = -1;
+    };
+    // a Store/ScatterAdd into `buffer`, which defines no value
+    inline bool nagisa_is_store(const KernelStmt &s) {
+        return s.kind == StmtKind::Compute && nagisa_is_store(s.inst.op);
+    }
+    // v<var> is the operand of this lane, the backend keeps a running r<var> and combines it into `buffer`
+    inline bool nagisa_is_reduction(const KernelStmt &s) {
+        return s.kind == StmtKind::Compute && nagisa_is_reduction(s.inst.op);
+    }
+    inline bool nagisa_is_control(const KernelStmt &s) {
+        return s.kind >= StmtKind::LoopBegin && s.kind <= StmtKind::RegionEnd;
+    }
+    // statements that have an effect besides defining v<var>
+    inline bool nagisa_writes_buffer(const KernelStmt &s) {
+        return s.kind == StmtKind::Write || nagisa_is_store(s) || nagisa_is_reduction(s);
+    }
+    struct KernelParam {
+        Type type;
+        // the bits of the value as a param_type_str, in the low bytes
+        uint64_t bits = 0;
+    };
+    struct Kernel {
+        std::vector<KernelStmt> stmts;
+        // (buffer id, type) of each buffer argument, only the buffers the kernel touches
+        std::vector<std::pair<int, Type>> buffers;
+        std::vector<KernelParam> params;
+        // type of local v<i>
+        std::vector<Type> local_types;
+        size_t size = 1;
+        // structural hash of everything above except the values of params and size
+        KernelHash hash;
+    };
+    KernelHash nagisa_hash_kernel(const Kernel &kernel);
+    // whether kernel.buffers[i] is stored to, the others are only read
+    std::vector<bool> nagisa_buffer_writes(const Kernel &kernel);
+    /*
+    C-like body shared by the OpenCL and the scalar CPU code generators. f16 buffers are accessed
+    through vload_half/vstore_half, which the CPU preludes define with the OpenCL signatures
+    */
+    std::string nagisa_emit_scalar_body(const Kernel &kernel, const std::string &thread_idx);
+    bool nagisa_has_reduction(const Kernel &kernel);
+    // "add", "max" or "min", names the atomic_<name>_<f|i> helpers of the backends
+    const char *nagisa_reduction_name(Opcode op);
+    // C literal of the value a reduction starts from
+    std::string nagisa_reduction_identity(Opcode op, Type type);
+    // C expression folding b into the running value a
+    std::string nagisa_reduction_combine(Opcode op, const std::string &a, const std::string &b);
+    // `type r<var> = identity;` for every reduction of the kernel
+    std::string nagisa_emit_reduction_init(const Kernel &kernel);
+
+    // an in-order sequence of device commands, every tracing context queues on a stream of its own
+    class CommandStream {
+      public:
+        virtual ~CommandStream() = default;
+    };
+    /*
+    A Backend compiles the kernel source produced by nagisa_generate_kernel_trace
+    and launches it over [0, size) of Predefined::ThreadIdx.
+    Launches are asynchronous: DeviceBuffer::read and write wait only for the
+    pending launches that touch that buffer, and a buffer may be destroyed while
+    launches using it are still in flight.
+    One backend serves every context, so its methods may be called from several threads, each with its own
+    stream. A buffer is used by one thread at a time, but commands on a stream are ordered after the commands
+    of other streams that used the same buffer before, as happens when the allocator hands a buffer on
+    */
+    class Backend {
+      public:
+        virtual ~Backend() = default;
+        virtual const char *name() const = 0;
+        virtual std::unique_ptr<CommandStream> create_stream() = 0;
+        virtual std::unique_ptr<DeviceBuffer> alloc(size_t bytes, Type type) = 0;
+        // a buffer over host memory that outlives it, used in place where the device allows.
+        // Destroying it waits for the launches still using the memory
+        virtual std::unique_ptr<DeviceBuffer> wrap_host(void *p, size_t bytes, Type type) = 0;
+        virtual std::string kernel_source(const Kernel &kernel) const = 0;
+        // starts building the kernel in the background unless a kernel with its Kernel::hash is built or being built
+        virtual void prepare(const Kernel &kernel) = 0;
+        // builds the kernel first unless prepare did, returns once it is queued, which may have to wait for the build
+        virtual void launch(CommandStream *stream, const Kernel &kernel, const std::vector<DeviceBuffer *> &buffers) = 0;
+        // copies `bytes` of src from src_offset into dst at dst_offset once the launches writing src are done,
+        // returns once it is queued
+        virtual void copy(CommandStream *stream, DeviceBuffer *dst, size_t dst_offset, DeviceBuffer *src,
+                          size_t src_offset, size_t bytes) = 0;
+        // running sum of the first n elements of src (f32 or i32) into dst, which may be src. Returns once it is queued
+        virtual void prefix_sum(CommandStream *stream, DeviceBuffer *dst, DeviceBuffer *src, size_t n,
+                                bool exclusive) = 0;
+        // waits for every command queued on the stream
+        virtual void synchronize(CommandStream *stream) = 0;
+    };
+
+    // the workers of the pool a backend builds kernels on, NAGISA_COMPILE_THREADS or every hardware thread
+    size_t nagisa_compile_threads();
+    std::unique_ptr<Backend> nagisa_create_cpu_backend();
+    // builds the kernel of a Function with the host compiler, whichever backend is active. See nagisa_function_end
+    NativeFunction nagisa_compile_native_function(const Kernel &kernel, size_t lanes);
+    // returns nullptr if no usable OpenCL device is found
+    std::unique_ptr<Backend> nagisa_create_opencl_backend();
+} // namespace nagisa
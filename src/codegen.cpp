@@ -0,0 +1,347 @@
+// MIT License
+//
+// Copyright (c) 2020 椎名深雪
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+#include "backend.h"
+#include <algorithm>
+#include <cmath>
+#include <iomanip>
+#include <iostream>
+#include <limits>
+#include <sstream>
+namespace nagisa {
+    std::string type_to_str(Type type) {
+        switch (type) {
+        case Type::f32:
+        case Type::f16:
+            return "float";
+        case Type::f64:
+            return "double";
+        case Type::i32:
+            return "int";
+        case Type::u32:
+            return "uint";
+        case Type::i64:
+            return "long";
+        case Type::u64:
+            return "ulong";
+        case Type::boolean:
+            return "bool";
+        default:
+            break;
+        }
+        std::cerr << "unknown type" << std::endl;
+        std::abort();
+    }
+    std::string buffer_type_str(Type type) { return type == Type::f16 ? "half" : type_to_str(type); }
+    const char *nagisa_type_suffix(Type type) {
+        switch (type) {
+        case Type::f32:
+            return "f";
+        case Type::f64:
+            return "d";
+        case Type::f16:
+            return "h";
+        case Type::i32:
+            return "i";
+        case Type::u32:
+            return "u";
+        case Type::i64:
+            return "l";
+        case Type::u64:
+            return "ul";
+        case Type::boolean:
+            return "b";
+        default:
+            NGS_ASSERT(false);
+        }
+        return nullptr;
+    }
+    std::string nagisa_const_str(const Instruction &inst, Type type) {
+        std::ostringstream out;
+        if (nagisa_is_float(type)) {
+            double x = inst.op == ConstantFloat ? inst.fval : (double)inst.ival;
+            if (type != Type::f64) {
+                x = (float)x;
+            }
+            if (std::isnan(x)) {
+                return "NAN";
+            }
+            if (std::isinf(x)) {
+                return x > 0 ? "INFINITY" : "-INFINITY";
+            }
+            out << std::setprecision(type == Type::f64 ? std::numeric_limits<double>::max_digits10
+                                                       : std::numeric_limits<float>::max_digits10)
+                << x;
+            auto str = out.str();
+            if (str.find_first_of(".e") == std::string::npos) {
+                str += ".0";
+            }
+            return type == Type::f64 ? str : str + "f";
+        }
+        int64_t x = inst.op == ConstantFloat ? (int64_t)inst.fval : inst.ival;
+        switch (type) {
+        case Type::u32:
+            out << (uint32_t)x << "u";
+            break;
+        case Type::i64:
+            // the literal of the smallest value would not fit in a long before its negation
+            if (x == std::numeric_limits<int64_t>::min()) {
+                return "(-9223372036854775807L - 1)";
+            }
+            out << x << "L";
+            break;
+        case Type::u64:
+            out << (uint64_t)x << "UL";
+            break;
+        case Type::boolean:
+            out << (x != 0);
+            break;
+        default:
+            out << (int32_t)x;
+        }
+        return out.str();
+    }
+    static const char *binary_op_str(Opcode op) {
+        switch (op) {
+        case FAdd:
+            return " + ";
+        case FSub:
+            return " - ";
+        case FMul:
+            return " * ";
+        case FDiv:
+            return " / ";
+        case Mod:
+            return " % ";
+        case CmpLt:
+            return " < ";
+        case CmpLe:
+            return " <= ";
+        case CmpGt:
+            return " > ";
+        case CmpGe:
+            return " >= ";
+        case CmpEq:
+            return " == ";
+        case CmpNe:
+            return " != ";
+        default:
+            return nullptr;
+        }
+    }
+    KernelHash nagisa_hash_kernel(const Kernel &kernel) {
+        Hasher h;
+        for (auto &s : kernel.stmts) {
+            h.update(s.kind).update(s.var).update(s.type).update(s.buffer).update(s.param);
+            if (nagisa_is_control(s)) {
+                h.update(s.inst.operand);
+            }
+            if (s.kind != StmtKind::Compute) {
+                continue;
+            }
+            auto &inst = s.inst;
+            h.update(inst.op);
+            if (inst.op == ConstantInt) {
+                h.update(inst.ival);
+            } else if (inst.op == ConstantFloat) {
+                h.update(inst.fval);
+            } else {
+                h.update(inst.operand);
+            }
+        }
+        // buffer ids are not part of the kernel, only the types of its buffer arguments
+        for (auto &b : kernel.buffers) {
+            h.update(b.second);
+        }
+        for (auto &p : kernel.params) {
+            h.update(p.type);
+        }
+        return h.digest();
+    }
+    std::vector<bool> nagisa_buffer_writes(const Kernel &kernel) {
+        std::vector<bool> writes(kernel.buffers.size(), false);
+        for (auto &s : kernel.stmts) {
+            if (nagisa_writes_buffer(s)) {
+                writes[s.buffer] = true;
+            }
+        }
+        return writes;
+    }
+    std::string param_type_str(Type type) { return type == Type::boolean ? "int" : type_to_str(type); }
+    size_t param_size(Type type) { return type == Type::boolean || type == Type::f16 ? 4 : get_typesize(type); }
+    bool nagisa_has_reduction(const Kernel &kernel) {
+        return std::any_of(kernel.stmts.begin(), kernel.stmts.end(),
+                           [](const KernelStmt &s) { return nagisa_is_reduction(s); });
+    }
+    const char *nagisa_reduction_name(Opcode op) {
+        switch (op) {
+        case ReduceAdd:
+            return "add";
+        case ReduceMax:
+            return "max";
+        case ReduceMin:
+            return "min";
+        default:
+            NGS_ASSERT(false);
+        }
+        return nullptr;
+    }
+    std::string nagisa_reduction_identity(Opcode op, Type type) {
+        if (op == ReduceAdd) {
+            return nagisa_const_str(Instruction::const_int(0), type);
+        }
+        if (nagisa_is_float(type)) {
+            return op == ReduceMax ? "-INFINITY" : "INFINITY";
+        }
+        int64_t x = 0;
+        nagisa_dispatch_type(type, [&](auto v) {
+            using T = decltype(v);
+            x = (int64_t)(op == ReduceMax ? std::numeric_limits<T>::min() : std::numeric_limits<T>::max());
+        });
+        return nagisa_const_str(Instruction::const_int(x), type);
+    }
+    std::string nagisa_reduction_combine(Opcode op, const std::string &a, const std::string &b) {
+        if (op == ReduceAdd) {
+            return a + " + " + b;
+        }
+        return "(" + b + (op == ReduceMax ? " > " : " < ") + a + " ? " + b + " : " + a + ")";
+    }
+    std::string nagisa_emit_reduction_init(const Kernel &kernel) {
+        std::ostringstream out;
+        for (auto &s : kernel.stmts) {
+            if (nagisa_is_reduction(s)) {
+                out << type_to_str(s.type) << " r" << s.var << " = " << nagisa_reduction_identity(s.inst.op, s.type)
+                    << ";\n";
+            }
+        }
+        return out.str();
+    }
+    std::string nagisa_emit_scalar_body(const Kernel &kernel, const std::string &thread_idx) {
+        std::ostringstream out;
+        auto var = [](int i) { return std::string("v").append(std::to_string(i)); };
+        auto read = [&](int buffer, const std::string &idx) {
+            auto name = "buffer" + std::to_string(buffer);
+            if (kernel.buffers[buffer].second == Type::f16) {
+                return "vload_half(" + idx + ", " + name + ")";
+            }
+            return name + "[" + idx + "]";
+        };
+        auto write = [&](int buffer, const std::string &idx, const std::string &value) {
+            auto name = "buffer" + std::to_string(buffer);
+            if (kernel.buffers[buffer].second == Type::f16) {
+                return "vstore_half(" + value + ", " + idx + ", " + name + ");\n";
+            }
+            return name + "[" + idx + "] = " + value + ";\n";
+        };
+        for (auto &s : kernel.stmts) {
+            if (s.kind == StmtKind::Write) {
+                out << write(s.buffer, thread_idx, var(s.var));
+                continue;
+            }
+            switch (s.kind) {
+            case StmtKind::LoopBegin:
+                out << "while (1) {\n";
+                continue;
+            case StmtKind::LoopCond:
+                out << "if (!" << var(s.inst.operand[0]) << ") break;\n";
+                continue;
+            case StmtKind::IfBegin:
+                out << "if (" << var(s.inst.operand[0]) << ") {\n";
+                continue;
+            case StmtKind::PhiUpdate:
+                out << var(s.var) << " = " << var(s.inst.operand[0]) << ";\n";
+                continue;
+            case StmtKind::RegionEnd:
+                out << "}\n";
+                continue;
+            default:
+                break;
+            }
+            if (nagisa_is_reduction(s)) {
+                auto r = "r" + std::to_string(s.var);
+                out << r << " = " << nagisa_reduction_combine(s.inst.op, r, var(s.inst.operand[0])) << ";\n";
+                continue;
+            }
+            if (nagisa_is_store(s)) {
+                auto &inst = s.inst;
+                auto target = "buffer" + std::to_string(s.buffer);
+                out << "if (" << var(inst.operand[2]) << ") ";
+                if (inst.op == Store) {
+                    out << write(s.buffer, var(inst.operand[0]), var(inst.operand[1]));
+                } else {
+                    // atomic_add_<suffix> comes from the backend's prelude
+                    out << "atomic_add_" << nagisa_type_suffix(kernel.buffers[s.buffer].second) << "(" << target
+                        << " + " << var(inst.operand[0]) << ", " << var(inst.operand[1]) << ");\n";
+                }
+                continue;
+            }
+            out << type_to_str(s.type) << " " << var(s.var) << " = ";
+            if (s.kind == StmtKind::ThreadIdx) {
+                // the 64-bit index converted to the type of the range, plus the first lane of a tile
+                out << "(" << type_to_str(s.type) << ")(" << thread_idx;
+                if (s.param >= 0) {
+                    out << " + p" << s.param;
+                }
+                out << ")";
+            } else if (s.kind == StmtKind::Param) {
+                out << "p" << s.param;
+            } else if (s.kind == StmtKind::Read) {
+                out << read(s.buffer, thread_idx);
+            } else if (s.kind == StmtKind::ReadUniform) {
+                out << read(s.buffer, "0");
+            } else {
+                auto &inst = s.inst;
+                auto op = inst.op;
+                if (op == ConstantInt || op == ConstantFloat) {
+                    out << nagisa_const_str(inst, s.type);
+                } else if (op == Mod && nagisa_is_float(s.type)) {
+                    out << "fmod(" << var(inst.operand[0]) << ", " << var(inst.operand[1]) << ")";
+                } else if (auto str = binary_op_str(op)) {
+                    out << var(inst.operand[0]) << str << var(inst.operand[1]);
+                } else if (op == Select) {
+                    out << var(inst.operand[0]) << " ? " << var(inst.operand[1]) << " :" << var(inst.operand[2]);
+                } else if (op == Load) {
+                    out << var(inst.operand[1]) << " ? " << read(s.buffer, var(inst.operand[2])) << " : 0";
+                } else if (op == Cast) {
+                    if (s.type == Type::boolean) {
+                        out << "(" << var(inst.operand[0]) << " != 0)";
+                    } else {
+                        out << "(" << type_to_str(s.type) << ")" << var(inst.operand[0]);
+                    }
+                } else if (op == Sin) {
+                    out << "sin(" << var(inst.operand[0]) << ")";
+                } else if (op == Cos) {
+                    out << "cos(" << var(inst.operand[0]) << ")";
+                } else if (op == Sqrt) {
+                    out << "sqrt(" << var(inst.operand[0]) << ")";
+                } else if (op == Neg) {
+                    out << "-" << var(inst.operand[0]);
+                } else if (op == Phi || op == RegionOut) {
+                    out << var(inst.operand[0]);
+                } else {
+                    NGS_ASSERT(false);
+                }
+            }
+            out << ";\n";
+        }
+        return out.str();
+    }
+} // namespace nagisa
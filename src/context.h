@@ -0,0 +1,520 @@
+// MIT License
+//
+// Copyright (c) 2020 椎名深雪
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#pragma once
+#include <nagisa/nagisa.hpp>
+#include "allocator.h"
+#include "backend.h"
+#include <algorithm>
+#include <cstdint>
+#include <list>
+#include <new>
+#include <map>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+namespace nagisa {
+    template <size_t DEFAULT_BLOCK_SIZE = 262144ull>
+    class MemoryArena {
+        static constexpr size_t align16(size_t x) { return (x + 15ULL) & (~15ULL); }
+
+        struct Block {
+            size_t size;
+            uint8_t *data;
+
+            Block(uint8_t *data, size_t size) : size(size), data(data) {
+                //                log::log("???\n");
+            }
+
+            ~Block() = default;
+        };
+
+        std::list<Block> availableBlocks, usedBlocks;
+
+        size_t currentBlockPos = 0;
+        Block currentBlock;
+
+      public:
+        MemoryArena() : currentBlock(new uint8_t[DEFAULT_BLOCK_SIZE], DEFAULT_BLOCK_SIZE) {}
+
+        uint8_t *alloc(size_t size) {
+            auto allocSize = align16(size);
+            if (currentBlockPos + allocSize > currentBlock.size) {
+                usedBlocks.emplace_front(currentBlock);
+                currentBlockPos = 0;
+                auto iter = std::find_if(availableBlocks.begin(), availableBlocks.end(),
+                                         [=](const Block &b) { return b.size >= allocSize; });
+                if (iter != availableBlocks.end()) {
+                    currentBlock = *iter;
+                    availableBlocks.erase(iter);
+                } else {
+                    auto sz = std::max<size_t>(allocSize, DEFAULT_BLOCK_SIZE);
+                    currentBlock = Block(new uint8_t[sz], sz);
+                }
+            }
+            auto p = currentBlock.data + currentBlockPos;
+            currentBlockPos += allocSize;
+            return p;
+        }
+
+        void reset() {
+            currentBlockPos = 0;
+            availableBlocks.splice(availableBlocks.begin(), usedBlocks);
+        }
+
+        ~MemoryArena() {
+            delete[] currentBlock.data;
+            for (auto i : availableBlocks) {
+                delete[] i.data;
+            }
+            for (auto i : usedBlocks) {
+                delete[] i.data;
+            }
+        }
+    };
+
+    struct Value {
+        Instruction inst;
+        Type type;
+        int idx = 0;
+        int buf_idx = -1;
+        size_t size = 1;
+        int _ref_int = 0;
+        int _ref_ext = 0;
+        int _last_sync_time = -1;
+        // bumped every time the slot is freed, see VarTable
+        uint32_t generation = 0;
+        // var written by a Store/ScatterAdd, which holds an internal reference to it
+        int target = -1;
+        // Store/ScatterAdd vars queued against this one and not launched yet, see nagisa_scatter
+        int pending_stores = 0;
+        bool pending_adds_only = true;
+        // a buffer from wrap_host, which does not go back to the pool
+        bool borrowed = false;
+        // asked for by schedule() or read back by the host, so it is written whatever the cost model says.
+        // A size-1 var gets a buffer of its own
+        bool materialize = false;
+        // slot of the Loop/If a recorded var belongs to, or -2 - depth while that region is being recorded
+        int region = -1;
+        // size is the number of lanes a var runs over, reductions hold a single element
+        size_t num_elements() const { return nagisa_is_reduction(inst.op) ? 1 : size; }
+    };
+    class Bitset {
+        std::vector<uint64_t> words;
+
+      public:
+        Bitset() = default;
+        explicit Bitset(size_t n) : words((n + 63) / 64, 0) {}
+        bool test(size_t i) const { return i / 64 < words.size() && (words[i / 64] >> (i % 64) & 1); }
+        void set(size_t i) {
+            if (i / 64 >= words.size()) {
+                words.resize(i / 64 + 1, 0);
+            }
+            words[i / 64] |= 1ull << (i % 64);
+        }
+        void reset(size_t i) {
+            if (i / 64 < words.size()) {
+                words[i / 64] &= ~(1ull << (i % 64));
+            }
+        }
+        void clear() { std::fill(words.begin(), words.end(), 0); }
+        size_t count() const {
+            size_t n = 0;
+            for (auto w : words) {
+                n += __builtin_popcountll(w);
+            }
+            return n;
+        }
+        bool empty() const {
+            return std::all_of(words.begin(), words.end(), [](uint64_t w) { return w == 0; });
+        }
+        // first set bit >= i, or -1
+        int64_t find_next(size_t i) const {
+            size_t w = i / 64;
+            if (w >= words.size()) {
+                return -1;
+            }
+            uint64_t bits = words[w] & (~0ull << (i % 64));
+            while (true) {
+                if (bits) {
+                    return (int64_t)(w * 64 + __builtin_ctzll(bits));
+                }
+                if (++w == words.size()) {
+                    return -1;
+                }
+                bits = words[w];
+            }
+        }
+        // last set bit <= i, or -1
+        int64_t find_prev(int64_t i) const {
+            if (i < 0 || words.empty()) {
+                return -1;
+            }
+            size_t w = (size_t)i / 64;
+            if (w >= words.size()) {
+                w = words.size() - 1;
+                i = (int64_t)(w * 64 + 63);
+            }
+            uint64_t bits = words[w] & (~0ull >> (63 - i % 64));
+            while (true) {
+                if (bits) {
+                    return (int64_t)(w * 64 + 63 - __builtin_clzll(bits));
+                }
+                if (w-- == 0) {
+                    return -1;
+                }
+                bits = words[w];
+            }
+        }
+        template <class F>
+        void for_each(F &&f) const {
+            for (size_t w = 0; w < words.size(); w++) {
+                for (uint64_t bits = words[w]; bits; bits &= bits - 1) {
+                    f((int)(w * 64 + __builtin_ctzll(bits)));
+                }
+            }
+        }
+        // highest bit first, f may set bits below the one it is called on
+        template <class F>
+        void for_each_reverse(F &&f) const {
+            for (size_t w = words.size(); w-- > 0;) {
+                uint64_t below = ~0ull;
+                while (uint64_t bits = words[w] & below) {
+                    int b = 63 - __builtin_clzll(bits);
+                    below = b == 0 ? 0 : ~0ull >> (64 - b);
+                    f((int)(w * 64 + b));
+                }
+            }
+        }
+    };
+    /*
+    Dense table of trace variables. Slots live in fixed size chunks carved out of
+    a MemoryArena, so a Value never moves and indexing is two loads.
+    A freed slot goes to a free set and bumps its generation, which lets holders
+    of a plain index (the hash-consing table) detect that it was recycled.
+    Slots are handed out above `after`, the largest unevaluated dependency,
+    so slot order is always a topological order of the trace.
+    */
+    class VarTable {
+        static constexpr int CHUNK_BITS = 10;
+        static constexpr size_t CHUNK_SIZE = size_t(1) << CHUNK_BITS;
+        MemoryArena<> arena;
+        std::vector<Value *> chunks;
+        size_t _size = 0;
+        Bitset free_slots;
+        size_t _num_free = 0;
+        // no free slot above this one
+        size_t free_hi = 0;
+
+      public:
+        VarTable() = default;
+        VarTable(const VarTable &) = delete;
+        VarTable &operator=(const VarTable &) = delete;
+        ~VarTable() {
+            for (auto c : chunks) {
+                for (size_t i = 0; i < CHUNK_SIZE; i++) {
+                    c[i].~Value();
+                }
+            }
+        }
+        Value &operator[](int idx) { return chunks[(size_t)idx >> CHUNK_BITS][(size_t)idx & (CHUNK_SIZE - 1)]; }
+        const Value &operator[](int idx) const {
+            return chunks[(size_t)idx >> CHUNK_BITS][(size_t)idx & (CHUNK_SIZE - 1)];
+        }
+        // number of slots ever handed out, free or not
+        size_t size() const { return _size; }
+        size_t num_free() const { return _num_free; }
+        bool is_free(int idx) const { return free_slots.test(idx); }
+        int alloc(int after) {
+            size_t idx = _size;
+            size_t from = (size_t)(after + 1);
+            if (_num_free > 0 && from <= free_hi) {
+                auto i = free_slots.find_next(from);
+                if (i >= 0) {
+                    idx = (size_t)i;
+                    free_slots.reset(idx);
+                    _num_free--;
+                } else {
+                    free_hi = from - 1;
+                }
+            }
+            if (idx == _size) {
+                if (_size % CHUNK_SIZE == 0) {
+                    auto c = reinterpret_cast<Value *>(arena.alloc(sizeof(Value) * CHUNK_SIZE));
+                    for (size_t i = 0; i < CHUNK_SIZE; i++) {
+                        new (c + i) Value();
+                    }
+                    chunks.push_back(c);
+                }
+                _size++;
+            }
+            auto &v = (*this)[(int)idx];
+            auto gen = v.generation;
+            v = Value();
+            v.generation = gen;
+            v.idx = (int)idx;
+            return (int)idx;
+        }
+        void free(int idx) {
+            auto &v = (*this)[idx];
+            v.generation++;
+            free_slots.set(idx);
+            _num_free++;
+            free_hi = std::max(free_hi, (size_t)idx);
+        }
+    };
+    struct InstKey {
+        Opcode op;
+        Type type;
+        int64_t a, b, c;
+        // equal instructions over a different number of lanes are different vars
+        size_t size;
+        bool operator==(const InstKey &rhs) const {
+            return op == rhs.op && type == rhs.type && a == rhs.a && b == rhs.b && c == rhs.c && size == rhs.size;
+        }
+    };
+    /*
+    The hash-consing table, hit by every appended instruction. Open addressing with linear probing over a
+    power-of-two array of 16-byte entries, (hash, slot, generation): the key itself is not stored, a var
+    with a matching hash is compared against the key of its own instruction. Erasing shifts the following
+    entries of the run back, there are no tombstones
+    */
+    class CseTable {
+        struct Entry {
+            uint64_t hash = 0;
+            // slot -1 marks an empty entry
+            int idx = -1;
+            uint32_t generation = 0;
+        };
+        std::vector<Entry> entries;
+        size_t _size = 0;
+        size_t mask() const { return entries.size() - 1; }
+        void grow() {
+            std::vector<Entry> old(std::max<size_t>(64, entries.size() * 2));
+            old.swap(entries);
+            for (auto &e : old) {
+                if (e.idx != -1) {
+                    size_t i = e.hash & mask();
+                    while (entries[i].idx != -1) {
+                        i = (i + 1) & mask();
+                    }
+                    entries[i] = e;
+                }
+            }
+        }
+        void erase_at(size_t i) {
+            // pull back every later entry of the run whose home is not in (i, j]
+            for (size_t j = (i + 1) & mask(); entries[j].idx != -1; j = (j + 1) & mask()) {
+                size_t home = entries[j].hash & mask();
+                if (((j - home) & mask()) >= ((j - i) & mask())) {
+                    entries[i] = entries[j];
+                    i = j;
+                }
+            }
+            entries[i].idx = -1;
+            _size--;
+        }
+
+      public:
+        static uint64_t hash(const InstKey &k) {
+            uint64_t h = ((uint64_t)k.op << 8 | (uint64_t)k.type) * 0x9e3779b97f4a7c15ull;
+            h = (h ^ (uint64_t)k.a) * 0xff51afd7ed558ccdull;
+            h = (h ^ (uint64_t)k.b) * 0xc4ceb9fe1a85ec53ull;
+            h = (h ^ (uint64_t)k.c) * 0x87c37b91114253d5ull;
+            h = (h ^ (uint64_t)k.size) * 0x4cf5ad432745937full;
+            return h ^ (h >> 29);
+        }
+        size_t size() const { return _size; }
+        /*
+        The slot of an entry with this hash that `same` accepts, or -1. Entries `alive` rejects, whose
+        slot was recycled, are erased on the way
+        */
+        template <typename Alive, typename Same>
+        int find(uint64_t hash, Alive &&alive, Same &&same) {
+            if (_size == 0) {
+                return -1;
+            }
+            size_t i = hash & mask();
+            while (entries[i].idx != -1) {
+                auto &e = entries[i];
+                if (e.hash == hash) {
+                    if (!alive(e.idx, e.generation)) {
+                        // the run shifted into i
+                        erase_at(i);
+                        continue;
+                    }
+                    if (same(e.idx)) {
+                        return e.idx;
+                    }
+                }
+                i = (i + 1) & mask();
+            }
+            return -1;
+        }
+        void insert(uint64_t hash, int idx, uint32_t generation) {
+            if (2 * (_size + 1) > entries.size()) {
+                grow();
+            }
+            size_t i = hash & mask();
+            while (entries[i].idx != -1) {
+                i = (i + 1) & mask();
+            }
+            entries[i] = Entry{hash, idx, generation};
+            _size++;
+        }
+        void erase(uint64_t hash, int idx) {
+            if (_size == 0) {
+                return;
+            }
+            for (size_t i = hash & mask(); entries[i].idx != -1; i = (i + 1) & mask()) {
+                if (entries[i].hash == hash && entries[i].idx == idx) {
+                    erase_at(i);
+                    return;
+                }
+            }
+        }
+        // erases every entry whose (slot, generation) `alive` rejects
+        template <typename Alive>
+        void erase_stale(Alive &&alive) {
+            std::vector<Entry> kept;
+            for (auto &e : entries) {
+                if (e.idx != -1 && alive(e.idx, e.generation)) {
+                    kept.push_back(e);
+                }
+            }
+            std::fill(entries.begin(), entries.end(), Entry());
+            _size = 0;
+            for (auto &e : kept) {
+                insert(e.hash, e.idx, e.generation);
+            }
+        }
+    };
+    // a recorded Loop or If, see nagisa_loop_begin. It holds an internal reference to every var it lists
+    struct Region {
+        Opcode kind = Loop;
+        // recorded in the head of a Loop and tested before every iteration, read from outside by an If
+        int cond = -1;
+        // per state var: the value entering the region, the value inside it and the value at the end of the body
+        std::vector<int> inits, phis, results;
+        // vars recorded for the condition and for the body in slot order, a nested region is a single var
+        std::vector<int> head, body;
+        // vars from outside the region it reads, which are computed or read back before it
+        std::vector<int> outer;
+        size_t size = 1;
+    };
+    struct Recording {
+        Region region;
+        // (slot, generation) of the vars appended while recording, some of which die before the end
+        std::vector<std::pair<int, uint32_t>> head, body;
+        bool in_body = false;
+    };
+    // a device command sent by an eval, as a Graph replays it. Buffers are named by id
+    struct GraphCommand {
+        enum Kind { Launch, Copy, Write, PrefixSum } kind = Launch;
+        // shared by the tiles of a tiled kernel, which differ in params and size
+        std::shared_ptr<Kernel> kernel;
+        std::vector<KernelParam> params;
+        size_t size = 0;
+        // the buffers of a Launch in Kernel::buffers order, dst then src for a Copy or PrefixSum, dst for a Write
+        std::vector<int> buffers;
+        size_t dst_offset = 0, src_offset = 0, bytes = 0;
+        bool exclusive = false;
+        // contents of a Write
+        std::vector<uint8_t> data;
+    };
+    // a buffer freed while capturing that a command uses, kept for replay
+    struct GraphBuffer {
+        // host memory behind a tiled output, outlives the buffer wrapping it
+        std::unique_ptr<HostSpill> spill;
+        std::unique_ptr<DeviceBuffer> buffer;
+        // goes back to the pool once the graph is freed
+        bool pooled = false;
+    };
+    // see nagisa_capture_begin
+    struct CapturedGraph {
+        std::vector<GraphCommand> commands;
+        // the buffers of the inputs, which replay may rebind, and their (type, number of elements)
+        std::vector<int> input_buffers;
+        std::vector<std::pair<Type, size_t>> input_shapes;
+        // buffer ids some command uses
+        std::unordered_set<int> used;
+        std::unordered_map<int, GraphBuffer> owned;
+        // vars owning the other used buffers, held with an external reference
+        std::vector<int> held;
+    };
+    // a var as it was before a speculative kernel generation changed it, see nagisa_precompile
+    struct SpeculativeChange {
+        int idx;
+        int buf_idx;
+        int last_sync_time;
+        bool evaluated;
+    };
+    /*
+    The trace, buffers and settings of one thread, see nagisa_create_context. Only the backend and the
+    allocator are shared, everything else is touched by the thread the context is current on
+    */
+    class Context {
+      public:
+        int _time = 0;
+        // roots of the next nagisa_eval: pending vars with external references and scheduled ones.
+        // The cost model drops the roots it leaves to be recomputed by their users
+        Bitset live;
+        // vars with _last_sync_time set, kept apart for the scheduler to scan
+        Bitset evaluated;
+        VarTable vars;
+        // shared with the other contexts, see nagisa_create_context
+        Backend *backend = nullptr;
+        BufferAllocator *allocator = nullptr;
+        // where the commands of this context are queued, declared before buffers so it outlives them
+        std::unique_ptr<CommandStream> stream;
+        // host memory behind the buffers of tiled outputs, keyed by buffer id. Declared before buffers
+        // so it outlives the buffers wrapping it
+        std::unordered_map<int, std::unique_ptr<HostSpill>> spills;
+        std::unordered_map<int, std::unique_ptr<DeviceBuffer>> buffers;
+        int next_buffer_id = 0;
+        bool lift_constants = false;
+        // see nagisa_set_tile_budget
+        size_t tile_budget = 0;
+        // see nagisa_set_ops_per_byte
+        float ops_per_byte = 4;
+        // hash-consing table of the values appended so far
+        CseTable cse_table;
+        // keyed by the slot of the Loop/If var
+        std::unordered_map<int, Region> regions;
+        // regions being recorded, innermost last
+        std::vector<Recording> recording;
+        // the graph being captured, if any
+        std::unique_ptr<CapturedGraph> capture;
+        std::unordered_map<int, std::unique_ptr<CapturedGraph>> graphs;
+        int next_graph_id = 0;
+        // bumped by every replay, see nagisa_graph_epoch
+        uint64_t graph_epoch = 0;
+        // see nagisa_set_background_compile, trace nodes appended since the last precompile
+        size_t background_compile = 0;
+        size_t traced_since_precompile = 0;
+        // set while nagisa_precompile generates kernels, which then get placeholder buffers of these types,
+        // ids -2, -3 and so on, and leave their changes to the vars in the undo list
+        bool speculating = false;
+        std::vector<Type> placeholders;
+        std::vector<SpeculativeChange> undo;
+    };
+} // namespace nagisa
@@ -0,0 +1,474 @@
+// MIT License
+//
+// Copyright (c) 2020 椎名深雪
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+#include "backend.h"
+#include "cpu_simd.h"
+#include "disk_cache.h"
+#include "hash.h"
+#include "profiler.h"
+#include "thread_pool.h"
+#include <atomic>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <future>
+#include <iostream>
+#include <mutex>
+#include <sstream>
+#include <unordered_map>
+#include <dlfcn.h>
+#include <unistd.h>
+
+#ifndef NAGISA_HOST_CXX
+#define NAGISA_HOST_CXX "c++"
+#endif
+namespace nagisa {
+    // a task queued on the queue of a stream, or none
+    struct Ticket {
+        std::shared_ptr<TaskQueue> queue;
+        uint64_t ticket = 0;
+        bool done() const { return !queue || queue->done(ticket); }
+        void wait() const {
+            if (queue) {
+                queue->wait(ticket);
+            }
+        }
+    };
+    class CPUStream : public CommandStream {
+      public:
+        // launches run here in order, each one fanning out over the pool. Shared with the tickets of the
+        // buffers, which may outlive the stream in the pool of the allocator
+        std::shared_ptr<TaskQueue> queue = std::make_shared<TaskQueue>();
+        ~CPUStream() { queue->wait_all(); }
+    };
+    class CPUBuffer : public DeviceBuffer {
+        uint8_t *data;
+        size_t _size;
+        // false for host memory wrapped by wrap_host
+        bool owned = true;
+
+      public:
+        static constexpr size_t alignment = 64;
+        // the last queued task that writes / touches the buffer
+        Ticket last_write;
+        Ticket last_use;
+        CPUBuffer(Type type, size_t s) : DeviceBuffer(type), _size(s) {
+            data = static_cast<uint8_t *>(std::aligned_alloc(alignment, (s + alignment - 1) / alignment * alignment));
+            NGS_ASSERT(data);
+        }
+        CPUBuffer(Type type, void *p, size_t s)
+            : DeviceBuffer(type), data(static_cast<uint8_t *>(p)), _size(s), owned(false) {}
+        ~CPUBuffer() {
+            if (!owned) {
+                // the caller may release the memory as soon as this returns
+                last_use.wait();
+            } else if (last_use.done()) {
+                std::free(data);
+            } else {
+                // released behind the launches still using it instead of stalling the host
+                last_use.queue->submit([p = data] { std::free(p); });
+            }
+        }
+        size_t size() override { return _size; }
+        void write(const uint8_t *p, size_t bytes, size_t offset) override {
+            last_use.wait();
+            std::memcpy(data + offset, p, bytes);
+        }
+        void read(uint8_t *p, size_t bytes, size_t offset) override {
+            last_write.wait();
+            std::memcpy(p, data + offset, bytes);
+        }
+        const void *map(size_t) override {
+            last_write.wait();
+            return data;
+        }
+        void unmap(const void *) override {}
+        void *get() override { return data; }
+    };
+
+    // builds C++ sources into shared objects with the host compiler, through the disk cache
+    class HostCompiler {
+        std::filesystem::path build_dir;
+        std::string compiler;
+        std::string toolchain;
+        SimdISA _isa;
+
+        std::string compile_command(const std::string &src_path, const std::string &lib_path) const {
+            std::ostringstream cmd;
+            cmd << "\"" << compiler << "\" -std=c++17 -O3 -march=native " << nagisa_simd_flags(_isa)
+                << " -fPIC -shared -o \"" << lib_path << "\" \"" << src_path << "\"";
+            return cmd.str();
+        }
+        // everything besides the source that changes the produced object
+        std::string toolchain_identity() const {
+            std::ostringstream id;
+            id << compile_command("", "") << "\n";
+            std::error_code ec;
+            auto time = std::filesystem::last_write_time(compiler, ec);
+            if (!ec) {
+                id << time.time_since_epoch().count() << "\n";
+            }
+            std::ifstream cpuinfo("/proc/cpuinfo");
+            std::string line;
+            while (std::getline(cpuinfo, line)) {
+                if (line.rfind("model name", 0) == 0 || line.rfind("flags", 0) == 0) {
+                    id << line << "\n";
+                }
+                if (line.empty()) {
+                    break;
+                }
+            }
+            return id.str();
+        }
+
+      public:
+        HostCompiler() : _isa(nagisa_detect_simd_isa()) {
+            build_dir = std::filesystem::temp_directory_path() / "nagisa";
+            std::filesystem::create_directories(build_dir);
+            const char *cxx = std::getenv("NAGISA_CXX");
+            compiler = cxx ? cxx : NAGISA_HOST_CXX;
+            toolchain = toolchain_identity();
+        }
+        SimdISA isa() const { return _isa; }
+        // a dlopen handle of the object built from src, which stays loaded until the caller closes it
+        void *compile(const std::string &src) {
+            ScopedPhase phase(Phase::Compile, "compile");
+            nagisa_dump_kernel(src);
+            auto &disk = nagisa_disk_cache();
+            auto key = Hasher().update(src).update(toolchain).hex() + ".so";
+            // a failed load means the entry was evicted or truncated by someone else, so just rebuild
+            if (disk.contains(key)) {
+                if (auto handle = dlopen(disk.path(key).c_str(), RTLD_NOW | RTLD_LOCAL)) {
+                    return handle;
+                }
+            }
+            // unique within the process too, compilers of several threads may build the same source at once
+            static std::atomic<uint64_t> counter{0};
+            std::ostringstream name;
+            name << "kernel_" << key << "_" << getpid() << "_" << counter++;
+            auto src_path = build_dir / (name.str() + ".cpp");
+            auto lib_path = disk.enabled() ? disk.temp_path(key) : build_dir / (name.str() + ".so");
+            {
+                std::ofstream out(src_path);
+                out << src;
+            }
+            auto cmd = compile_command(src_path.string(), lib_path.string());
+            if (std::system(cmd.c_str()) != 0) {
+                std::cerr << "Error building: " << cmd << std::endl;
+                exit(1);
+            }
+            std::error_code ec;
+            std::filesystem::remove(src_path, ec);
+            // the loaded image stays mapped even if the file is renamed, evicted or removed
+            auto handle = dlopen(lib_path.c_str(), RTLD_NOW | RTLD_LOCAL);
+            if (!handle) {
+                std::cerr << "Error loading: " << dlerror() << std::endl;
+                exit(1);
+            }
+            if (disk.enabled()) {
+                disk.publish(key, lib_path);
+            } else {
+                std::filesystem::remove(lib_path, ec);
+            }
+            return handle;
+        }
+    };
+    // kernels over 64-bit or unsigned values run one element at a time
+    static std::string nagisa_cpu_kernel_source(const Kernel &k, SimdISA isa) {
+        if (isa != SimdISA::scalar && nagisa_simd_supports(k)) {
+            return nagisa_emit_simd_kernel(k, isa);
+        }
+        std::ostringstream kernel;
+        kernel << "#include <cmath>\n#include <cstddef>\nusing namespace std;\n";
+        kernel << nagisa_cpu_scalar_prelude();
+        kernel << nagisa_emit_cpu_prologue(k);
+        kernel << nagisa_emit_reduction_init(k);
+        kernel << "for(size_t tid = begin; tid < end; tid++){\n";
+        kernel << nagisa_emit_scalar_body(k, "tid");
+        kernel << "}\n";
+        // one atomic per chunk
+        for (auto &s : k.stmts) {
+            if (nagisa_is_reduction(s)) {
+                kernel << "atomic_" << nagisa_reduction_name(s.inst.op) << "_" << nagisa_type_suffix(s.type)
+                       << "(buffer" << s.buffer << ", r" << s.var << ");\n";
+            }
+        }
+        kernel << "}";
+        return kernel.str();
+    }
+    /*
+    Calls the kernel over [0, lanes) on the arguments, which are its first buffers, into the result,
+    its last one. More than one lane passes each of them as a struct of that many values, see vec
+    */
+    static std::string function_wrapper(const Kernel &kernel, size_t lanes) {
+        std::ostringstream out;
+        auto n_args = kernel.buffers.size() - 1;
+        auto c_type = [&](size_t i) {
+            return lanes == 1 ? buffer_type_str(kernel.buffers[i].second) : "ngs_vec" + std::to_string(i);
+        };
+        for (size_t i = 0; lanes > 1 && i <= n_args; i++) {
+            out << "struct " << c_type(i) << " { " << buffer_type_str(kernel.buffers[i].second) << " v[" << lanes
+                << "]; };\n";
+        }
+        out << "extern \"C\" " << c_type(n_args) << " nagisa_function(";
+        for (size_t i = 0; i < n_args; i++) {
+            out << (i ? ", " : "") << c_type(i) << " a" << i;
+        }
+        out << ") {\n" << c_type(n_args) << " r;\nvoid *args[] = {";
+        for (size_t i = 0; i < n_args; i++) {
+            out << "&a" << i << ", ";
+        }
+        out << "&r};\nnagisa_kernel(args, 0, " << lanes << ");\nreturn r;\n}\n";
+        return out.str();
+    }
+    struct NativeKeyHasher {
+        size_t operator()(const std::pair<KernelHash, size_t> &key) const {
+            return KernelHashHasher()(key.first) ^ key.second;
+        }
+    };
+    NativeFunction nagisa_compile_native_function(const Kernel &kernel, size_t lanes) {
+        static HostCompiler compiler;
+        static std::mutex mutex;
+        // by kernel and lanes, an object is unloaded once the last Function holding it is destroyed
+        static std::unordered_map<std::pair<KernelHash, size_t>, std::weak_ptr<void>, NativeKeyHasher> functions;
+        std::lock_guard<std::mutex> lock(mutex);
+        auto &entry = functions[{kernel.hash, lanes}];
+        auto library = entry.lock();
+        if (!library) {
+            // a single lane gains nothing from masked vector code
+            auto isa = lanes == 1 ? SimdISA::scalar : compiler.isa();
+            auto src = nagisa_cpu_kernel_source(kernel, isa) + "\n" + function_wrapper(kernel, lanes);
+            library = std::shared_ptr<void>(compiler.compile(src), [](void *handle) { dlclose(handle); });
+            entry = library;
+        }
+        auto fn = dlsym(library.get(), "nagisa_function");
+        NGS_ASSERT(fn);
+        return NativeFunction{fn, std::move(library)};
+    }
+
+    /*
+    Kernels are emitted as host C++, compiled into a shared object with the host
+    compiler and each launch splits [0, size) across the worker pool.
+    On x86 the kernel body is lowered to explicit AVX2/AVX-512 lane code
+    */
+    class CPUBackend : public Backend {
+        using KernelFn = void (*)(void *const *, size_t, size_t);
+        struct Module {
+            void *handle = nullptr;
+            KernelFn fn = nullptr;
+        };
+        // a kernel that is built or being built on compile_pool
+        struct CacheEntry {
+            std::shared_future<Module> module;
+            // the first launch counts as the cache miss, even if prepare started the build
+            bool launched = false;
+        };
+        std::mutex cache_mutex;
+        std::unordered_map<KernelHash, CacheEntry, KernelHashHasher> kernel_cache;
+        HostCompiler compiler;
+        ThreadPool pool;
+        SimdISA isa;
+        size_t min_chunk = 4096;
+        // sums of every chunk in parallel, a serial scan over the chunk sums, then every chunk scans from its offset
+        template <typename T>
+        void scan(T *out, const T *in, size_t n, bool exclusive) {
+            auto chunk = std::max(min_chunk, (n + pool.num_threads() - 1) / pool.num_threads());
+            std::vector<T> offset((n + chunk - 1) / chunk + 1, T());
+            pool.parallel_for(n, chunk, [&](size_t begin, size_t end) {
+                T sum = T();
+                for (size_t i = begin; i < end; i++) {
+                    sum += in[i];
+                }
+                offset[begin / chunk + 1] = sum;
+            });
+            for (size_t c = 1; c < offset.size(); c++) {
+                offset[c] += offset[c - 1];
+            }
+            pool.parallel_for(n, chunk, [&](size_t begin, size_t end) {
+                T sum = offset[begin / chunk];
+                for (size_t i = begin; i < end; i++) {
+                    T x = in[i];
+                    out[i] = exclusive ? sum : sum + x;
+                    sum += x;
+                }
+            });
+        }
+        /*
+        Queues f on the stream and records it on the buffers, (buffer, writes) pairs. A buffer last used by
+        another stream makes f wait for that use first, so the tickets of a buffer cover all its earlier uses
+        */
+        void submit(CommandStream *stream, const std::vector<std::pair<CPUBuffer *, bool>> &buffers,
+                    std::function<void()> f) {
+            auto &queue = static_cast<CPUStream *>(stream)->queue;
+            std::vector<Ticket> deps;
+            for (auto &b : buffers) {
+                if (b.first->last_use.queue != queue && !b.first->last_use.done()) {
+                    deps.push_back(b.first->last_use);
+                }
+            }
+            Ticket ticket{queue, queue->submit([deps = std::move(deps), f = std::move(f)] {
+                              for (auto &d : deps) {
+                                  d.wait();
+                              }
+                              f();
+                          })};
+            for (auto &b : buffers) {
+                b.first->last_use = ticket;
+                if (b.second) {
+                    b.first->last_write = ticket;
+                }
+            }
+        }
+
+        static size_t num_threads() {
+            if (auto env = std::getenv("NAGISA_NUM_THREADS")) {
+                return std::max<size_t>(1, std::strtoull(env, nullptr, 10));
+            }
+            return std::max<unsigned>(1, std::thread::hardware_concurrency());
+        }
+        Module compile(const std::string &src) {
+            Module m;
+            m.handle = compiler.compile(src);
+            m.fn = reinterpret_cast<KernelFn>(dlsym(m.handle, "nagisa_kernel"));
+            NGS_ASSERT(m.fn);
+            return m;
+        }
+        // declared last, so it is drained before anything its builds use goes away
+        TaskPool compile_pool;
+        // the entry of the kernel, whose build is started if there is none. With cache_mutex held
+        CacheEntry &entry(const Kernel &kernel) {
+            auto it = kernel_cache.find(kernel.hash);
+            if (it != kernel_cache.end()) {
+                return it->second;
+            }
+            auto build = std::make_shared<std::packaged_task<Module()>>([this, kernel] {
+                std::string src;
+                {
+                    ScopedPhase phase(Phase::Codegen, "kernel source");
+                    src = kernel_source(kernel);
+                }
+                return compile(src);
+            });
+            auto &e = kernel_cache[kernel.hash];
+            e.module = build->get_future().share();
+            compile_pool.submit([build] { (*build)(); });
+            return e;
+        }
+
+      public:
+        CPUBackend() : pool(num_threads()), isa(compiler.isa()), compile_pool(nagisa_compile_threads()) {
+            if (nagisa_logging()) {
+                std::cerr << "Using CPU backend with " << pool.num_threads() << " threads, "
+                          << nagisa_simd_width(isa) << " lanes\n";
+            }
+        }
+        ~CPUBackend() {
+            for (auto &p : kernel_cache) {
+                dlclose(p.second.module.get().handle);
+            }
+        }
+        const char *name() const override { return "cpu"; }
+        std::unique_ptr<CommandStream> create_stream() override { return std::make_unique<CPUStream>(); }
+        std::unique_ptr<DeviceBuffer> alloc(size_t bytes, Type type) override {
+            return std::make_unique<CPUBuffer>(type, bytes);
+        }
+        std::unique_ptr<DeviceBuffer> wrap_host(void *p, size_t bytes, Type type) override {
+            return std::make_unique<CPUBuffer>(type, p, bytes);
+        }
+        std::string kernel_source(const Kernel &k) const override { return nagisa_cpu_kernel_source(k, isa); }
+        void prepare(const Kernel &kernel) override {
+            std::lock_guard<std::mutex> lock(cache_mutex);
+            entry(kernel);
+        }
+        void launch(CommandStream *stream, const Kernel &kernel, const std::vector<DeviceBuffer *> &buffers) override {
+            std::shared_future<Module> module;
+            {
+                std::lock_guard<std::mutex> lock(cache_mutex);
+                auto &e = entry(kernel);
+                if (e.launched) {
+                    nagisa_disk_cache().record_memory_hit();
+                    nagisa_count(Counter::CacheHits);
+                } else {
+                    nagisa_count(Counter::CacheMisses);
+                    e.launched = true;
+                }
+                module = e.module;
+            }
+            ScopedPhase phase(Phase::Launch, "launch", kernel.size);
+            nagisa_count(Counter::Launches);
+            std::vector<void *> pointers;
+            for (auto buf : buffers) {
+                pointers.push_back(buf->get());
+            }
+            std::vector<uint64_t> params;
+            for (auto &p : kernel.params) {
+                params.push_back(p.bits);
+            }
+            auto size = kernel.size;
+            auto width = nagisa_simd_width(isa);
+            auto chunk = std::max(min_chunk, size / (pool.num_threads() * 4));
+            chunk = (chunk + width - 1) / width * width;
+            auto writes = nagisa_buffer_writes(kernel);
+            std::vector<std::pair<CPUBuffer *, bool>> uses;
+            for (size_t i = 0; i < buffers.size(); i++) {
+                uses.emplace_back(static_cast<CPUBuffer *>(buffers[i]), writes[i]);
+            }
+            // the launch waits for the build on the queue, so the host goes on to the next kernel meanwhile
+            submit(stream, uses, [this, module, size, chunk, pointers, params]() mutable {
+                auto fn = module.get().fn;
+                std::vector<void *> args = pointers;
+                for (auto &p : params) {
+                    args.push_back(&p);
+                }
+                ScopedPhase phase(Phase::Device, "kernel", size);
+                pool.parallel_for(size, chunk, [&](size_t begin, size_t end) { fn(args.data(), begin, end); });
+            });
+        }
+        void copy(CommandStream *stream, DeviceBuffer *dst, size_t dst_offset, DeviceBuffer *src, size_t src_offset,
+                  size_t bytes) override {
+            auto d = static_cast<CPUBuffer *>(dst), s = static_cast<CPUBuffer *>(src);
+            auto p = static_cast<uint8_t *>(d->get()) + dst_offset;
+            auto q = static_cast<const uint8_t *>(s->get()) + src_offset;
+            // the queue runs in order, so this sees every launch queued before it
+            submit(stream, {{d, true}, {s, false}}, [p, q, bytes] { std::memcpy(p, q, bytes); });
+        }
+        void prefix_sum(CommandStream *stream, DeviceBuffer *dst, DeviceBuffer *src, size_t n,
+                        bool exclusive) override {
+            auto d = static_cast<CPUBuffer *>(dst), s = static_cast<CPUBuffer *>(src);
+            NGS_ASSERT(s->type != Type::boolean && s->type != Type::f16);
+            submit(stream, {{d, true}, {s, false}}, [this, p = d->get(), q = s->get(), n, exclusive, type = s->type] {
+                nagisa_dispatch_type(type, [&](auto x) {
+                    using T = decltype(x);
+                    scan(static_cast<T *>(p), static_cast<const T *>(q), n, exclusive);
+                });
+            });
+        }
+        void synchronize(CommandStream *stream) override { static_cast<CPUStream *>(stream)->queue->wait_all(); }
+    };
+    size_t nagisa_compile_threads() {
+        if (auto env = std::getenv("NAGISA_COMPILE_THREADS")) {
+            return std::max<size_t>(1, std::strtoull(env, nullptr, 10));
+        }
+        return std::max<unsigned>(1, std::thread::hardware_concurrency());
+    }
+    std::unique_ptr<Backend> nagisa_create_cpu_backend() { return std::make_unique<CPUBackend>(); }
+} // namespace nagisa
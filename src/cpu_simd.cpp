@@ -0,0 +1,633 @@
+// MIT License
+//
+// Copyright (c) 2020 椎名深雪
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+#include "cpu_simd.h"
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <sstream>
+namespace nagisa {
+    // Every op of the lane code maps to one helper below, most of which are a single intrinsic.
+    // Ops without a packed instruction (integer division, fmod, sin, cos) spill to the stack.
+    static const char *common_prelude = R"(#include <immintrin.h>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#define NGS_INLINE static inline __attribute__((always_inline))
+)";
+    // the OpenCL names of the types and of the f16 accessors, then the atomics
+    static const char *scalar_prelude = R"(#include <cstring>
+typedef unsigned int uint;
+typedef unsigned long ulong;
+typedef unsigned short half;
+static inline float vload_half(size_t i, const half *p) {
+    uint h = p[i], sign = (h & 0x8000u) << 16, e = (h >> 10) & 0x1f, m = h & 0x3ffu, x;
+    if (e == 0x1f) {
+        x = sign | 0x7f800000u | (m << 13);
+    } else if (e != 0) {
+        x = sign | ((e + 112) << 23) | (m << 13);
+    } else {
+        float f = (float)m * 5.9604645e-8f;
+        return sign ? -f : f;
+    }
+    float f;
+    std::memcpy(&f, &x, sizeof(f));
+    return f;
+}
+// rounds to nearest even
+static inline void vstore_half(float f, size_t i, half *p) {
+    uint x;
+    std::memcpy(&x, &f, sizeof(x));
+    uint sign = (x >> 16) & 0x8000u, m = x & 0x7fffffu, shift = 13;
+    int e = (int)((x >> 23) & 0xff) - 112;
+    if (e == 0xff - 112) {
+        p[i] = (half)(sign | 0x7c00u | (m ? 0x200u : 0u));
+        return;
+    }
+    if (e >= 0x1f || e < -10) {
+        p[i] = (half)(sign | (e >= 0x1f ? 0x7c00u : 0u));
+        return;
+    }
+    if (e <= 0) {
+        m |= 0x800000u;
+        shift = 14 - e;
+        e = 0;
+    }
+    uint r = ((uint)e << 10) + (m >> shift), rest = m & ((1u << shift) - 1), h = 1u << (shift - 1);
+    if (rest > h || (rest == h && (r & 1))) r++;
+    p[i] = (half)(sign | r);
+}
+#define NGS_ATOMIC_ADD(name, T)                                                                              \
+    static inline void name(T *p, T x) { __atomic_fetch_add(p, x, __ATOMIC_RELAXED); }
+// floats have no atomic add, retry a compare-and-swap instead
+#define NGS_ATOMIC_FADD(name, T)                                                                             \
+    static inline void name(T *p, T x) {                                                                     \
+        T old, next;                                                                                         \
+        __atomic_load(p, &old, __ATOMIC_RELAXED);                                                            \
+        do {                                                                                                 \
+            next = old + x;                                                                                  \
+        } while (!__atomic_compare_exchange(p, &old, &next, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED));      \
+    }
+#define NGS_ATOMIC_MINMAX(name, T, better)                                                                  \
+    static inline void name(T *p, T x) {                                                                     \
+        T old;                                                                                               \
+        __atomic_load(p, &old, __ATOMIC_RELAXED);                                                            \
+        while (x better old && !__atomic_compare_exchange(p, &old, &x, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) \
+            ;                                                                                                \
+    }
+#define NGS_ATOMICS(suffix, T, add)                                                                          \
+    add(atomic_add_##suffix, T)                                                                              \
+    NGS_ATOMIC_MINMAX(atomic_max_##suffix, T, >) NGS_ATOMIC_MINMAX(atomic_min_##suffix, T, <)
+NGS_ATOMICS(i, int, NGS_ATOMIC_ADD)
+NGS_ATOMICS(u, uint, NGS_ATOMIC_ADD)
+NGS_ATOMICS(l, long, NGS_ATOMIC_ADD)
+NGS_ATOMICS(ul, ulong, NGS_ATOMIC_ADD)
+NGS_ATOMICS(f, float, NGS_ATOMIC_FADD)
+NGS_ATOMICS(d, double, NGS_ATOMIC_FADD)
+)";
+    const char *nagisa_cpu_scalar_prelude() { return scalar_prelude; }
+    static const char *lanewise_prelude = R"(
+template <class F> NGS_INLINE vf map_f(vf a, F f) {
+    alignas(64) float x[W]; spill_f(x, a);
+    for (int i = 0; i < W; i++) x[i] = f(x[i]);
+    return fill_f(x);
+}
+template <class F> NGS_INLINE vf map_f(vf a, vf b, F f) {
+    alignas(64) float x[W], y[W]; spill_f(x, a); spill_f(y, b);
+    for (int i = 0; i < W; i++) x[i] = f(x[i], y[i]);
+    return fill_f(x);
+}
+template <class F> NGS_INLINE vi map_i(vi a, vi b, F f) {
+    alignas(64) int x[W], y[W]; spill_i(x, a); spill_i(y, b);
+    for (int i = 0; i < W; i++) x[i] = f(x[i], y[i]);
+    return fill_i(x);
+}
+NGS_INLINE vf mod_f(vf a, vf b) { return map_f(a, b, [](float x, float y) { return std::fmod(x, y); }); }
+NGS_INLINE vi div_i(vi a, vi b) { return map_i(a, b, [](int x, int y) { return y == 0 ? 0 : x / y; }); }
+NGS_INLINE vi mod_i(vi a, vi b) { return map_i(a, b, [](int x, int y) { return y == 0 ? 0 : x % y; }); }
+NGS_INLINE vf sin_f(vf a) { return map_f(a, [](float x) { return std::sin(x); }); }
+NGS_INLINE vf cos_f(vf a) { return map_f(a, [](float x) { return std::cos(x); }); }
+NGS_INLINE vi b2i(vb m) { alignas(64) int x[W]; spill_b(x, m); return fill_i(x); }
+NGS_INLINE vf b2f(vb m) { return i2f(b2i(m)); }
+NGS_INLINE vb load_b(const bool *p, size_t n) {
+    alignas(64) int x[W] = {0};
+    for (size_t i = 0; i < n; i++) x[i] = p[i];
+    return i2b(fill_i(x));
+}
+NGS_INLINE void store_b(bool *p, vb m, size_t n) {
+    alignas(64) int x[W]; spill_b(x, m);
+    for (size_t i = 0; i < n; i++) p[i] = x[i] != 0;
+}
+NGS_INLINE vb gather_b(const bool *p, vb m, vi idx) {
+    alignas(64) int x[W], y[W]; spill_b(x, m); spill_i(y, idx);
+    for (int i = 0; i < W; i++) x[i] = x[i] ? p[y[i]] : 0;
+    return i2b(fill_i(x));
+}
+template <class F> NGS_INLINE float fold_f(vf a, F f) {
+    alignas(64) float x[W]; spill_f(x, a);
+    for (int i = 1; i < W; i++) x[0] = f(x[0], x[i]);
+    return x[0];
+}
+template <class F> NGS_INLINE int fold_i(vi a, F f) {
+    alignas(64) int x[W]; spill_i(x, a);
+    for (int i = 1; i < W; i++) x[0] = f(x[0], x[i]);
+    return x[0];
+}
+NGS_INLINE float hadd_f(vf a) { return fold_f(a, [](float x, float y) { return x + y; }); }
+NGS_INLINE float hmax_f(vf a) { return fold_f(a, [](float x, float y) { return y > x ? y : x; }); }
+NGS_INLINE float hmin_f(vf a) { return fold_f(a, [](float x, float y) { return y < x ? y : x; }); }
+NGS_INLINE int hadd_i(vi a) { return fold_i(a, [](int x, int y) { return x + y; }); }
+NGS_INLINE int hmax_i(vi a) { return fold_i(a, [](int x, int y) { return y > x ? y : x; }); }
+NGS_INLINE int hmin_i(vi a) { return fold_i(a, [](int x, int y) { return y < x ? y : x; }); }
+NGS_INLINE void scatter_b(bool *p, vb m, vi idx, vb a) {
+    alignas(64) int k[W], j[W], x[W]; spill_b(k, m); spill_i(j, idx); spill_b(x, a);
+    for (int i = 0; i < W; i++) if (k[i]) p[j[i]] = x[i] != 0;
+}
+NGS_INLINE void scatter_add_f(float *p, vb m, vi idx, vf a) {
+    alignas(64) int k[W], j[W]; alignas(64) float x[W]; spill_b(k, m); spill_i(j, idx); spill_f(x, a);
+    for (int i = 0; i < W; i++) if (k[i]) atomic_add_f(p + j[i], x[i]);
+}
+NGS_INLINE void scatter_add_i(int *p, vb m, vi idx, vi a) {
+    alignas(64) int k[W], j[W], x[W]; spill_b(k, m); spill_i(j, idx); spill_i(x, a);
+    for (int i = 0; i < W; i++) if (k[i]) atomic_add_i(p + j[i], x[i]);
+}
+// f16 buffers hold half bits, converted to and from float lanes by fill_h/spill_h
+NGS_INLINE vf load_h(const half *p, size_t n) {
+    if (n == W) return fill_h(p);
+    alignas(64) half x[W] = {0};
+    for (size_t i = 0; i < n; i++) x[i] = p[i];
+    return fill_h(x);
+}
+NGS_INLINE void store_h(half *p, vf a, size_t n) {
+    if (n == W) { spill_h(p, a); return; }
+    alignas(64) half x[W]; spill_h(x, a);
+    for (size_t i = 0; i < n; i++) p[i] = x[i];
+}
+NGS_INLINE vf gather_h(const half *p, vb m, vi idx) {
+    alignas(64) int k[W], j[W]; alignas(64) half x[W]; spill_b(k, m); spill_i(j, idx);
+    for (int i = 0; i < W; i++) x[i] = k[i] ? p[j[i]] : 0;
+    return fill_h(x);
+}
+NGS_INLINE void scatter_h(half *p, vb m, vi idx, vf a) {
+    alignas(64) int k[W], j[W]; alignas(64) half x[W]; spill_b(k, m); spill_i(j, idx); spill_h(x, a);
+    for (int i = 0; i < W; i++) if (k[i]) p[j[i]] = x[i];
+}
+)";
+    static const char *avx2_prelude = R"(constexpr int W = 8;
+typedef __m256 vf;
+typedef __m256i vi;
+typedef __m256i vb;
+NGS_INLINE vi lane_ids() { return _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7); }
+NGS_INLINE vf const_f(float x) { return _mm256_set1_ps(x); }
+NGS_INLINE vi const_i(int x) { return _mm256_set1_epi32(x); }
+NGS_INLINE vb const_b(bool x) { return _mm256_set1_epi32(x ? -1 : 0); }
+NGS_INLINE vi iota(size_t base) { return _mm256_add_epi32(_mm256_set1_epi32((int)base), lane_ids()); }
+NGS_INLINE vb tail_mask(size_t n) { return _mm256_cmpgt_epi32(_mm256_set1_epi32((int)n), lane_ids()); }
+NGS_INLINE void spill_f(float *p, vf a) { _mm256_store_ps(p, a); }
+NGS_INLINE void spill_i(int *p, vi a) { _mm256_store_si256((__m256i *)p, a); }
+NGS_INLINE void spill_b(int *p, vb m) { _mm256_store_si256((__m256i *)p, _mm256_and_si256(m, _mm256_set1_epi32(1))); }
+NGS_INLINE vf fill_f(const float *p) { return _mm256_load_ps(p); }
+NGS_INLINE vi fill_i(const int *p) { return _mm256_load_si256((const __m256i *)p); }
+NGS_INLINE vf fill_h(const half *p) { return _mm256_cvtph_ps(_mm_loadu_si128((const __m128i *)p)); }
+NGS_INLINE void spill_h(half *p, vf a) {
+    _mm_storeu_si128((__m128i *)p, _mm256_cvtps_ph(a, _MM_FROUND_TO_NEAREST_INT));
+}
+NGS_INLINE vf add_f(vf a, vf b) { return _mm256_add_ps(a, b); }
+NGS_INLINE vf sub_f(vf a, vf b) { return _mm256_sub_ps(a, b); }
+NGS_INLINE vf mul_f(vf a, vf b) { return _mm256_mul_ps(a, b); }
+NGS_INLINE vf div_f(vf a, vf b) { return _mm256_div_ps(a, b); }
+NGS_INLINE vf sqrt_f(vf a) { return _mm256_sqrt_ps(a); }
+NGS_INLINE vf max_f(vf a, vf b) { return _mm256_max_ps(a, b); }
+NGS_INLINE vf min_f(vf a, vf b) { return _mm256_min_ps(a, b); }
+NGS_INLINE vi max_i(vi a, vi b) { return _mm256_max_epi32(a, b); }
+NGS_INLINE vi min_i(vi a, vi b) { return _mm256_min_epi32(a, b); }
+NGS_INLINE vi add_i(vi a, vi b) { return _mm256_add_epi32(a, b); }
+NGS_INLINE vi sub_i(vi a, vi b) { return _mm256_sub_epi32(a, b); }
+NGS_INLINE vi mul_i(vi a, vi b) { return _mm256_mullo_epi32(a, b); }
+NGS_INLINE vf neg_f(vf a) { return _mm256_xor_ps(a, _mm256_set1_ps(-0.0f)); }
+NGS_INLINE vi neg_i(vi a) { return _mm256_sub_epi32(_mm256_setzero_si256(), a); }
+NGS_INLINE vb not_b(vb m) { return _mm256_xor_si256(m, _mm256_set1_epi32(-1)); }
+NGS_INLINE vb and_b(vb a, vb b) { return _mm256_and_si256(a, b); }
+NGS_INLINE bool any_b(vb m) { return !_mm256_testz_si256(m, m); }
+NGS_INLINE vb eq_b(vb a, vb b) { return _mm256_cmpeq_epi32(a, b); }
+NGS_INLINE vb ne_b(vb a, vb b) { return _mm256_xor_si256(a, b); }
+NGS_INLINE vb lt_f(vf a, vf b) { return _mm256_castps_si256(_mm256_cmp_ps(a, b, _CMP_LT_OQ)); }
+NGS_INLINE vb le_f(vf a, vf b) { return _mm256_castps_si256(_mm256_cmp_ps(a, b, _CMP_LE_OQ)); }
+NGS_INLINE vb gt_f(vf a, vf b) { return _mm256_castps_si256(_mm256_cmp_ps(a, b, _CMP_GT_OQ)); }
+NGS_INLINE vb ge_f(vf a, vf b) { return _mm256_castps_si256(_mm256_cmp_ps(a, b, _CMP_GE_OQ)); }
+NGS_INLINE vb eq_f(vf a, vf b) { return _mm256_castps_si256(_mm256_cmp_ps(a, b, _CMP_EQ_OQ)); }
+NGS_INLINE vb ne_f(vf a, vf b) { return _mm256_castps_si256(_mm256_cmp_ps(a, b, _CMP_NEQ_UQ)); }
+NGS_INLINE vb lt_i(vi a, vi b) { return _mm256_cmpgt_epi32(b, a); }
+NGS_INLINE vb gt_i(vi a, vi b) { return _mm256_cmpgt_epi32(a, b); }
+NGS_INLINE vb le_i(vi a, vi b) { return not_b(gt_i(a, b)); }
+NGS_INLINE vb ge_i(vi a, vi b) { return not_b(lt_i(a, b)); }
+NGS_INLINE vb eq_i(vi a, vi b) { return _mm256_cmpeq_epi32(a, b); }
+NGS_INLINE vb ne_i(vi a, vi b) { return not_b(eq_i(a, b)); }
+NGS_INLINE vf select_f(vb m, vf a, vf b) { return _mm256_blendv_ps(b, a, _mm256_castsi256_ps(m)); }
+NGS_INLINE vi select_i(vb m, vi a, vi b) { return _mm256_blendv_epi8(b, a, m); }
+NGS_INLINE vb select_b(vb m, vb a, vb b) { return _mm256_blendv_epi8(b, a, m); }
+NGS_INLINE vf i2f(vi a) { return _mm256_cvtepi32_ps(a); }
+NGS_INLINE vi f2i(vf a) { return _mm256_cvttps_epi32(a); }
+NGS_INLINE vb i2b(vi a) { return not_b(_mm256_cmpeq_epi32(a, _mm256_setzero_si256())); }
+NGS_INLINE vb f2b(vf a) { return ne_f(a, _mm256_setzero_ps()); }
+NGS_INLINE vf load_f(const float *p, size_t n) {
+    return n == W ? _mm256_loadu_ps(p) : _mm256_maskload_ps(p, tail_mask(n));
+}
+NGS_INLINE vi load_i(const int *p, size_t n) {
+    return n == W ? _mm256_loadu_si256((const __m256i *)p) : _mm256_maskload_epi32(p, tail_mask(n));
+}
+NGS_INLINE void store_f(float *p, vf a, size_t n) {
+    if (n == W) _mm256_storeu_ps(p, a); else _mm256_maskstore_ps(p, tail_mask(n), a);
+}
+NGS_INLINE void store_i(int *p, vi a, size_t n) {
+    if (n == W) _mm256_storeu_si256((__m256i *)p, a); else _mm256_maskstore_epi32(p, tail_mask(n), a);
+}
+NGS_INLINE vf gather_f(const float *p, vb m, vi idx) {
+    return _mm256_mask_i32gather_ps(_mm256_setzero_ps(), p, idx, _mm256_castsi256_ps(m), 4);
+}
+NGS_INLINE vi gather_i(const int *p, vb m, vi idx) {
+    return _mm256_mask_i32gather_epi32(_mm256_setzero_si256(), p, idx, m, 4);
+}
+// AVX2 has no scatter instruction
+NGS_INLINE void scatter_f(float *p, vb m, vi idx, vf a) {
+    alignas(64) int k[W], j[W]; alignas(64) float x[W]; spill_b(k, m); spill_i(j, idx); spill_f(x, a);
+    for (int i = 0; i < W; i++) if (k[i]) p[j[i]] = x[i];
+}
+NGS_INLINE void scatter_i(int *p, vb m, vi idx, vi a) {
+    alignas(64) int k[W], j[W], x[W]; spill_b(k, m); spill_i(j, idx); spill_i(x, a);
+    for (int i = 0; i < W; i++) if (k[i]) p[j[i]] = x[i];
+}
+)";
+    static const char *avx512_prelude = R"(constexpr int W = 16;
+typedef __m512 vf;
+typedef __m512i vi;
+typedef __mmask16 vb;
+NGS_INLINE vi lane_ids() { return _mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15); }
+NGS_INLINE vf const_f(float x) { return _mm512_set1_ps(x); }
+NGS_INLINE vi const_i(int x) { return _mm512_set1_epi32(x); }
+NGS_INLINE vb const_b(bool x) { return x ? (vb)0xFFFF : (vb)0; }
+NGS_INLINE vi iota(size_t base) { return _mm512_add_epi32(_mm512_set1_epi32((int)base), lane_ids()); }
+NGS_INLINE vb tail_mask(size_t n) { return (vb)((1u << n) - 1u); }
+NGS_INLINE void spill_f(float *p, vf a) { _mm512_store_ps(p, a); }
+NGS_INLINE void spill_i(int *p, vi a) { _mm512_store_si512(p, a); }
+NGS_INLINE void spill_b(int *p, vb m) { _mm512_store_si512(p, _mm512_maskz_mov_epi32(m, _mm512_set1_epi32(1))); }
+NGS_INLINE vf fill_f(const float *p) { return _mm512_load_ps(p); }
+NGS_INLINE vi fill_i(const int *p) { return _mm512_load_si512(p); }
+NGS_INLINE vf fill_h(const half *p) { return _mm512_cvtph_ps(_mm256_loadu_si256((const __m256i *)p)); }
+NGS_INLINE void spill_h(half *p, vf a) {
+    _mm256_storeu_si256((__m256i *)p, _mm512_cvtps_ph(a, _MM_FROUND_TO_NEAREST_INT));
+}
+NGS_INLINE vf add_f(vf a, vf b) { return _mm512_add_ps(a, b); }
+NGS_INLINE vf sub_f(vf a, vf b) { return _mm512_sub_ps(a, b); }
+NGS_INLINE vf mul_f(vf a, vf b) { return _mm512_mul_ps(a, b); }
+NGS_INLINE vf div_f(vf a, vf b) { return _mm512_div_ps(a, b); }
+NGS_INLINE vf sqrt_f(vf a) { return _mm512_sqrt_ps(a); }
+NGS_INLINE vf max_f(vf a, vf b) { return _mm512_max_ps(a, b); }
+NGS_INLINE vf min_f(vf a, vf b) { return _mm512_min_ps(a, b); }
+NGS_INLINE vi max_i(vi a, vi b) { return _mm512_max_epi32(a, b); }
+NGS_INLINE vi min_i(vi a, vi b) { return _mm512_min_epi32(a, b); }
+NGS_INLINE vi add_i(vi a, vi b) { return _mm512_add_epi32(a, b); }
+NGS_INLINE vi sub_i(vi a, vi b) { return _mm512_sub_epi32(a, b); }
+NGS_INLINE vi mul_i(vi a, vi b) { return _mm512_mullo_epi32(a, b); }
+NGS_INLINE vf neg_f(vf a) { return _mm512_xor_ps(a, _mm512_set1_ps(-0.0f)); }
+NGS_INLINE vi neg_i(vi a) { return _mm512_sub_epi32(_mm512_setzero_si512(), a); }
+NGS_INLINE vb not_b(vb m) { return (vb)~m; }
+NGS_INLINE vb and_b(vb a, vb b) { return (vb)(a & b); }
+NGS_INLINE bool any_b(vb m) { return m != 0; }
+NGS_INLINE vb eq_b(vb a, vb b) { return (vb)~(a ^ b); }
+NGS_INLINE vb ne_b(vb a, vb b) { return (vb)(a ^ b); }
+NGS_INLINE vb lt_f(vf a, vf b) { return _mm512_cmp_ps_mask(a, b, _CMP_LT_OQ); }
+NGS_INLINE vb le_f(vf a, vf b) { return _mm512_cmp_ps_mask(a, b, _CMP_LE_OQ); }
+NGS_INLINE vb gt_f(vf a, vf b) { return _mm512_cmp_ps_mask(a, b, _CMP_GT_OQ); }
+NGS_INLINE vb ge_f(vf a, vf b) { return _mm512_cmp_ps_mask(a, b, _CMP_GE_OQ); }
+NGS_INLINE vb eq_f(vf a, vf b) { return _mm512_cmp_ps_mask(a, b, _CMP_EQ_OQ); }
+NGS_INLINE vb ne_f(vf a, vf b) { return _mm512_cmp_ps_mask(a, b, _CMP_NEQ_UQ); }
+NGS_INLINE vb lt_i(vi a, vi b) { return _mm512_cmp_epi32_mask(a, b, _MM_CMPINT_LT); }
+NGS_INLINE vb le_i(vi a, vi b) { return _mm512_cmp_epi32_mask(a, b, _MM_CMPINT_LE); }
+NGS_INLINE vb gt_i(vi a, vi b) { return _mm512_cmp_epi32_mask(a, b, _MM_CMPINT_NLE); }
+NGS_INLINE vb ge_i(vi a, vi b) { return _mm512_cmp_epi32_mask(a, b, _MM_CMPINT_NLT); }
+NGS_INLINE vb eq_i(vi a, vi b) { return _mm512_cmp_epi32_mask(a, b, _MM_CMPINT_EQ); }
+NGS_INLINE vb ne_i(vi a, vi b) { return _mm512_cmp_epi32_mask(a, b, _MM_CMPINT_NE); }
+NGS_INLINE vf select_f(vb m, vf a, vf b) { return _mm512_mask_blend_ps(m, b, a); }
+NGS_INLINE vi select_i(vb m, vi a, vi b) { return _mm512_mask_blend_epi32(m, b, a); }
+NGS_INLINE vb select_b(vb m, vb a, vb b) { return (vb)((m & a) | (~m & b)); }
+NGS_INLINE vf i2f(vi a) { return _mm512_cvtepi32_ps(a); }
+NGS_INLINE vi f2i(vf a) { return _mm512_cvttps_epi32(a); }
+NGS_INLINE vb i2b(vi a) { return _mm512_test_epi32_mask(a, a); }
+NGS_INLINE vb f2b(vf a) { return ne_f(a, _mm512_setzero_ps()); }
+NGS_INLINE vf load_f(const float *p, size_t n) { return _mm512_maskz_loadu_ps(tail_mask(n), p); }
+NGS_INLINE vi load_i(const int *p, size_t n) { return _mm512_maskz_loadu_epi32(tail_mask(n), p); }
+NGS_INLINE void store_f(float *p, vf a, size_t n) { _mm512_mask_storeu_ps(p, tail_mask(n), a); }
+NGS_INLINE void store_i(int *p, vi a, size_t n) { _mm512_mask_storeu_epi32(p, tail_mask(n), a); }
+NGS_INLINE vf gather_f(const float *p, vb m, vi idx) {
+    return _mm512_mask_i32gather_ps(_mm512_setzero_ps(), m, idx, p, 4);
+}
+NGS_INLINE vi gather_i(const int *p, vb m, vi idx) {
+    return _mm512_mask_i32gather_epi32(_mm512_setzero_si512(), m, idx, p, 4);
+}
+NGS_INLINE void scatter_f(float *p, vb m, vi idx, vf a) { _mm512_mask_i32scatter_ps(p, m, idx, a, 4); }
+NGS_INLINE void scatter_i(int *p, vb m, vi idx, vi a) { _mm512_mask_i32scatter_epi32(p, m, idx, a, 4); }
+)";
+
+    SimdISA nagisa_detect_simd_isa() {
+        if (auto env = std::getenv("NAGISA_SIMD")) {
+            if (std::strcmp(env, "scalar") == 0) {
+                return SimdISA::scalar;
+            } else if (std::strcmp(env, "avx2") == 0) {
+                return SimdISA::avx2;
+            } else if (std::strcmp(env, "avx512") == 0) {
+                return SimdISA::avx512;
+            }
+            std::cerr << "unknown NAGISA_SIMD " << env << std::endl;
+            exit(1);
+        }
+#if defined(__x86_64__) || defined(__i386__)
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw") &&
+            __builtin_cpu_supports("avx512dq") && __builtin_cpu_supports("avx512vl")) {
+            return SimdISA::avx512;
+        }
+        if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma") && __builtin_cpu_supports("f16c")) {
+            return SimdISA::avx2;
+        }
+#endif
+        return SimdISA::scalar;
+    }
+    size_t nagisa_simd_width(SimdISA isa) {
+        switch (isa) {
+        case SimdISA::avx2:
+            return 8;
+        case SimdISA::avx512:
+            return 16;
+        default:
+            return 1;
+        }
+    }
+    const char *nagisa_simd_flags(SimdISA isa) {
+        switch (isa) {
+        case SimdISA::avx2:
+            return "-mavx2 -mfma -mf16c";
+        case SimdISA::avx512:
+            return "-mavx2 -mfma -mf16c -mavx512f -mavx512bw -mavx512dq -mavx512vl";
+        default:
+            return "";
+        }
+    }
+    // suffix of the lanes holding values of `type`, f16 values are computed in float lanes
+    static char type_suffix(Type type) {
+        switch (type) {
+        case Type::f32:
+        case Type::f16:
+            return 'f';
+        case Type::i32:
+            return 'i';
+        case Type::boolean:
+            return 'b';
+        default:
+            NGS_ASSERT(false);
+        }
+        return 0;
+    }
+    // suffix of the load/store helpers of a buffer
+    static char buffer_suffix(Type type) { return type == Type::f16 ? 'h' : type_suffix(type); }
+    static bool has_lanes(Type type) {
+        return type == Type::f32 || type == Type::f16 || type == Type::i32 || type == Type::boolean;
+    }
+    bool nagisa_simd_supports(const Kernel &kernel) {
+        auto buffer_ok = [](const std::pair<int, Type> &b) { return has_lanes(b.second); };
+        // the tile offset of ThreadIdx is added to the scalar base, it never gets lanes of its own
+        std::vector<bool> offset(kernel.params.size(), false);
+        for (auto &s : kernel.stmts) {
+            if (s.kind == StmtKind::ThreadIdx && s.param >= 0) {
+                offset[s.param] = true;
+            }
+        }
+        for (size_t i = 0; i < kernel.params.size(); i++) {
+            if (!offset[i] && !has_lanes(kernel.params[i].type)) {
+                return false;
+            }
+        }
+        return std::all_of(kernel.local_types.begin(), kernel.local_types.end(), has_lanes) &&
+               std::all_of(kernel.buffers.begin(), kernel.buffers.end(), buffer_ok);
+    }
+    static const char *simd_op_name(Opcode op) {
+        switch (op) {
+        case FAdd:
+            return "add";
+        case FSub:
+            return "sub";
+        case FMul:
+            return "mul";
+        case FDiv:
+            return "div";
+        case Mod:
+            return "mod";
+        case CmpLt:
+            return "lt";
+        case CmpLe:
+            return "le";
+        case CmpGt:
+            return "gt";
+        case CmpGe:
+            return "ge";
+        case CmpEq:
+            return "eq";
+        case CmpNe:
+            return "ne";
+        case Sin:
+            return "sin";
+        case Cos:
+            return "cos";
+        case Sqrt:
+            return "sqrt";
+        case Neg:
+            return "neg";
+        default:
+            return nullptr;
+        }
+    }
+    std::string nagisa_emit_cpu_prologue(const Kernel &kernel) {
+        std::ostringstream out;
+        out << "extern \"C\" void nagisa_kernel(void *const *args, size_t begin, size_t end){\n";
+        for (size_t i = 0; i < kernel.buffers.size(); i++) {
+            auto type = buffer_type_str(kernel.buffers[i].second);
+            out << type << " * __restrict__ buffer" << i << " = (" << type << " *)args[" << i
+                << "];\n";
+        }
+        for (size_t i = 0; i < kernel.params.size(); i++) {
+            auto type = param_type_str(kernel.params[i].type);
+            out << "const " << type << " p" << i << " = *(const " << type << " *)args["
+                << kernel.buffers.size() + i << "];\n";
+        }
+        return out.str();
+    }
+    std::string nagisa_emit_simd_kernel(const Kernel &kernel, SimdISA isa) {
+        NGS_ASSERT(isa != SimdISA::scalar && nagisa_simd_supports(kernel));
+        std::ostringstream out;
+        out << common_prelude << scalar_prelude << (isa == SimdISA::avx2 ? avx2_prelude : avx512_prelude)
+            << lanewise_prelude;
+        auto var = [](int i) { return std::string("v").append(std::to_string(i)); };
+        // v<i> converted to lanes of type `to`
+        auto arg = [&](int i, Type to) {
+            auto from = type_suffix(kernel.local_types.at(i));
+            if (from == type_suffix(to)) {
+                return var(i);
+            }
+            return std::string(1, from) + "2" + type_suffix(to) + "(" + var(i) + ")";
+        };
+        auto vtype = [](Type type) { return std::string("v") + type_suffix(type); };
+        out << nagisa_emit_cpu_prologue(kernel);
+        for (auto &s : kernel.stmts) {
+            if (nagisa_is_reduction(s)) {
+                out << vtype(s.type) << " r" << s.var << " = const_" << type_suffix(s.type) << "("
+                    << nagisa_reduction_identity(s.inst.op, s.type) << ");\n";
+            }
+        }
+        out << "for(size_t base = begin; base < end; base += W){\n";
+        out << "size_t n = end - base < (size_t)W ? end - base : (size_t)W;\n";
+        out << "vb tail = tail_mask(n);\n";
+        // lanes running the innermost region, every region runs while any of its lanes is active
+        std::vector<std::string> active{"tail"};
+        auto mask = [](int i) { return std::string("m").append(std::to_string(i)); };
+        for (auto &s : kernel.stmts) {
+            switch (s.kind) {
+            case StmtKind::LoopBegin:
+                out << "{ vb " << mask(s.var) << " = " << active.back() << ";\nwhile (1) {\n";
+                active.push_back(mask(s.var));
+                continue;
+            case StmtKind::LoopCond: {
+                auto m = mask(s.inst.operand[1]);
+                out << m << " = and_b(" << m << ", " << arg(s.inst.operand[0], Type::boolean) << ");\n";
+                out << "if (!any_b(" << m << ")) break;\n";
+                continue;
+            }
+            case StmtKind::IfBegin:
+                out << "{ vb " << mask(s.var) << " = and_b(" << active.back() << ", "
+                    << arg(s.inst.operand[0], Type::boolean) << ");\nif (any_b(" << mask(s.var) << ")) {\n";
+                active.push_back(mask(s.var));
+                continue;
+            case StmtKind::PhiUpdate:
+                // inactive lanes keep the value they left the region with
+                out << var(s.var) << " = select_" << type_suffix(s.type) << "(" << mask(s.inst.operand[1]) << ", "
+                    << arg(s.inst.operand[0], s.type) << ", " << var(s.var) << ");\n";
+                continue;
+            case StmtKind::RegionEnd:
+                out << "}}\n";
+                active.pop_back();
+                continue;
+            default:
+                break;
+            }
+            if (s.kind == StmtKind::Write) {
+                out << "store_" << buffer_suffix(kernel.buffers[s.buffer].second) << "(buffer" << s.buffer
+                    << " + base, " << var(s.var) << ", n);\n";
+                continue;
+            }
+            if (nagisa_is_reduction(s)) {
+                // lanes past the end keep the running value
+                auto r = "r" + std::to_string(s.var);
+                auto name = nagisa_reduction_name(s.inst.op);
+                auto t = type_suffix(s.type);
+                out << r << " = select_" << t << "(tail, " << name << "_" << t << "(" << r << ", "
+                    << arg(s.inst.operand[0], s.type) << "), " << r << ");\n";
+                continue;
+            }
+            if (nagisa_is_store(s)) {
+                auto &inst = s.inst;
+                auto t = kernel.buffers[s.buffer].second;
+                out << (inst.op == Store ? "scatter_" : "scatter_add_") << buffer_suffix(t) << "(buffer" << s.buffer
+                    << ", and_b(tail, " << arg(inst.operand[2], Type::boolean) << "), "
+                    << arg(inst.operand[0], Type::i32) << ", " << arg(inst.operand[1], t) << ");\n";
+                continue;
+            }
+            out << vtype(s.type) << " " << var(s.var) << " = ";
+            auto &inst = s.inst;
+            // only computed statements carry an opcode
+            auto op = s.kind == StmtKind::Compute ? inst.op : ConstantInt;
+            if (s.kind == StmtKind::ThreadIdx) {
+                auto base = s.param >= 0 ? "base + (size_t)p" + std::to_string(s.param) : std::string("base");
+                auto lanes = "iota(" + base + ")";
+                out << (s.type == Type::i32 ? lanes : std::string("i2") + type_suffix(s.type) + "(" + lanes + ")");
+            } else if (s.kind == StmtKind::Param) {
+                out << "const_" << type_suffix(s.type) << "(p" << s.param << ")";
+            } else if (s.kind == StmtKind::Read) {
+                out << "load_" << buffer_suffix(kernel.buffers[s.buffer].second) << "(buffer" << s.buffer
+                    << " + base, n)";
+            } else if (s.kind == StmtKind::ReadUniform) {
+                auto buffer = "buffer" + std::to_string(s.buffer);
+                out << "const_" << type_suffix(s.type) << "("
+                    << (kernel.buffers[s.buffer].second == Type::f16 ? "vload_half(0, " + buffer + ")" : buffer + "[0]")
+                    << ")";
+            } else if (op == ConstantInt || op == ConstantFloat) {
+                out << "const_" << type_suffix(s.type) << "(" << nagisa_const_str(inst, s.type) << ")";
+            } else if (op == FAdd || op == FSub || op == FMul || op == FDiv || op == Mod) {
+                auto t = s.type == Type::boolean ? Type::i32 : s.type;
+                auto expr = std::string(simd_op_name(op)) + "_" + type_suffix(t) + "(" + arg(inst.operand[0], t) +
+                            ", " + arg(inst.operand[1], t) + ")";
+                out << (t == s.type ? expr : "i2b(" + expr + ")");
+            } else if (op == Neg) {
+                auto t = s.type == Type::boolean ? Type::i32 : s.type;
+                auto expr = std::string("neg_") + type_suffix(t) + "(" + arg(inst.operand[0], t) + ")";
+                out << (t == s.type ? expr : "i2b(" + expr + ")");
+            } else if (op >= CmpLt && op <= CmpNe) {
+                auto ta = kernel.local_types.at(inst.operand[0]);
+                auto tb = kernel.local_types.at(inst.operand[1]);
+                auto t = Type::i32;
+                if (type_suffix(ta) == 'f' || type_suffix(tb) == 'f') {
+                    t = Type::f32;
+                } else if (ta == Type::boolean && tb == Type::boolean && (op == CmpEq || op == CmpNe)) {
+                    t = Type::boolean;
+                }
+                out << simd_op_name(op) << "_" << type_suffix(t) << "(" << arg(inst.operand[0], t) << ", "
+                    << arg(inst.operand[1], t) << ")";
+            } else if (op == Select) {
+                out << "select_" << type_suffix(s.type) << "(" << arg(inst.operand[0], Type::boolean) << ", "
+                    << arg(inst.operand[1], s.type) << ", " << arg(inst.operand[2], s.type) << ")";
+            } else if (op == Sin || op == Cos || op == Sqrt) {
+                auto expr = std::string(simd_op_name(op)) + "_f(" + arg(inst.operand[0], Type::f32) + ")";
+                out << (type_suffix(s.type) == 'f' ? expr : std::string("f2") + type_suffix(s.type) + "(" + expr + ")");
+            } else if (op == Phi || op == RegionOut || op == Cast) {
+                out << arg(inst.operand[0], s.type);
+            } else if (op == Load) {
+                // lanes past the end of the range must not touch memory
+                out << "gather_" << buffer_suffix(kernel.buffers[s.buffer].second) << "(buffer" << s.buffer
+                    << ", and_b(" << active.back() << ", " << arg(inst.operand[1], Type::boolean) << "), "
+                    << arg(inst.operand[2], Type::i32) << ")";
+            } else {
+                NGS_ASSERT(false);
+            }
+            out << ";\n";
+        }
+        out << "}\n";
+        // one atomic per chunk
+        for (auto &s : kernel.stmts) {
+            if (nagisa_is_reduction(s)) {
+                auto name = nagisa_reduction_name(s.inst.op);
+                auto t = type_suffix(s.type);
+                out << "atomic_" << name << "_" << t << "(buffer" << s.buffer << ", h" << name << "_" << t << "(r" << s.var
+                    << "));\n";
+            }
+        }
+        out << "}";
+        return out.str();
+    }
+} // namespace nagisa
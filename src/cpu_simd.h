@@ -0,0 +1,39 @@
+// MIT License
+//
+// Copyright (c) 2020 椎名深雪
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#pragma once
+#include "backend.h"
+namespace nagisa {
+    enum class SimdISA { scalar, avx2, avx512 };
+    // picks the widest ISA the host supports, NAGISA_SIMD=scalar|avx2|avx512 overrides it
+    SimdISA nagisa_detect_simd_isa();
+    size_t nagisa_simd_width(SimdISA isa);
+    // compiler flags that enable the ISA for generated kernels
+    const char *nagisa_simd_flags(SimdISA isa);
+    // whether every value of the kernel has packed lanes: f32, f16 (in f32 lanes), i32 and bool
+    bool nagisa_simd_supports(const Kernel &kernel);
+    std::string nagisa_emit_simd_kernel(const Kernel &kernel, SimdISA isa);
+    // signature of the entry point plus the unpacking of buffer and param arguments
+    std::string nagisa_emit_cpu_prologue(const Kernel &kernel);
+    // the OpenCL type names and f16 accessors the shared scalar body relies on, and the atomic_<op>_<suffix> helpers
+    const char *nagisa_cpu_scalar_prelude();
+} // namespace nagisa
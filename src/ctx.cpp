@@ -21,452 +21,1586 @@
 // SOFTWARE.
 #include <algorithm>
 #include <nagisa/nagisa.hpp>
-#include <cl/cl.hpp>
-#include <list>
+#include "context.h"
+#include "passes.h"
+#include "profiler.h"
+#include <cstdlib>
+#include <cstring>
 #include <sstream>
 #include <iostream>
 #include <array>
-#include <map>
-#include <unordered_map>
-#include <unordered_set>
+#include <atomic>
+#include <limits>
 namespace nagisa {
-    template <size_t DEFAULT_BLOCK_SIZE = 262144ull>
-    class MemoryArena {
-        static constexpr size_t align16(size_t x) { return (x + 15ULL) & (~15ULL); }
-
-        struct Block {
-            size_t size;
-            uint8_t *data;
-
-            Block(uint8_t *data, size_t size) : size(size), data(data) {
-                //                log::log("???\n");
-            }
-
-            ~Block() = default;
-        };
-
-        std::list<Block> availableBlocks, usedBlocks;
-
-        size_t currentBlockPos = 0;
-        Block currentBlock;
-
-      public:
-        MemoryArena() : currentBlock(new uint8_t[DEFAULT_BLOCK_SIZE], DEFAULT_BLOCK_SIZE) {}
-
-        uint8_t *alloc(size_t size) {
-            typename std::list<Block>::iterator iter;
-            auto allocSize = size;
-
-            uint8_t *p = nullptr;
-            if (currentBlockPos + allocSize > currentBlock.size) {
-                usedBlocks.emplace_front(currentBlock);
-                currentBlockPos = 0;
-                for (iter = availableBlocks.begin(); iter != availableBlocks.end(); iter++) {
-                    if (iter->size >= allocSize) {
-                        currentBlockPos = allocSize;
-                        currentBlock = *iter;
-                        availableBlocks.erase(iter);
-                        break;
-                    }
-                }
-                if (iter == availableBlocks.end()) {
-                    auto sz = std::max<size_t>(allocSize, DEFAULT_BLOCK_SIZE);
-                    currentBlock = Block(new uint8_t[sz], sz);
+    // the backend and the buffer pool, shared by every context
+    struct Device {
+        std::unique_ptr<Backend> backend;
+        std::unique_ptr<BufferAllocator> allocator;
+        // the context nagisa_init made current on its thread, destroyed by nagisa_destroy
+        Context *main = nullptr;
+        // contexts of nagisa_create_context not destroyed yet
+        std::atomic<int> contexts{0};
+    };
+    static std::unique_ptr<Device> device;
+    static thread_local Context *ctx = nullptr;
+    void nagisa_add_predefined();
+    static std::unique_ptr<Backend> create_backend(BackendType type) {
+        if (type == BackendType::automatic) {
+            if (auto env = std::getenv("NAGISA_BACKEND")) {
+                if (std::strcmp(env, "cpu") == 0) {
+                    type = BackendType::cpu;
+                } else if (std::strcmp(env, "opencl") == 0) {
+                    type = BackendType::opencl;
+                } else {
+                    std::cerr << "unknown NAGISA_BACKEND " << env << std::endl;
+                    exit(1);
                 }
             }
-            p = currentBlock.data + currentBlockPos;
-            currentBlockPos += allocSize;
-            return p;
-        }
-
-        void reset() {
-            currentBlockPos = 0;
-            availableBlocks.splice(availableBlocks.begin(), usedBlocks);
         }
-
-        ~MemoryArena() {
-            delete[] currentBlock.data;
-            for (auto i : availableBlocks) {
-                delete[] i.data;
-            }
-            for (auto i : usedBlocks) {
-                delete[] i.data;
-            }
+        if (type == BackendType::cpu) {
+            return nagisa_create_cpu_backend();
         }
-    };
-
-    struct OCLContext {
-        cl::Platform platform;
-        cl::Device device;
-        cl::Context context;
-        cl::CommandQueue queue;
-        OCLContext() {
-            std::vector<cl::Platform> all_platforms;
-            cl::Platform::get(&all_platforms);
-
-            if (all_platforms.size() == 0) {
-                std::cout << " No platforms found. Check OpenCL installation!\n";
+        auto backend = nagisa_create_opencl_backend();
+        if (!backend) {
+            if (type == BackendType::opencl) {
+                std::cerr << "OpenCL backend is not available" << std::endl;
                 exit(1);
             }
-            cl::Platform default_platform = all_platforms[0];
-            std::cout << "Using platform: " << default_platform.getInfo<CL_PLATFORM_NAME>() << "\n";
-            platform = default_platform;
-            std::vector<cl::Device> all_devices;
-            default_platform.getDevices(CL_DEVICE_TYPE_GPU, &all_devices);
-            if (all_devices.size() == 0) {
-                std::cout << " No devices found. Check OpenCL installation!\n";
-                exit(1);
+            if (nagisa_logging()) {
+                std::cerr << "Falling back to CPU backend\n";
             }
-
-            cl::Device default_device = all_devices[0];
-            std::cout << "Using device: " << default_device.getInfo<CL_DEVICE_NAME>() << "\n";
-            device = default_device;
-            context = cl::Context({device});
-            queue = cl::CommandQueue(context, device);
+            return nagisa_create_cpu_backend();
         }
-    };
-    static std::unique_ptr<OCLContext> ocl_ctx = nullptr;
-    struct Value {
-        Instruction inst;
-        Type type;
-        int idx = 0;
-        int buf_idx = -1;
-        size_t size = 1;
-        int _ref_int = 0;
-        int _ref_ext = 0;
-        int _last_sync_time = -1;
-    };
-    class Context {
-      public:
-        int _time = 0;
-        size_t cur_var = -1;
-        size_t cur_size = 1;
-        std::unordered_set<int> live;
-        std::unordered_map<size_t, Value> vars;
-        std::map<int, std::unique_ptr<DeviceBuffer>> buffers;
-        std::unordered_map<std::string, cl::Program> kernel_cache;
-        MemoryArena<> arena;
-    };
-    static std::unique_ptr<Context> ctx = nullptr;
-    void nagisa_add_predefined();
-    void nagisa_init() {
-        ctx = std::make_unique<Context>();
-        ocl_ctx = std::make_unique<OCLContext>();
+        return backend;
+    }
+    void nagisa_init(BackendType backend) {
+        NGS_ASSERT(!device);
+        nagisa_profiler_init();
+        device = std::make_unique<Device>();
+        device->backend = create_backend(backend);
+        device->allocator = std::make_unique<BufferAllocator>(device->backend.get());
+        device->main = nagisa_create_context();
+        nagisa_set_context(device->main);
     }
     void nagisa_destroy() {
-        ocl_ctx = nullptr;
-        ctx = nullptr;
+        if (device) {
+            // the contexts of nagisa_create_context are destroyed first
+            NGS_ASSERT(device->contexts == 1);
+            if (ctx == device->main) {
+                ctx = nullptr;
+            }
+            nagisa_destroy_context(device->main);
+        }
+        device = nullptr;
+        nagisa_profiler_destroy();
     }
-    void nagisa_set_var_size(int idx, size_t s) {
-        NGS_ASSERT(ctx->vars.at(idx).buf_idx == -1);
-        ctx->vars.at(idx).size = s;
+    Context *nagisa_create_context() {
+        // nagisa_init creates the device
+        NGS_ASSERT(device);
+        auto c = new Context();
+        c->backend = device->backend.get();
+        c->allocator = device->allocator.get();
+        c->stream = c->backend->create_stream();
+        if (auto env = std::getenv("NAGISA_TILE_BUDGET")) {
+            c->tile_budget = std::strtoull(env, nullptr, 10);
+        }
+        if (auto env = std::getenv("NAGISA_OPS_PER_BYTE")) {
+            c->ops_per_byte = std::strtof(env, nullptr);
+        }
+        if (auto env = std::getenv("NAGISA_BACKGROUND_COMPILE")) {
+            c->background_compile = std::strtoull(env, nullptr, 10);
+        }
+        device->contexts++;
+        return c;
+    }
+    void nagisa_destroy_context(Context *c) {
+        NGS_ASSERT(c != ctx);
+        // device timings of the last launches arrive once they are done
+        c->backend->synchronize(c->stream.get());
+        delete c;
+        device->contexts--;
+    }
+    Context *nagisa_set_context(Context *c) {
+        auto prev = ctx;
+        ctx = c;
+        return prev;
     }
+    Context *nagisa_get_context() { return ctx; }
     int nagisa_buffer_id(int idx) {
-        // NGS_ASSERT(ctx->vars.at(idx).buf_idx != -1);
-        return ctx->vars.at(idx).buf_idx;
+        // NGS_ASSERT(ctx->vars[idx].buf_idx != -1);
+        return ctx->vars[idx].buf_idx;
     }
+    void nagisa_free_var(int i);
     void nagisa_inc_int(int idx) {
         if (idx < (int)Predefined::Total)
             return;
-        ctx->vars.at(idx)._ref_int++;
+        ctx->vars[idx]._ref_int++;
     }
     void nagisa_dec_int(int idx) {
         if (idx < (int)Predefined::Total)
             return;
-        ctx->vars.at(idx)._ref_int--;
+        auto &v = ctx->vars[idx];
+        NGS_ASSERT(v._ref_int > 0);
+        if (--v._ref_int == 0 && v._ref_ext == 0) {
+            nagisa_free_var(idx);
+        }
     }
     void nagisa_inc_ext(int idx) {
         if (idx < (int)Predefined::Total)
             return;
-        ctx->vars.at(idx)._ref_ext++;
+        ctx->vars[idx]._ref_ext++;
     }
     void nagisa_dec_ext(int idx) {
         if (idx < (int)Predefined::Total)
             return;
-        NGS_ASSERT(ctx->vars.at(idx)._ref_ext > 0);
-        ctx->vars.at(idx)._ref_ext--;
-        if (ctx->vars.at(idx)._ref_ext == 0) {
-            ctx->live.erase(idx);
+        auto &v = ctx->vars[idx];
+        NGS_ASSERT(v._ref_ext > 0);
+        if (--v._ref_ext == 0) {
+            ctx->live.reset(idx);
+            if (v._ref_int == 0) {
+                nagisa_free_var(idx);
+            }
         }
     }
-    int nagisa_ref_ext(int idx) { return ctx->vars.at(idx)._ref_ext; }
+    int nagisa_ref_ext(int idx) { return ctx->vars[idx]._ref_ext; }
     void nagisa_add_predefined() {
         auto &vars = ctx->vars;
-        NGS_ASSERT(vars.empty());
-        Value vs[(int)Predefined::Total];
-        vs[(int)Predefined::ThreadIdx].idx = (int)Predefined::ThreadIdx;
-        vs[(int)Predefined::ThreadIdx].type = Type::i32;
+        NGS_ASSERT(vars.size() == 0);
         for (int i = 0; i < (int)Predefined::Total; i++) {
-            vars[i] = vs[i];
+            NGS_ASSERT(vars.alloc(i - 1) == i);
         }
-        ctx->cur_var = (int)Predefined::Total - 1;
+        vars[(int)Predefined::ThreadIdx].type = Type::i64;
     }
-    class OCLBuffer : public DeviceBuffer {
-        cl::Buffer buffer;
-
-      public:
-        size_t _size;
-        OCLBuffer(Type type, size_t s) : DeviceBuffer(type), _size(s), buffer(ocl_ctx->context, CL_MEM_READ_WRITE, s) {}
-        size_t size() { return _size; }
-        void write(const uint8_t *p, size_t bytes, size_t offset) {
-            ocl_ctx->queue.enqueueWriteBuffer(buffer, CL_TRUE, offset, bytes, p);
-        }
-        void read(uint8_t *p, size_t bytes, size_t offset) {
-            ocl_ctx->queue.enqueueReadBuffer(buffer, CL_TRUE, offset, bytes, p);
-        }
-        void *get() override { return buffer(); }
-    };
     std::pair<DeviceBuffer *, int32_t> nagisa_alloc(size_t s, Type type) {
-        auto buffer = std::make_unique<OCLBuffer>(type, s);
+        auto buffer = ctx->allocator->alloc(s, type);
         auto p = buffer.get();
-        ctx->buffers.emplace(ctx->buffers.size(), std::move(buffer));
-        return {p, (int)ctx->buffers.size() - 1};
+        // ids are never reused, so a var keeps naming the same buffer for its whole life
+        int id = ctx->next_buffer_id++;
+        ctx->buffers.emplace(id, std::move(buffer));
+        return {p, id};
     }
     void nagisa_free(DeviceBuffer *) {}
-    int nagisa_trace_append(const Instruction &i, Type type) {
-        if (ctx->vars.empty()) {
+    MemoryStats nagisa_memory_stats() {
+        auto stats = ctx->allocator->stats();
+        for (auto &s : ctx->spills) {
+            stats.spilled_bytes += s.second->size();
+        }
+        return stats;
+    }
+    void nagisa_trim_memory(size_t bytes) { ctx->allocator->trim(bytes); }
+    void nagisa_set_tile_budget(size_t bytes) { ctx->tile_budget = bytes; }
+    void nagisa_set_ops_per_byte(float ops) { ctx->ops_per_byte = ops; }
+    // whether a hash-consing entry still names the var it was made for
+    static bool var_alive(int idx, uint32_t generation) {
+        return !ctx->vars.is_free(idx) && ctx->vars[idx].generation == generation;
+    }
+    // an existing value handed out again may already have been dropped from live
+    static int reuse_var(int idx) {
+        auto &v = ctx->vars[idx];
+        if (idx >= (int)Predefined::Total && v._last_sync_time == -1 && v.region == -1) {
+            ctx->live.set(idx);
+        }
+        return idx;
+    }
+    static void fail_if_recording(const char *what) {
+        if (!ctx->recording.empty()) {
+            std::cerr << what << " inside a recorded loop or if_" << std::endl;
+            exit(1);
+        }
+    }
+    // a recorded var is only emitted inside its region, so nothing outside of it can read it
+    static void check_scope(int idx) {
+        if (idx >= (int)Predefined::Total && ctx->vars[idx].region >= 0) {
+            std::cerr << "a value computed inside a loop or if_ is used outside of it" << std::endl;
+            exit(1);
+        }
+    }
+    static int recording_scope() { return -1 - (int)ctx->recording.size(); }
+    // a var appended while recording belongs to the innermost region, which emits it
+    static void record(int idx) {
+        auto &rec = ctx->recording.back();
+        auto &v = ctx->vars[idx];
+        v.region = recording_scope();
+        (rec.in_body ? rec.body : rec.head).emplace_back(idx, v.generation);
+    }
+    // a var with queued stores, or a reduction, is only complete after it ran over all of its lanes
+    static bool needs_flush(int idx) {
+        if (idx < (int)Predefined::Total) {
+            return false;
+        }
+        auto &v = ctx->vars[idx];
+        return v.pending_stores > 0 || (nagisa_is_reduction(v.inst.op) && !ctx->evaluated.test(idx));
+    }
+    void nagisa_schedule(int idx) {
+        check_scope(idx);
+        if (idx < (int)Predefined::Total || ctx->evaluated.test(idx)) {
+            return;
+        }
+        ctx->vars[idx].materialize = true;
+        ctx->live.set(idx);
+    }
+    int nagisa_trace_append(const Instruction &i, Type type, size_t size) {
+        if (ctx->vars.size() == 0) {
             nagisa_add_predefined();
         }
-        ++ctx->cur_var;
-        Value v;
-        v.inst = i;
-        v.idx = (int)ctx->cur_var;
+        if (nagisa_is_reduction(i.op)) {
+            fail_if_recording("reductions can't be used");
+        }
+        for (auto dep : i.deps) {
+            check_scope(dep);
+        }
+        // a gather reads other lanes of its source, so it has to be launched before the new var can use it
+        bool flush = i.op == Load && i.deps[0] >= (int)Predefined::Total && !ctx->evaluated.test(i.deps[0]);
+        for (int k = 0; k < nagisa_arity(i.op); k++) {
+            flush = flush || needs_flush(i.deps[k]);
+        }
+        if (flush) {
+            if (i.op == Load) {
+                nagisa_schedule(i.deps[0]);
+            }
+            nagisa_eval();
+        } else if (ctx->background_compile > 0 && ctx->traced_since_precompile >= ctx->background_compile) {
+            nagisa_precompile();
+        }
+        std::array<const Value *, 3> operands{};
+        for (int k = 0; k < nagisa_arity(i.op); k++) {
+            if (i.deps[k] >= 0) {
+                operands[k] = &ctx->vars[i.deps[k]];
+            }
+        }
+        auto simplified = nagisa_simplify(i, type, operands);
+        // a var over other lanes, or a reduction's single element, can't stand in for the new one
+        if (simplified.forward >= 0 && ctx->vars[simplified.forward].num_elements() == size) {
+            return reuse_var(simplified.forward);
+        }
+        auto inst = simplified.constant ? *simplified.constant : i;
+        auto key = nagisa_inst_key(inst, type, size);
+        if (key) {
+            int hit = ctx->cse_table.find(CseTable::hash(*key), var_alive, [&](int idx) {
+                auto &u = ctx->vars[idx];
+                return nagisa_inst_key(u.inst, u.type, u.size) == *key;
+            });
+            if (hit != -1) {
+                return reuse_var(hit);
+            }
+        }
+        // evaluated deps are plain reads, only pending ones constrain the slot
+        int after = (int)Predefined::Total - 1;
+        for (auto dep : inst.deps) {
+            if (dep >= (int)Predefined::Total && ctx->vars[dep]._last_sync_time == -1) {
+                after = std::max(after, dep);
+            }
+        }
+        int idx = ctx->vars.alloc(after);
+        nagisa_count(Counter::TraceNodes);
+        ctx->traced_since_precompile++;
+        auto &v = ctx->vars[idx];
+        v.inst = inst;
         v.type = type;
-        ctx->vars.emplace(ctx->cur_var, v);
-        ctx->live.insert(v.idx);
-        return v.idx;
+        v.size = size;
+        for (auto dep : inst.deps) {
+            nagisa_inc_int(dep);
+        }
+        // recorded vars are neither roots nor valid outside their region
+        if (!ctx->recording.empty()) {
+            record(idx);
+            return idx;
+        }
+        ctx->live.set(idx);
+        if (key) {
+            ctx->cse_table.insert(CseTable::hash(*key), idx, v.generation);
+        }
+        return idx;
+    }
+    /*
+    ThreadIdx itself is predefined and never evaluated, a range is a var reading it so that it can be
+    written into a buffer, gathered from or read back like any other. ThreadIdx is 64-bit, kernels only
+    see it through these casts and compute the index in the type of the range
+    */
+    int nagisa_range(size_t count, Type type) {
+        if (ctx->vars.size() == 0) {
+            nagisa_add_predefined();
+        }
+        return nagisa_trace_append(Instruction::unary(Cast, (int)Predefined::ThreadIdx), type, count);
+    }
+    static int new_phi(int init, size_t size) {
+        int idx = ctx->vars.alloc((int)Predefined::Total - 1);
+        auto &v = ctx->vars[idx];
+        v.inst.op = Phi;
+        v.type = ctx->vars[init].type;
+        v.size = size;
+        v.region = recording_scope();
+        nagisa_inc_int(idx);
+        return idx;
     }
-    std::string type_to_str(Type type) {
-        if (type == Type::f32) {
-            return "float";
+    static void begin_region(Opcode kind, int cond, const int *state, size_t n, size_t size) {
+        if (ctx->vars.size() == 0) {
+            nagisa_add_predefined();
         }
-        if (type == Type::i32) {
-            return "int";
+        Recording rec;
+        auto &r = rec.region;
+        r.kind = kind;
+        r.size = size;
+        r.cond = cond;
+        nagisa_inc_int(cond);
+        for (size_t k = 0; k < n; k++) {
+            check_scope(state[k]);
+            nagisa_inc_int(state[k]);
+            r.inits.push_back(state[k]);
         }
-        if (type == Type::boolean) {
-            return "bool";
+        // an If has nothing to test per iteration
+        rec.in_body = kind == If;
+        ctx->recording.push_back(std::move(rec));
+        for (size_t k = 0; k < n; k++) {
+            ctx->recording.back().region.phis.push_back(new_phi(state[k], size));
         }
-        std::cerr << "unknown type" << std::endl;
-        std::abort();
     }
-    void scan_traces(std::unordered_set<int32_t> &visited, std::vector<int> &trace, int idx) {
-        if (visited.find(idx) != visited.end()) {
-            return;
+    /*
+    loop() and if_() record their code once, with every state var replaced by a Phi standing for its
+    value inside the region. The vars appended meanwhile belong to the region: they are not roots,
+    not hash-consed and can't be read from outside. nagisa_region_end wraps them in a Loop/If var
+    above all of them, and a RegionOut var per state var reads the Phi after the region.
+    The scheduler reaches a region through its outer vars only, the kernel generator emits its
+    vars in place, see nagisa_generate_kernel_trace
+    */
+    void nagisa_loop_begin(const int *state, int *phis, size_t n, size_t size) {
+        begin_region(Loop, -1, state, n, size);
+        auto &r = ctx->recording.back().region;
+        std::copy(r.phis.begin(), r.phis.end(), phis);
+    }
+    void nagisa_loop_cond(int cond) {
+        auto &rec = ctx->recording.back();
+        NGS_ASSERT(!rec.in_body && rec.region.kind == Loop);
+        check_scope(cond);
+        nagisa_inc_int(cond);
+        rec.region.cond = cond;
+        rec.in_body = true;
+    }
+    void nagisa_if_begin(int cond, const int *state, size_t n, size_t size) {
+        check_scope(cond);
+        begin_region(If, cond, state, n, size);
+        // the state keeps its outer vars, the Phis only carry the result out
+    }
+    void nagisa_region_end(int *state, size_t n, size_t size) {
+        NGS_ASSERT(!ctx->recording.empty());
+        auto rec = std::move(ctx->recording.back());
+        ctx->recording.pop_back();
+        auto &r = rec.region;
+        NGS_ASSERT(n == r.phis.size() && rec.in_body);
+        r.size = size;
+        auto &vars = ctx->vars;
+        int after = (int)Predefined::Total - 1;
+        for (size_t k = 0; k < n; k++) {
+            check_scope(state[k]);
+            nagisa_inc_int(state[k]);
+            r.results.push_back(state[k]);
         }
-        auto &v = ctx->vars.at(idx);
-        if (v.idx >= (int)Predefined::Total && v._last_sync_time != -1) {
-            // v is from last kernel launch
-            return;
+        auto alive = [&](const std::vector<std::pair<int, uint32_t>> &recorded) {
+            std::vector<int> out;
+            for (auto [idx, generation] : recorded) {
+                if (!vars.is_free(idx) && vars[idx].generation == generation) {
+                    out.push_back(idx);
+                }
+            }
+            std::sort(out.begin(), out.end());
+            return out;
+        };
+        r.head = alive(rec.head);
+        r.body = alive(rec.body);
+        for (auto list : {&r.inits, &r.phis, &r.results, &r.head, &r.body}) {
+            for (auto idx : *list) {
+                after = std::max(after, idx);
+            }
         }
-        visited.insert(idx);
-        std::array<int, 3> deps = v.inst.deps;
-        for (auto k : deps) {
-            if (k >= 0) {
-                scan_traces(visited, trace, k);
+        after = std::max(after, r.cond);
+        int node = vars.alloc(after);
+        vars[node].inst.op = r.kind;
+        vars[node].type = Type::none;
+        vars[node].size = r.size;
+        for (auto list : {&r.phis, &r.head, &r.body}) {
+            for (auto idx : *list) {
+                vars[idx].region = node;
+            }
+        }
+        for (auto list : {&r.head, &r.body}) {
+            for (auto idx : *list) {
+                nagisa_inc_int(idx);
+            }
+        }
+        auto inside = [&](int idx) {
+            for (int g = idx >= (int)Predefined::Total ? vars[idx].region : -1; g >= 0; g = vars[g].region) {
+                if (g == node) {
+                    return true;
+                }
+            }
+            return false;
+        };
+        auto add_outer = [&](int dep) {
+            if (dep >= 0 && !inside(dep)) {
+                r.outer.push_back(dep);
+            }
+        };
+        add_outer(r.cond);
+        for (auto list : {&r.inits, &r.results}) {
+            std::for_each(list->begin(), list->end(), add_outer);
+        }
+        for (auto list : {&r.head, &r.body}) {
+            for (auto idx : *list) {
+                auto &v = vars[idx];
+                std::for_each(v.inst.deps.begin(), v.inst.deps.end(), add_outer);
+                if (nagisa_is_region(v.inst.op)) {
+                    auto &inner = ctx->regions.at(idx).outer;
+                    std::for_each(inner.begin(), inner.end(), add_outer);
+                }
+            }
+        }
+        std::sort(r.outer.begin(), r.outer.end());
+        r.outer.erase(std::unique(r.outer.begin(), r.outer.end()), r.outer.end());
+        auto phis = r.phis;
+        ctx->regions.emplace(node, std::move(r));
+        if (!ctx->recording.empty()) {
+            record(node);
+        }
+        for (size_t k = 0; k < n; k++) {
+            int out = vars.alloc(node);
+            auto &v = vars[out];
+            v.inst = Instruction::unary(RegionOut, node);
+            v.inst.operand[1] = (int)k;
+            v.type = vars[phis[k]].type;
+            v.size = size;
+            nagisa_inc_int(node);
+            if (!ctx->recording.empty()) {
+                record(out);
+            } else {
+                ctx->live.set(out);
             }
+            state[k] = out;
         }
-        trace.push_back(idx);
     }
-    std::string nagisa_generate_kernel_trace(std::unordered_map<int, std::string> &to_var,
-                                             const std::vector<int> &trace) {
-        std::ostringstream out, kernel;
-        int _var_cnt = 0;
-        ctx->cur_size = 1;
-        for (auto idx : trace) {
-            auto &v = ctx->vars.at(idx);
-            // if (v.inst.op == Store) {
-            //     auto st = v.inst.store_inst;
-            //     // clang-format off
-            //     out << "if(" << to_var.at(st.mask) << "){" \
-            //         << "buffer" << st.buffer_id \
-            //         << "[" << to_var.at(st.idx) << "] = " << to_var.at(st.value) << ";}\n";
-            //     // clang-format on
-            //     continue;
-            // }
-            for (auto dep : v.inst.deps) {
-                if (dep >= (int)Predefined::Total) {
-                    auto &u = ctx->vars.at(dep);
-                    if (u._last_sync_time >= 0 && u._last_sync_time < ctx->_time && to_var.find(dep) == to_var.end()) {
-                        std::string var = std::string("v").append(std::to_string(_var_cnt++));
-                        to_var[dep] = var;
-                        out << type_to_str(u.type) << " " << var << " = buffer" << u.buf_idx << "[get_global_id(0)];\n";
+    /*
+    Collects the pending vars reachable from the live roots, one trace per root size.
+    Pending deps always sit in lower slots than their users (see VarTable), so one
+    sweep down from the highest root marks everything without recursion, and one
+    sweep up emits every trace in slot order, which is a valid schedule.
+    Evaluated vars are not part of any trace, kernels read them back.
+    */
+    static std::vector<std::pair<size_t, std::vector<int>>> schedule_traces() {
+        std::map<size_t, int> group_of_size;
+        ctx->live.for_each([&](int idx) { group_of_size.emplace(ctx->vars[idx].size, 0); });
+        std::vector<std::pair<size_t, std::vector<int>>> traces;
+        for (auto &g : group_of_size) {
+            g.second = (int)traces.size();
+            traces.emplace_back(g.first, std::vector<int>());
+        }
+        int n_groups = (int)traces.size();
+        int64_t hi = ctx->live.find_prev((int64_t)ctx->vars.size() - 1);
+        Bitset reachable((size_t)hi + 1);
+        // with a single size reachable is the only mark needed
+        std::vector<Bitset> marks(n_groups > 1 ? n_groups : 0, Bitset((size_t)hi + 1));
+        ctx->live.for_each([&](int idx) {
+            reachable.set(idx);
+            if (!marks.empty()) {
+                marks[group_of_size.at(ctx->vars[idx].size)].set(idx);
+            }
+        });
+        auto &vars = ctx->vars;
+        auto &evaluated = ctx->evaluated;
+        reachable.for_each_reverse([&](int i) {
+            auto visit = [&](int dep) {
+                if (dep < 0 || evaluated.test(dep)) {
+                    return;
+                }
+                NGS_ASSERT(dep < i);
+                reachable.set(dep);
+                for (auto &m : marks) {
+                    if (m.test(i)) {
+                        m.set(dep);
+                    }
+                }
+            };
+            std::for_each(vars[i].inst.deps.begin(), vars[i].inst.deps.end(), visit);
+            // the vars recorded in a region are emitted with it, only what it reads from outside is scheduled
+            if (nagisa_is_region(vars[i].inst.op)) {
+                auto &outer = ctx->regions.at(i).outer;
+                std::for_each(outer.begin(), outer.end(), visit);
+            }
+        });
+        if (marks.empty()) {
+            auto &trace = traces[0].second;
+            trace.reserve(reachable.count());
+            reachable.for_each([&](int idx) { trace.push_back(idx); });
+        } else {
+            reachable.for_each([&](int idx) {
+                for (int g = 0; g < n_groups; g++) {
+                    if (marks[g].test(idx)) {
+                        traces[g].second.push_back(idx);
                     }
                 }
+            });
+        }
+        return traces;
+    }
+    // a command sent while capturing, see nagisa_capture_begin
+    static void record_command(GraphCommand cmd) {
+        for (auto id : cmd.buffers) {
+            ctx->capture->used.insert(id);
+        }
+        ctx->capture->commands.push_back(std::move(cmd));
+    }
+    static void record_launch(const std::shared_ptr<Kernel> &kernel, const Kernel &launched, std::vector<int> buffers) {
+        GraphCommand cmd;
+        cmd.kernel = kernel;
+        cmd.params = launched.params;
+        cmd.size = launched.size;
+        cmd.buffers = std::move(buffers);
+        record_command(std::move(cmd));
+    }
+    static void record_copy(int dst, size_t dst_offset, int src, size_t src_offset, size_t bytes) {
+        GraphCommand cmd;
+        cmd.kind = GraphCommand::Copy;
+        cmd.buffers = {dst, src};
+        cmd.dst_offset = dst_offset;
+        cmd.src_offset = src_offset;
+        cmd.bytes = bytes;
+        record_command(std::move(cmd));
+    }
+    static void record_write(int dst, const void *p, size_t bytes) {
+        GraphCommand cmd;
+        cmd.kind = GraphCommand::Write;
+        cmd.buffers = {dst};
+        cmd.bytes = bytes;
+        cmd.data.assign(static_cast<const uint8_t *>(p), static_cast<const uint8_t *>(p) + bytes);
+        record_command(std::move(cmd));
+    }
+    // see Context::speculating
+    static void remember(const Value &v) {
+        ctx->undo.push_back({v.idx, v.buf_idx, v._last_sync_time, ctx->evaluated.test(v.idx)});
+    }
+    static int placeholder_buffer(Type type) {
+        ctx->placeholders.push_back(type);
+        return -1 - (int)ctx->placeholders.size();
+    }
+    static Type buffer_type(int id) { return id < -1 ? ctx->placeholders[-2 - id] : ctx->buffers.at(id)->type; }
+    // gives a reduction its buffer, holding the identity it accumulates from
+    static void start_reduction(Value &v) {
+        if (ctx->speculating) {
+            remember(v);
+            if (v.buf_idx == -1) {
+                v.buf_idx = placeholder_buffer(v.type);
             }
-            ctx->cur_size = std::max(ctx->cur_size, v.size);
-            std::string var = std::string("v").append(std::to_string(_var_cnt++));
-            out << type_to_str(v.type) << " " << var << " = ";
-            to_var[v.idx] = var;
+            v._last_sync_time = ctx->_time;
+            ctx->evaluated.set(v.idx);
+            return;
+        }
+        if (v.buf_idx == -1) {
+            auto [_, buf_id] = nagisa_alloc(get_typesize(v.type), v.type);
+            v.buf_idx = buf_id;
+        }
+        uint64_t bits = 0;
+        nagisa_dispatch_type(v.type, [&](auto zero) {
+            using T = decltype(zero);
+            using L = std::numeric_limits<T>;
+            T x = v.inst.op == ReduceAdd   ? zero
+                  : v.inst.op == ReduceMax ? (L::has_infinity ? -L::infinity() : L::lowest())
+                                           : (L::has_infinity ? L::infinity() : L::max());
+            std::memcpy(&bits, &x, sizeof(T));
+        });
+        nagisa_count(Counter::BytesUploaded, get_typesize(v.type));
+        if (ctx->capture) {
+            record_write(v.buf_idx, &bits, get_typesize(v.type));
+        }
+        ctx->buffers.at(v.buf_idx)->write(reinterpret_cast<const uint8_t *>(&bits), get_typesize(v.type), 0);
+        v._last_sync_time = ctx->_time;
+        ctx->evaluated.set(v.idx);
+    }
+    /*
+    Emits vars into a Kernel in the order they are given. Evaluated deps become reads of their buffer
+    and a region is emitted in place together with the vars recorded in it
+    */
+    struct KernelBuilder {
+        Kernel kernel;
+        std::unordered_map<int, int> to_local;
+        // a native function reads nothing but its arguments and bakes every constant in, see nagisa_function_end
+        bool native = false;
+        // a tiled kernel runs a slice of the lanes at a time, its ThreadIdx statements add the param offset_param
+        bool tiled = false;
+        int offset_param = -1;
+
+        int add_local(Type type) {
+            kernel.local_types.push_back(type);
+            return (int)kernel.local_types.size() - 1;
+        }
+        int new_local(int idx, Type type) { return to_local[idx] = add_local(type); }
+        void push(StmtKind kind, int var, Type type, int buffer = -1) {
+            KernelStmt s;
+            s.kind = kind;
+            s.var = var;
+            s.type = type;
+            s.buffer = buffer;
+            kernel.stmts.push_back(s);
+        }
+        // written by an earlier launch or wrapped host memory
+        void read_evaluated(int dep) {
+            if (dep < (int)Predefined::Total || !ctx->evaluated.test(dep) || to_local.count(dep)) {
+                return;
+            }
+            if (native) {
+                std::cerr << "a Function can only read its arguments, not evaluated arrays" << std::endl;
+                exit(1);
+            }
+            auto &u = ctx->vars[dep];
+            push(u.num_elements() == 1 ? StmtKind::ReadUniform : StmtKind::Read, new_local(dep, u.type), u.type,
+                 u.buf_idx);
+        }
+        // a copy of v<operand>, how Phis are declared
+        KernelStmt copy(int operand, Type type) {
+            KernelStmt s;
+            s.type = type;
+            s.inst.op = Phi;
+            s.inst.operand[0] = operand;
+            return s;
+        }
+        // the Phis of a region, its recorded vars in order and the Phi updates closing every iteration
+        void emit_region(Value &v) {
+            auto &r = ctx->regions.at(v.idx);
+            for (auto dep : r.outer) {
+                read_evaluated(dep);
+            }
+            for (size_t k = 0; k < r.phis.size(); k++) {
+                auto type = ctx->vars[r.phis[k]].type;
+                auto s = copy(to_local.at(r.inits[k]), type);
+                s.var = new_local(r.phis[k], type);
+                kernel.stmts.push_back(s);
+            }
+            KernelStmt begin;
+            begin.kind = v.inst.op == Loop ? StmtKind::LoopBegin : StmtKind::IfBegin;
+            begin.var = add_local(Type::boolean);
+            if (v.inst.op == If) {
+                begin.inst.operand[0] = to_local.at(r.cond);
+            }
+            kernel.stmts.push_back(begin);
+            for (auto idx : r.head) {
+                emit(ctx->vars[idx]);
+            }
+            if (v.inst.op == Loop) {
+                KernelStmt cond;
+                cond.kind = StmtKind::LoopCond;
+                cond.inst.operand[0] = to_local.at(r.cond);
+                cond.inst.operand[1] = begin.var;
+                kernel.stmts.push_back(cond);
+            }
+            for (auto idx : r.body) {
+                emit(ctx->vars[idx]);
+            }
+            // copy the results first, a result may be the Phi of another state var
+            std::vector<int> results;
+            for (size_t k = 0; k < r.phis.size(); k++) {
+                auto s = copy(to_local.at(r.results[k]), ctx->vars[r.phis[k]].type);
+                s.var = add_local(s.type);
+                results.push_back(s.var);
+                kernel.stmts.push_back(s);
+            }
+            for (size_t k = 0; k < r.phis.size(); k++) {
+                KernelStmt s;
+                s.kind = StmtKind::PhiUpdate;
+                s.type = ctx->vars[r.phis[k]].type;
+                s.var = to_local.at(r.phis[k]);
+                s.inst.operand[0] = results[k];
+                s.inst.operand[1] = begin.var;
+                kernel.stmts.push_back(s);
+            }
+            push(StmtKind::RegionEnd, -1, Type::none);
+        }
+        void emit(Value &v) {
+            if (nagisa_is_region(v.inst.op)) {
+                emit_region(v);
+                return;
+            }
+            // ThreadIdx is emitted in the type of each cast reading it
             if (v.idx < (int)Predefined::Total) {
-                if (v.idx == 0) {
-                    out << "get_global_id(0)";
+                return;
+            }
+            if (v.inst.op == Argument) {
+                std::cerr << "a value computed inside a Function is used outside of it" << std::endl;
+                exit(1);
+            }
+            for (auto dep : v.inst.deps) {
+                read_evaluated(dep);
+            }
+            KernelStmt s;
+            s.type = v.type;
+            s.inst = v.inst;
+            bool is_const = v.inst.op == ConstantInt || v.inst.op == ConstantFloat;
+            if (v.inst.op == Cast && v.inst.deps[0] < (int)Predefined::Total) {
+                s.kind = StmtKind::ThreadIdx;
+                s.param = tiled ? thread_offset() : -1;
+            } else if (is_const && !native && (v.inst.opaque || ctx->lift_constants)) {
+                KernelParam param;
+                param.type = v.type;
+                nagisa_dispatch_type(v.type, [&](auto zero) {
+                    using T = decltype(zero);
+                    T x = v.inst.op == ConstantFloat ? (T)v.inst.fval : (T)v.inst.ival;
+                    std::memcpy(&param.bits, &x, sizeof(T));
+                });
+                s.kind = StmtKind::Param;
+                s.param = (int)kernel.params.size();
+                kernel.params.push_back(param);
+            } else if (v.inst.op == RegionOut) {
+                auto &r = ctx->regions.at(v.inst.deps[0]);
+                s.inst.operand[0] = to_local.at(r.phis[v.inst.operand[1]]);
+            } else if (!is_const) {
+                if (v.inst.op == Load) {
+                    s.buffer = ctx->vars[v.inst.operand[0]].buf_idx;
+                    NGS_ASSERT(s.buffer != -1);
+                } else if (nagisa_is_store(v.inst.op)) {
+                    s.buffer = ctx->vars[v.target].buf_idx;
+                    NGS_ASSERT(s.buffer != -1);
+                } else if (nagisa_is_reduction(v.inst.op)) {
+                    start_reduction(v);
+                    s.buffer = v.buf_idx;
                 }
-            } else {
-                auto op = v.inst.op;
-                if (op == ConstantInt) {
-                    out << v.inst.ival;
-                } else if (op == ConstantFloat) {
-                    out << v.inst.fval;
-                } else if (op == FAdd) {
-                    out << to_var.at(v.inst.operand[0]) << " + " << to_var.at(v.inst.operand[1]);
-                } else if (op == FSub) {
-                    out << to_var.at(v.inst.operand[0]) << " - " << to_var.at(v.inst.operand[1]);
-                } else if (op == FMul) {
-                    out << to_var.at(v.inst.operand[0]) << " * " << to_var.at(v.inst.operand[1]);
-                } else if (op == FDiv) {
-                    out << to_var.at(v.inst.operand[0]) << " / " << to_var.at(v.inst.operand[1]);
-                } else if (op == Mod) {
-                    out << to_var.at(v.inst.operand[0]) << " % " << to_var.at(v.inst.operand[1]);
-                } else if (op == CmpLt) {
-                    out << to_var.at(v.inst.operand[0]) << " < " << to_var.at(v.inst.operand[1]);
-                } else if (op == CmpLe) {
-                    out << to_var.at(v.inst.operand[0]) << " <= " << to_var.at(v.inst.operand[1]);
-                } else if (op == CmpGt) {
-                    out << to_var.at(v.inst.operand[0]) << " > " << to_var.at(v.inst.operand[1]);
-                } else if (op == CmpGe) {
-                    out << to_var.at(v.inst.operand[0]) << " >= " << to_var.at(v.inst.operand[1]);
-                } else if (op == CmpEq) {
-                    out << to_var.at(v.inst.operand[0]) << " == " << to_var.at(v.inst.operand[1]);
-                } else if (op == CmpNe) {
-                    out << to_var.at(v.inst.operand[0]) << " != " << to_var.at(v.inst.operand[1]);
-                } else if (op == Select) {
-                    out << to_var.at(v.inst.operand[0]) << " ? " << to_var.at(v.inst.operand[1]) << " :"
-                        << to_var.at(v.inst.operand[2]);
-                } else if (op == Load) {
-                    out << to_var.at(v.inst.operand[1]) << " ? " << to_var.at(v.inst.operand[0]) << "["
-                        << to_var.at(v.inst.operand[2]) << "] : 0";
-                } else if (op == Sin) {
-                    out << "sin(" << to_var.at(v.inst.operand[0]) << ")";
-                } else if (op == Cos) {
-                    out << "cos(" << to_var.at(v.inst.operand[0]) << ")";
-                } else if (op == Sqrt) {
-                    out << "sqrt(" << to_var.at(v.inst.operand[0]) << ")";
-                } else {
-                    NGS_ASSERT(false);
+                for (int k = 0; k < 3; k++) {
+                    if (v.inst.deps[k] >= 0) {
+                        s.inst.operand[k] = to_local.at(v.inst.deps[k]);
+                    }
+                }
+            }
+            s.var = new_local(v.idx, v.type);
+            kernel.stmts.push_back(s);
+        }
+        // the i64 param holding the first lane of a tile, set by run_tiled for every launch
+        int thread_offset() {
+            if (offset_param == -1) {
+                offset_param = (int)kernel.params.size();
+                kernel.params.push_back(KernelParam{Type::i64});
+            }
+            return offset_param;
+        }
+    };
+    // whether a kernel over `size` lanes writes v into a buffer of its own, roots are live until their kernels exist
+    static bool is_output(const Value &v, size_t size) {
+        bool write = v.size != 1 || (v.materialize && size == 1);
+        return write && ctx->live.test(v.idx) && v.type != Type::none && !nagisa_is_reduction(v.inst.op);
+    }
+    /*
+    A kernel run over tiles of its lanes, see nagisa_set_tile_budget. Every buffer it reads or writes
+    at the thread index is replaced by two tile-sized staging buffers used by turns, so the copies
+    of one tile overlap the launch of the next where the device runs them concurrently
+    */
+    struct TiledKernel {
+        struct Staged {
+            // the full-size buffer and the staging buffers standing in for it
+            int full;
+            std::array<int, 2> staging;
+            bool write;
+        };
+        size_t size = 0, tile = 0;
+        // index into Kernel::params of the first lane of a tile, an i64, -1 if the kernel does not read ThreadIdx
+        int offset_param = -1;
+        std::vector<Staged> staged;
+    };
+    // whether the full-size buffers a group allocates, plus the spilled ones it reads, exceed the tile budget
+    static bool needs_tiling(size_t size, const std::vector<int> &trace) {
+        if (ctx->tile_budget == 0 || size == 1) {
+            return false;
+        }
+        size_t bytes = 0;
+        std::unordered_set<int> spilled;
+        auto visit = [&](int dep) {
+            if (dep >= (int)Predefined::Total && ctx->evaluated.test(dep)) {
+                auto &u = ctx->vars[dep];
+                if (u.num_elements() == size && ctx->spills.count(u.buf_idx) && spilled.insert(u.buf_idx).second) {
+                    bytes += size * get_typesize(u.type);
                 }
             }
-            out << ";\n";
-            if (v.size != 1 && v._ref_ext > 0) {
+        };
+        for (auto idx : trace) {
+            auto &v = ctx->vars[idx];
+            if (is_output(v, size) && v.buf_idx == -1) {
+                bytes += size * get_typesize(v.type);
+            }
+            std::for_each(v.inst.deps.begin(), v.inst.deps.end(), visit);
+            if (nagisa_is_region(v.inst.op)) {
+                auto &outer = ctx->regions.at(idx).outer;
+                std::for_each(outer.begin(), outer.end(), visit);
+            }
+        }
+        // a kernel staging no buffers, such as a reduction over a range, counts a byte per lane
+        return std::max(bytes, size) > ctx->tile_budget;
+    }
+    // an evaluated buffer of n elements over a new HostSpill
+    static int spill_buffer(size_t n, Type type) {
+        auto bytes = n * get_typesize(type);
+        auto spill = std::make_unique<HostSpill>(bytes);
+        int id = ctx->next_buffer_id++;
+        ctx->buffers.emplace(id, ctx->backend->wrap_host(spill->data(), bytes, type));
+        ctx->spills.emplace(id, std::move(spill));
+        return id;
+    }
+    // sizes the tiles to the budget and points the Read/Write statements at the first set of staging buffers
+    static void stage_buffers(Kernel &kernel, TiledKernel &tiled) {
+        std::unordered_map<int, size_t> staged_of;
+        for (auto &s : kernel.stmts) {
+            if (s.kind != StmtKind::Read && s.kind != StmtKind::Write) {
+                continue;
+            }
+            auto [it, inserted] = staged_of.emplace(s.buffer, tiled.staged.size());
+            if (inserted) {
+                tiled.staged.push_back({s.buffer, {-1, -1}, false});
+            }
+            tiled.staged[it->second].write |= s.kind == StmtKind::Write;
+        }
+        size_t lane_bytes = 0;
+        for (auto &st : tiled.staged) {
+            lane_bytes += get_typesize(ctx->buffers.at(st.full)->type);
+        }
+        // both sets fit the budget, in whole CPU chunks and work-groups
+        const size_t granule = 4096;
+        tiled.tile = (lane_bytes == 0 ? ctx->tile_budget : ctx->tile_budget / (2 * lane_bytes)) / granule * granule;
+        tiled.tile = std::min(tiled.size, std::max(granule, tiled.tile));
+        for (auto &st : tiled.staged) {
+            auto type = ctx->buffers.at(st.full)->type;
+            for (auto &id : st.staging) {
+                id = nagisa_alloc(tiled.tile * get_typesize(type), type).second;
+            }
+        }
+        for (auto &s : kernel.stmts) {
+            if (s.kind == StmtKind::Read || s.kind == StmtKind::Write) {
+                s.buffer = tiled.staged[staged_of.at(s.buffer)].staging[0];
+            } else if (s.kind == StmtKind::ThreadIdx) {
+                tiled.offset_param = s.param;
+            }
+        }
+    }
+    // tiled is set for a kernel that runs over tiles, see TiledKernel
+    static Kernel generate_kernel(size_t size, const std::vector<int> &trace, TiledKernel *tiled) {
+        KernelBuilder b;
+        auto &kernel = b.kernel;
+        kernel.size = size;
+        b.tiled = tiled != nullptr;
+        for (auto idx : trace) {
+            auto &v = ctx->vars[idx];
+            b.emit(v);
+            if (is_output(v, size)) {
+                if (ctx->speculating) {
+                    remember(v);
+                }
                 if (v.buf_idx == -1) {
-                    auto [_, buf_id] = nagisa_alloc(v.size * get_typesize(v.type), v.type);
-                    v.buf_idx = buf_id;
+                    // a tiled output is streamed into host memory rather than held on the device
+                    v.buf_idx = ctx->speculating ? placeholder_buffer(v.type)
+                                : tiled          ? spill_buffer(v.size, v.type)
+                                                 : nagisa_alloc(v.size * get_typesize(v.type), v.type).second;
                 }
-                out << "buffer" << v.buf_idx << "["
-                    << "get_global_id(0)"
-                    << "] = " << to_var.at(v.idx) << ";\n";
+                b.push(StmtKind::Write, b.to_local.at(v.idx), v.type, v.buf_idx);
                 v._last_sync_time = ctx->_time;
+                ctx->evaluated.set(v.idx);
             }
         }
-        kernel << "__kernel void main(";
-        {
-            for (auto &p : ctx->buffers) {
-                auto i = p.first;
-                auto &buf = p.second;
-                kernel << "__global " << type_to_str(buf->type) << " * buffer" << i;
-                if (i != ctx->buffers.size() - 1) {
-                    kernel << ", ";
+        nagisa_eliminate_dead_code(kernel);
+        if (tiled) {
+            tiled->size = size;
+            stage_buffers(kernel, *tiled);
+        }
+        // renumber the buffers that survived in order of first use, so the kernel does not depend on ids
+        std::unordered_map<int, int> buffer_arg;
+        for (auto &s : kernel.stmts) {
+            if (s.buffer == -1) {
+                continue;
+            }
+            auto [it, inserted] = buffer_arg.emplace(s.buffer, (int)kernel.buffers.size());
+            if (inserted) {
+                kernel.buffers.emplace_back(s.buffer, buffer_type(s.buffer));
+            }
+            s.buffer = it->second;
+        }
+        kernel.hash = nagisa_hash_kernel(kernel);
+        return std::move(kernel);
+    }
+    Kernel nagisa_generate_kernel_trace(size_t size, const std::vector<int> &trace) {
+        return generate_kernel(size, trace, nullptr);
+    }
+    /*
+    A Function is recorded like the body of a region (see nagisa_loop_begin), over one Argument var per
+    parameter, so nothing is hash-consed or evaluated meanwhile. Its kernel reads the arguments from
+    buffers 0..n-1 and writes the result into buffer n, the wrapper around it passes their addresses
+    */
+    void nagisa_function_begin(const Type *types, int *args, size_t n) {
+        if (ctx->vars.size() == 0) {
+            nagisa_add_predefined();
+        }
+        Recording rec;
+        rec.in_body = true;
+        ctx->recording.push_back(std::move(rec));
+        for (size_t k = 0; k < n; k++) {
+            int idx = ctx->vars.alloc((int)Predefined::Total - 1);
+            auto &v = ctx->vars[idx];
+            v.inst.op = Argument;
+            v.inst.ival = (int)k;
+            v.type = types[k];
+            v.region = recording_scope();
+            nagisa_inc_int(idx);
+            ctx->recording.back().region.inits.push_back(idx);
+            args[k] = idx;
+        }
+    }
+    NativeFunction nagisa_function_end(int result, size_t lanes) {
+        NGS_ASSERT(!ctx->recording.empty());
+        auto rec = std::move(ctx->recording.back());
+        ctx->recording.pop_back();
+        auto &args = rec.region.inits;
+        auto &vars = ctx->vars;
+        // everything the result is computed from, down to the arguments
+        std::vector<int> trace;
+        std::unordered_set<int> seen;
+        std::vector<int> stack{result};
+        while (!stack.empty()) {
+            int idx = stack.back();
+            stack.pop_back();
+            if (idx < 0 || !seen.insert(idx).second || ctx->evaluated.test(idx)) {
+                continue;
+            }
+            trace.push_back(idx);
+            auto &v = vars[idx];
+            stack.insert(stack.end(), v.inst.deps.begin(), v.inst.deps.end());
+            if (nagisa_is_region(v.inst.op)) {
+                auto &outer = ctx->regions.at(idx).outer;
+                stack.insert(stack.end(), outer.begin(), outer.end());
+            }
+        }
+        std::sort(trace.begin(), trace.end());
+        KernelBuilder b;
+        b.native = true;
+        auto &kernel = b.kernel;
+        kernel.size = lanes;
+        for (size_t k = 0; k < args.size(); k++) {
+            auto type = vars[args[k]].type;
+            kernel.buffers.emplace_back((int)k, type);
+            b.push(StmtKind::Read, b.new_local(args[k], type), type, (int)k);
+        }
+        for (auto idx : trace) {
+            if (vars[idx].inst.op != Argument) {
+                b.emit(vars[idx]);
+            }
+        }
+        b.read_evaluated(result);
+        auto type = vars[result].type;
+        kernel.buffers.emplace_back((int)args.size(), type);
+        b.push(StmtKind::Write, b.to_local.at(result), type, (int)args.size());
+        nagisa_eliminate_dead_code(kernel);
+        kernel.hash = nagisa_hash_kernel(kernel);
+        auto fn = nagisa_compile_native_function(kernel, lanes);
+        for (auto idx : args) {
+            nagisa_dec_int(idx);
+        }
+        return fn;
+    }
+    void nagisa_lift_constants(bool enable) { ctx->lift_constants = enable; }
+    void nagisa_run_kernel(const Kernel &kernel) {
+        std::vector<DeviceBuffer *> args;
+        std::vector<int> ids;
+        for (auto &b : kernel.buffers) {
+            args.push_back(ctx->buffers.at(b.first).get());
+            ids.push_back(b.first);
+        }
+        if (ctx->capture) {
+            record_launch(std::make_shared<Kernel>(kernel), kernel, std::move(ids));
+        }
+        ctx->backend->launch(ctx->stream.get(), kernel, args);
+    }
+    // a buffer some captured command uses goes to the graph instead of being freed, returns whether it did
+    static bool keep_for_capture(int id, bool pooled) {
+        if (!ctx->capture || !ctx->capture->used.count(id)) {
+            return false;
+        }
+        auto &kept = ctx->capture->owned[id];
+        kept.buffer = std::move(ctx->buffers.at(id));
+        ctx->buffers.erase(id);
+        auto spill = ctx->spills.find(id);
+        if (spill != ctx->spills.end()) {
+            kept.spill = std::move(spill->second);
+            ctx->spills.erase(spill);
+        }
+        kept.pooled = pooled && !kept.spill;
+        return true;
+    }
+    /*
+    Tile i reads and writes the staging set i % 2: its inputs are copied in, it is launched over its
+    lanes and its outputs are copied out, each step queued behind whatever last used the buffers
+    */
+    static void run_tiled(Kernel &kernel, const TiledKernel &tiled) {
+        std::unordered_map<int, int> second_set;
+        for (auto &st : tiled.staged) {
+            second_set.emplace(st.staging[0], st.staging[1]);
+        }
+        auto copy = [](int dst, size_t dst_offset, int src, size_t src_offset, size_t bytes) {
+            nagisa_count(Counter::BytesCopied, bytes);
+            if (ctx->capture) {
+                record_copy(dst, dst_offset, src, src_offset, bytes);
+            }
+            ctx->backend->copy(ctx->stream.get(), ctx->buffers.at(dst).get(), dst_offset, ctx->buffers.at(src).get(),
+                               src_offset, bytes);
+        };
+        auto captured = ctx->capture ? std::make_shared<Kernel>(kernel) : nullptr;
+        for (size_t begin = 0, i = 0; begin < tiled.size; begin += tiled.tile, i++) {
+            size_t n = std::min(tiled.tile, tiled.size - begin);
+            for (auto &st : tiled.staged) {
+                if (!st.write) {
+                    auto bytes = get_typesize(ctx->buffers.at(st.full)->type);
+                    copy(st.staging[i % 2], 0, st.full, begin * bytes, n * bytes);
                 }
             }
-            kernel << "){\n";
+            std::vector<DeviceBuffer *> args;
+            std::vector<int> ids;
+            for (auto &b : kernel.buffers) {
+                auto it = second_set.find(b.first);
+                ids.push_back(i % 2 == 1 && it != second_set.end() ? it->second : b.first);
+                args.push_back(ctx->buffers.at(ids.back()).get());
+            }
+            kernel.size = n;
+            if (tiled.offset_param >= 0) {
+                auto offset = (int64_t)begin;
+                std::memcpy(&kernel.params[tiled.offset_param].bits, &offset, sizeof(offset));
+            }
+            if (captured) {
+                record_launch(captured, kernel, std::move(ids));
+            }
+            ctx->backend->launch(ctx->stream.get(), kernel, args);
+            for (auto &st : tiled.staged) {
+                if (st.write) {
+                    auto bytes = get_typesize(ctx->buffers.at(st.full)->type);
+                    copy(st.full, begin * bytes, st.staging[i % 2], 0, n * bytes);
+                }
+            }
+        }
+        // the pool orders any later use of the staging buffers after the copies above
+        for (auto &st : tiled.staged) {
+            for (auto id : st.staging) {
+                if (keep_for_capture(id, true)) {
+                    continue;
+                }
+                auto it = ctx->buffers.find(id);
+                ctx->allocator->release(std::move(it->second));
+                ctx->buffers.erase(it);
+            }
         }
-        kernel << out.str();
-        kernel << "}";
-        return kernel.str();
     }
-    void nagisa_run_kernel(size_t size, const std::string &kernel_src) {
-        std::cout << "kernel:\n" << kernel_src << std::endl;
-        auto it = ctx->kernel_cache.find(kernel_src);
-        cl::Program *program = nullptr;
-        if (it != ctx->kernel_cache.end()) {
-            std::cout << "hit!" << std::endl;
-            program = &it->second;
-        } else {
-            cl::Program::Sources sources;
-            sources.push_back({kernel_src.c_str(), kernel_src.length()});
-            cl::Program p(ocl_ctx->context, sources);
-            if (p.build({ocl_ctx->device}) != CL_SUCCESS) {
-                std::cerr << "Error building: " << p.getBuildInfo<CL_PROGRAM_BUILD_LOG>(ocl_ctx->device) << std::endl;
-                exit(1);
+    // an evaluated var is a plain read from now on and no longer needs its deps
+    static void release_deps(int idx) {
+        auto &v = ctx->vars[idx];
+        if (auto key = nagisa_inst_key(v.inst, v.type, v.size)) {
+            // its key names operand slots that may be recycled after this
+            ctx->cse_table.erase(CseTable::hash(*key), idx);
+        }
+        auto deps = v.inst.deps;
+        v.inst.deps = {-1, -1, -1};
+        for (auto dep : deps) {
+            if (dep >= 0) {
+                nagisa_dec_int(dep);
             }
-            ctx->kernel_cache.emplace(kernel_src, p);
-            program = &ctx->kernel_cache[kernel_src];
         }
-
-        cl::Kernel kernel(*program, "main");
-        for (auto &p : ctx->buffers) {
-            kernel.setArg((cl_uint)p.first, p.second->get());
+    }
+    /*
+    Whether the cost model leaves root idx to be recomputed by the kernels that use it rather than written.
+    Writing it moves its bytes twice, stored now and read back by each user. Recomputing it runs the ops
+    of its pending expression and reads the buffers that expression reads, per user. A moved byte is worth
+    ops_per_byte ops. The walk stops as soon as recomputing is the dearer, so it stays short
+    */
+    static bool defer(int idx) {
+        auto &x = ctx->vars[idx];
+        if (ctx->ops_per_byte <= 0 || ctx->capture || x.materialize || x.size == 1 || x.type == Type::none ||
+            nagisa_is_reduction(x.inst.op)) {
+            return false;
+        }
+        auto budget = 2 * ctx->ops_per_byte * get_typesize(x.type);
+        float cost = 0;
+        std::unordered_set<int> seen;
+        std::vector<int> stack{idx};
+        while (!stack.empty() && cost <= budget) {
+            int i = stack.back();
+            stack.pop_back();
+            if (i < (int)Predefined::Total || !seen.insert(i).second) {
+                continue;
+            }
+            auto &v = ctx->vars[i];
+            // host memory may change once this returns, so whatever reads it is written now
+            if (v.borrowed || nagisa_is_region(v.inst.op)) {
+                return false;
+            }
+            // read back from a buffer, a size-1 one costs nothing per lane
+            if (ctx->evaluated.test(i) || (i != idx && (v.materialize || nagisa_is_reduction(v.inst.op)))) {
+                cost += v.num_elements() == 1 ? 0 : ctx->ops_per_byte * get_typesize(v.type);
+                continue;
+            }
+            cost += nagisa_op_cost(v.inst.op);
+            // operand 0 of a Load is read at random, which the Load itself accounts for
+            for (int k = v.inst.op == Load ? 1 : 0; k < 3; k++) {
+                if (v.inst.deps[k] >= 0) {
+                    stack.push_back(v.inst.deps[k]);
+                }
+            }
         }
-        std::cout << "kernel launch with size: " << size << std::endl;
-        ocl_ctx->queue.enqueueNDRangeKernel(kernel, cl::NDRange(0), cl::NDRange(size));
-        ocl_ctx->queue.finish();
+        return cost <= budget;
+    }
+    // takes the roots the cost model leaves pending out of live
+    static void drop_deferred_roots() {
+        std::vector<int> deferred;
+        ctx->live.for_each([&](int idx) {
+            if (defer(idx)) {
+                deferred.push_back(idx);
+            }
+        });
+        for (auto idx : deferred) {
+            ctx->live.reset(idx);
+        }
+    }
+    static bool writes_buffers(const Kernel &kernel) {
+        return std::any_of(kernel.stmts.begin(), kernel.stmts.end(),
+                           [](const KernelStmt &s) { return nagisa_writes_buffer(s); });
     }
-    void nagisa_free_var(int i);
     void nagisa_eval() {
-        if (ctx->live.empty())
-            return;
-        std::map<size_t, std::pair<std::unordered_set<int>, std::vector<int>>> traces;
-        for (auto idx : ctx->live) {
-            auto &rec = traces[ctx->vars.at(idx).size];
-            scan_traces(rec.first, rec.second, idx);
+        fail_if_recording("can't evaluate");
+        std::vector<std::pair<size_t, std::vector<int>>> traces;
+        {
+            ScopedPhase phase(Phase::Schedule, "schedule");
+            drop_deferred_roots();
+            if (ctx->live.empty())
+                return;
+            traces = schedule_traces();
         }
-        ctx->live.clear();
-        std::unordered_map<int, std::string> to_var;
-        for (auto it = traces.begin(); it != traces.end(); it++) {
-            auto &trace = it->second.second;
-            auto knl = nagisa_generate_kernel_trace(to_var, trace);
-            nagisa_run_kernel(ctx->cur_size, knl);
-        }
-        for (auto it = ctx->vars.begin(); it != ctx->vars.end();) {
-            if (it->first < (int)Predefined::Total) {
-                it++;
+        /*
+        The kernels of a batch are all generated and their builds started before the first one is launched,
+        so they build in parallel and each launch only waits for its own kernel. A tiled kernel closes its
+        batch, which keeps a single set of staging buffers allocated at a time
+        */
+        struct Pending {
+            Kernel kernel;
+            TiledKernel tiled;
+            bool tile = false;
+        };
+        std::vector<Pending> batch;
+        auto launch_batch = [&] {
+            for (auto &p : batch) {
+                if (p.tile) {
+                    run_tiled(p.kernel, p.tiled);
+                } else {
+                    nagisa_run_kernel(p.kernel);
+                }
+            }
+            batch.clear();
+        };
+        for (auto &[size, trace] : traces) {
+            Pending p;
+            p.tile = needs_tiling(size, trace);
+            {
+                ScopedPhase phase(Phase::Codegen, "generate kernel", size);
+                p.kernel = generate_kernel(size, trace, p.tile ? &p.tiled : nullptr);
+            }
+            if (!writes_buffers(p.kernel)) {
                 continue;
             }
-
-            bool need_remove = false;
-            // if (it->second._last_sync_time == -1) {
-            //     // not synced to global memory
-            //     // is lost permanently after kernel launch
-            //     need_remove = true;
-            // }
-            if (it->second._ref_ext == 0) {
-                // no need keep the variable
-                need_remove = true;
-            }
-            if (need_remove) {
-                nagisa_free_var(it->first);
-                it = ctx->vars.erase(it);
-            } else {
-                it++;
+            nagisa_count(Counter::KernelsGenerated);
+            ctx->backend->prepare(p.kernel);
+            bool tile = p.tile;
+            batch.push_back(std::move(p));
+            if (tile) {
+                launch_batch();
             }
         }
-        decltype(ctx->buffers) new_buffers;
-        std::unordered_map<int, int> buffer_rename;
-        for (auto &p : ctx->buffers) {
-            buffer_rename[p.first] = (int)new_buffers.size();
-            new_buffers.emplace((int)new_buffers.size(), std::move(p.second));
+        launch_batch();
+        ctx->traced_since_precompile = 0;
+        ctx->live.clear();
+        // only after every kernel is generated, traces of different sizes share nodes
+        std::vector<int> materialized, stores;
+        for (auto &[_, trace] : traces) {
+            for (auto idx : trace) {
+                if (idx < (int)Predefined::Total) {
+                    continue;
+                }
+                auto &v = ctx->vars[idx];
+                if (v._last_sync_time == ctx->_time) {
+                    materialized.push_back(idx);
+                } else if (nagisa_is_store(v.inst.op)) {
+                    stores.push_back(idx);
+                }
+            }
         }
-        for (auto &v : ctx->vars) {
-            if (v.second.buf_idx != -1) {
-                v.second.buf_idx = buffer_rename[v.second.buf_idx];
+        for (auto idx : materialized) {
+            // may have been freed by an earlier release
+            if (!ctx->vars.is_free(idx)) {
+                release_deps(idx);
             }
         }
-        std::swap(ctx->buffers, new_buffers);
+        // a launched store is done with its target and drops the reference nagisa_scatter gave it
+        for (auto idx : stores) {
+            auto &t = ctx->vars[ctx->vars[idx].target];
+            if (--t.pending_stores == 0) {
+                t.pending_adds_only = true;
+            }
+            nagisa_dec_ext(idx);
+        }
+        // stale hash-consing entries are only dropped on lookup, sweep them once they pile up
+        size_t num_vars = ctx->vars.size() - ctx->vars.num_free();
+        if (ctx->cse_table.size() > 2 * num_vars + 1024) {
+            ctx->cse_table.erase_stale(var_alive);
+        }
         ctx->_time++;
     }
+    // frees i and every dependency that was only kept alive by it
     void nagisa_free_var(int i) {
-        // std::cout << "free " << i << std::endl;
-        auto v = ctx->vars.at(i);
-        if (v.buf_idx != -1) {
-            ctx->buffers.erase(v.buf_idx);
+        std::vector<int> stack{i};
+        while (!stack.empty()) {
+            auto idx = stack.back();
+            stack.pop_back();
+            auto &v = ctx->vars[idx];
+            if (v.buf_idx != -1 && !keep_for_capture(v.buf_idx, !v.borrowed)) {
+                auto it = ctx->buffers.find(v.buf_idx);
+                auto spill = ctx->spills.find(v.buf_idx);
+                // wrapped host memory does not belong to the pool
+                if (!v.borrowed && spill == ctx->spills.end()) {
+                    ctx->allocator->release(std::move(it->second));
+                }
+                ctx->buffers.erase(it);
+                // unmapped only once the buffer over it is done with its launches
+                if (spill != ctx->spills.end()) {
+                    ctx->spills.erase(spill);
+                }
+            }
+            auto release = [&](int dep) {
+                if (dep >= (int)Predefined::Total) {
+                    auto &u = ctx->vars[dep];
+                    NGS_ASSERT(u._ref_int > 0);
+                    if (--u._ref_int == 0 && u._ref_ext == 0) {
+                        stack.push_back(dep);
+                    }
+                }
+            };
+            std::array<int, 4> refs{v.inst.deps[0], v.inst.deps[1], v.inst.deps[2], v.target};
+            std::for_each(refs.begin(), refs.end(), release);
+            if (nagisa_is_region(v.inst.op)) {
+                auto it = ctx->regions.find(idx);
+                auto &r = it->second;
+                release(r.cond);
+                for (auto list : {&r.inits, &r.phis, &r.results, &r.head, &r.body}) {
+                    std::for_each(list->begin(), list->end(), release);
+                }
+                ctx->regions.erase(it);
+            }
+            ctx->live.reset(idx);
+            ctx->evaluated.reset(idx);
+            ctx->vars.free(idx);
+        }
+    }
+    int nagisa_from_host(const void *p, size_t count, Type type) {
+        if (ctx->vars.size() == 0) {
+            nagisa_add_predefined();
+        }
+        auto bytes = count * get_typesize(type);
+        int id = ctx->next_buffer_id++;
+        ctx->buffers.emplace(id, ctx->backend->wrap_host(const_cast<void *>(p), bytes, type));
+        int idx = ctx->vars.alloc((int)Predefined::Total - 1);
+        auto &v = ctx->vars[idx];
+        v.inst.op = Input;
+        v.type = type;
+        v.size = count;
+        v.buf_idx = id;
+        v.borrowed = true;
+        v._last_sync_time = ctx->_time;
+        ctx->evaluated.set(idx);
+        return idx;
+    }
+    // evaluates idx, giving it a buffer even if it is a size-1 var
+    static void eval_to_buffer(int idx) {
+        auto &v = ctx->vars[idx];
+        nagisa_schedule(idx);
+        nagisa_eval();
+        NGS_ASSERT(v.buf_idx != -1);
+    }
+    // an evaluated var over a new pooled buffer of n elements, whose contents are up to the caller
+    static int new_buffer_var(size_t n, Type type) {
+        auto [_, id] = nagisa_alloc(n * get_typesize(type), type);
+        int idx = ctx->vars.alloc((int)Predefined::Total - 1);
+        auto &v = ctx->vars[idx];
+        v.inst.op = Input;
+        v.type = type;
+        v.size = n;
+        v.buf_idx = id;
+        v._last_sync_time = ctx->_time;
+        ctx->evaluated.set(idx);
+        return idx;
+    }
+    static DeviceBuffer *buffer_of(int idx) { return ctx->buffers.at(ctx->vars[idx].buf_idx).get(); }
+    // a new evaluated var holding the contents of idx, the copy is queued behind the launches writing it
+    static int copy_var(int idx) {
+        auto &src = ctx->vars[idx];
+        int copy = new_buffer_var(src.num_elements(), src.type);
+        auto bytes = src.num_elements() * get_typesize(src.type);
+        nagisa_count(Counter::BytesCopied, bytes);
+        if (ctx->capture) {
+            record_copy(ctx->vars[copy].buf_idx, 0, src.buf_idx, 0, bytes);
+        }
+        ctx->backend->copy(ctx->stream.get(), buffer_of(copy), 0, buffer_of(idx), 0, bytes);
+        return copy;
+    }
+    int nagisa_empty(size_t count, Type type) {
+        if (ctx->vars.size() == 0) {
+            nagisa_add_predefined();
+        }
+        return new_buffer_var(count, type);
+    }
+    int nagisa_upload(const void *p, size_t count, Type type) {
+        int idx = nagisa_empty(count, type);
+        nagisa_count(Counter::BytesUploaded, count * get_typesize(type));
+        if (ctx->capture) {
+            record_write(ctx->vars[idx].buf_idx, p, count * get_typesize(type));
+        }
+        buffer_of(idx)->write(static_cast<const uint8_t *>(p), count * get_typesize(type), 0);
+        return idx;
+    }
+    int nagisa_prefix_sum(int idx, size_t size, bool exclusive) {
+        // the scan reads a buffer of `size` elements, a broadcast element or ThreadIdx is written out first
+        int wide = -1;
+        if (idx < (int)Predefined::Total || ctx->vars[idx].num_elements() != size) {
+            wide = nagisa_trace_append(Instruction::unary(Cast, idx), ctx->vars[idx].type, size);
+            nagisa_inc_ext(wide);
+            idx = wide;
+        }
+        eval_to_buffer(idx);
+        auto &v = ctx->vars[idx];
+        auto n = v.num_elements();
+        NGS_ASSERT(n == size);
+        int out = new_buffer_var(n, v.type);
+        if (ctx->capture) {
+            GraphCommand cmd;
+            cmd.kind = GraphCommand::PrefixSum;
+            cmd.buffers = {ctx->vars[out].buf_idx, v.buf_idx};
+            cmd.size = n;
+            cmd.exclusive = exclusive;
+            record_command(std::move(cmd));
+        }
+        ctx->backend->prefix_sum(ctx->stream.get(), buffer_of(out), buffer_of(idx), n, exclusive);
+        if (wide != -1) {
+            nagisa_dec_ext(wide);
+        }
+        return out;
+    }
+    /*
+    A Store/ScatterAdd var writes into the buffer of its target in place. It is kept pending
+    until the next nagisa_eval, and until then every trace_append using the target flushes first.
+    The target is copied if anything else can still observe its contents
+    */
+    int nagisa_scatter(int target, int index, int value, int mask, size_t size, bool add) {
+        fail_if_recording("scatters can't be used");
+        // each queued store holds one internal reference
+        auto shared = [&] {
+            auto &t = ctx->vars[target];
+            return t._ref_ext > 1 || t._ref_int > t.pending_stores || t.borrowed;
+        };
+        auto &t = ctx->vars[target];
+        // stores into one target may share a kernel and run in any order, which is only fine for adds
+        bool reorder = t.pending_stores > 0 && (!add || !t.pending_adds_only || shared());
+        if (!ctx->evaluated.test(target)) {
+            eval_to_buffer(target);
+        } else if (reorder || needs_flush(index) || needs_flush(value) || needs_flush(mask)) {
+            nagisa_eval();
+        }
+        NGS_ASSERT(ctx->evaluated.test(target));
+        if (shared()) {
+            target = copy_var(target);
+        }
+        std::array<int, 3> deps{index, value, mask};
+        int after = (int)Predefined::Total - 1;
+        for (auto dep : deps) {
+            if (dep >= (int)Predefined::Total && ctx->vars[dep]._last_sync_time == -1) {
+                after = std::max(after, dep);
+            }
+        }
+        int idx = ctx->vars.alloc(after);
+        auto &v = ctx->vars[idx];
+        v.inst = Instruction::store(index, value, mask, add);
+        v.type = Type::none;
+        v.size = size;
+        v.target = target;
+        for (auto dep : deps) {
+            nagisa_inc_int(dep);
         }
+        nagisa_inc_int(target);
+        // nothing refers to a store, this keeps it alive until it is launched
+        nagisa_inc_ext(idx);
+        ctx->live.set(idx);
+        auto &u = ctx->vars[target];
+        u.pending_stores++;
+        u.pending_adds_only = u.pending_adds_only && add;
+        return target;
     }
+    const void *nagisa_map(int idx) {
+        eval_to_buffer(idx);
+        auto &v = ctx->vars[idx];
+        auto bytes = get_typesize(v.type) * v.num_elements();
+        ScopedPhase phase(Phase::Readback, "map", bytes);
+        nagisa_count(Counter::BytesDownloaded, bytes);
+        return ctx->buffers.at(v.buf_idx)->map(bytes);
+    }
+    void nagisa_unmap(int idx, const void *p) { ctx->buffers.at(ctx->vars[idx].buf_idx)->unmap(p); }
     void nagisa_copy_to_host(int idx, void *p) {
-        auto &v = ctx->vars.at(idx);
-        NGS_ASSERT(v.size != 1);
+        eval_to_buffer(idx);
+        auto &v = ctx->vars[idx];
+        auto bytes = get_typesize(v.type) * v.num_elements();
+        ScopedPhase phase(Phase::Readback, "read", bytes);
+        nagisa_count(Counter::BytesDownloaded, bytes);
+        ctx->buffers.at(v.buf_idx)->read((uint8_t *)p, bytes, 0);
+    }
+    void nagisa_capture_begin(const int *inputs, size_t n) {
+        fail_if_recording("can't capture a graph");
+        if (ctx->capture) {
+            std::cerr << "graph captures can't be nested" << std::endl;
+            exit(1);
+        }
+        for (size_t k = 0; k < n; k++) {
+            NGS_ASSERT(inputs[k] >= (int)Predefined::Total);
+            nagisa_schedule(inputs[k]);
+        }
+        // what is pending now is not part of the graph
         nagisa_eval();
-
-        auto buf_id = v.buf_idx;
-        std::cout << "reading buffer" << buf_id << std::endl;
-        ctx->buffers[buf_id]->read((uint8_t *)p, get_typesize(v.type) * v.size, 0);
+        auto graph = std::make_unique<CapturedGraph>();
+        for (size_t k = 0; k < n; k++) {
+            auto &v = ctx->vars[inputs[k]];
+            NGS_ASSERT(v.buf_idx != -1);
+            // replay may bind another value, which must not be folded into the kernels
+            v.inst.opaque = true;
+            graph->input_buffers.push_back(v.buf_idx);
+            graph->input_shapes.emplace_back(v.type, v.num_elements());
+        }
+        ctx->capture = std::move(graph);
+    }
+    int nagisa_capture_end() {
+        NGS_ASSERT(ctx->capture);
+        nagisa_eval();
+        auto &graph = *ctx->capture;
+        // the used buffers the graph does not own yet belong to live vars, which it keeps alive
+        for (int idx = (int)Predefined::Total; idx < (int)ctx->vars.size(); idx++) {
+            auto &v = ctx->vars[idx];
+            if (!ctx->vars.is_free(idx) && v.buf_idx != -1 && graph.used.count(v.buf_idx) &&
+                !graph.owned.count(v.buf_idx)) {
+                nagisa_inc_ext(idx);
+                graph.held.push_back(idx);
+            }
+        }
+        int id = ctx->next_graph_id++;
+        ctx->graphs.emplace(id, std::move(ctx->capture));
+        return id;
+    }
+    void nagisa_graph_replay(int id, const int *inputs, size_t n) {
+        fail_if_recording("can't replay a graph");
+        auto &graph = *ctx->graphs.at(id);
+        if (n != graph.input_buffers.size()) {
+            std::cerr << "a graph captured with " << graph.input_buffers.size() << " inputs is replayed with " << n
+                      << std::endl;
+            exit(1);
+        }
+        for (size_t k = 0; k < n; k++) {
+            nagisa_schedule(inputs[k]);
+        }
+        // writes pending into the buffers of the graph happen before the replay
+        nagisa_eval();
+        std::unordered_map<int, DeviceBuffer *> bound;
+        for (size_t k = 0; k < n; k++) {
+            auto &v = ctx->vars[inputs[k]];
+            if (std::make_pair(v.type, v.num_elements()) != graph.input_shapes[k]) {
+                std::cerr << "input " << k << " of a graph is replayed with an array of another type or size"
+                          << std::endl;
+                exit(1);
+            }
+            bound[graph.input_buffers[k]] = buffer_of(inputs[k]);
+        }
+        auto buffer = [&](int buf) {
+            auto it = bound.find(buf);
+            if (it != bound.end()) {
+                return it->second;
+            }
+            auto kept = graph.owned.find(buf);
+            return kept != graph.owned.end() ? kept->second.buffer.get() : ctx->buffers.at(buf).get();
+        };
+        std::vector<DeviceBuffer *> args;
+        for (auto &cmd : graph.commands) {
+            switch (cmd.kind) {
+            case GraphCommand::Launch:
+                args.clear();
+                for (auto buf : cmd.buffers) {
+                    args.push_back(buffer(buf));
+                }
+                cmd.kernel->params = cmd.params;
+                cmd.kernel->size = cmd.size;
+                ctx->backend->launch(ctx->stream.get(), *cmd.kernel, args);
+                break;
+            case GraphCommand::Copy:
+                nagisa_count(Counter::BytesCopied, cmd.bytes);
+                ctx->backend->copy(ctx->stream.get(), buffer(cmd.buffers[0]), cmd.dst_offset, buffer(cmd.buffers[1]),
+                                   cmd.src_offset, cmd.bytes);
+                break;
+            case GraphCommand::Write:
+                nagisa_count(Counter::BytesUploaded, cmd.bytes);
+                buffer(cmd.buffers[0])->write(cmd.data.data(), cmd.bytes, 0);
+                break;
+            case GraphCommand::PrefixSum:
+                ctx->backend->prefix_sum(ctx->stream.get(), buffer(cmd.buffers[0]), buffer(cmd.buffers[1]), cmd.size,
+                                         cmd.exclusive);
+                break;
+            }
+        }
+        ctx->graph_epoch++;
+    }
+    void nagisa_graph_free(int id) {
+        auto it = ctx->graphs.find(id);
+        auto graph = std::move(it->second);
+        ctx->graphs.erase(it);
+        for (auto &[_, kept] : graph->owned) {
+            if (kept.pooled) {
+                ctx->allocator->release(std::move(kept.buffer));
+            }
+        }
+        for (auto idx : graph->held) {
+            nagisa_dec_ext(idx);
+        }
+    }
+    uint64_t nagisa_graph_epoch() { return ctx ? ctx->graph_epoch : 0; }
+    /*
+    Generates what nagisa_eval would for the pending trace and only prepares the kernels. Outputs and reductions
+    get placeholder buffers, the vars and live are put back afterwards. Groups from the first tiled one on are
+    left out, their spill buffers can't be stood in for
+    */
+    void nagisa_precompile() {
+        ctx->traced_since_precompile = 0;
+        if (!ctx->recording.empty() || ctx->capture) {
+            return;
+        }
+        ScopedPhase phase(Phase::Codegen, "precompile");
+        auto live = ctx->live;
+        drop_deferred_roots();
+        if (!ctx->live.empty()) {
+            auto traces = schedule_traces();
+            ctx->speculating = true;
+            for (auto &[size, trace] : traces) {
+                if (needs_tiling(size, trace)) {
+                    break;
+                }
+                auto kernel = generate_kernel(size, trace, nullptr);
+                if (writes_buffers(kernel)) {
+                    ctx->backend->prepare(kernel);
+                }
+            }
+            ctx->speculating = false;
+            for (auto it = ctx->undo.rbegin(); it != ctx->undo.rend(); it++) {
+                auto &v = ctx->vars[it->idx];
+                v.buf_idx = it->buf_idx;
+                v._last_sync_time = it->last_sync_time;
+                if (!it->evaluated) {
+                    ctx->evaluated.reset(it->idx);
+                }
+            }
+            ctx->undo.clear();
+            ctx->placeholders.clear();
+        }
+        ctx->live = std::move(live);
     }
-} // namespace nagisa
\ No newline at end of file
+    void nagisa_set_background_compile(size_t nodes) { ctx->background_compile = nodes; }
+} // namespace nagisa
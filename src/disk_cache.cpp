@@ -0,0 +1,173 @@
+// MIT License
+//
+// Copyright (c) 2020 椎名深雪
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+#include "disk_cache.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <unistd.h>
+namespace nagisa {
+    namespace fs = std::filesystem;
+    DiskCache::DiskCache() {
+        max_bytes = size_t(1) << 30;
+        if (auto env = std::getenv("NAGISA_CACHE_SIZE")) {
+            max_bytes = std::strtoull(env, nullptr, 10);
+        }
+        if (auto env = std::getenv("NAGISA_CACHE_DIR")) {
+            dir = env;
+        } else if (auto env = std::getenv("XDG_CACHE_HOME")) {
+            dir = fs::path(env) / "nagisa";
+        } else if (auto env = std::getenv("HOME")) {
+            dir = fs::path(env) / ".cache" / "nagisa";
+        } else {
+            dir = fs::temp_directory_path() / "nagisa-cache";
+        }
+        if (enabled()) {
+            std::error_code ec;
+            fs::create_directories(dir, ec);
+            if (ec) {
+                std::cerr << "cannot create kernel cache " << dir << ": " << ec.message() << std::endl;
+                max_bytes = 0;
+            }
+        }
+    }
+    bool DiskCache::contains(const std::string &key) {
+        if (!enabled()) {
+            return false;
+        }
+        std::error_code ec;
+        // touching the entry is what keeps it away from eviction
+        fs::last_write_time(path(key), fs::file_time_type::clock::now(), ec);
+        std::lock_guard<std::mutex> lock(stats_mutex);
+        if (ec) {
+            _stats.misses++;
+            return false;
+        }
+        _stats.disk_hits++;
+        return true;
+    }
+    std::optional<std::vector<uint8_t>> DiskCache::load(const std::string &key) {
+        if (!contains(key)) {
+            return std::nullopt;
+        }
+        std::ifstream in(path(key), std::ios::binary);
+        std::vector<uint8_t> data((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+        if (!in.good() && !in.eof()) {
+            // evicted by another process between the touch and the read
+            std::lock_guard<std::mutex> lock(stats_mutex);
+            _stats.disk_hits--;
+            _stats.misses++;
+            return std::nullopt;
+        }
+        return data;
+    }
+    fs::path DiskCache::temp_path(const std::string &key) const {
+        static std::atomic<uint64_t> counter{0};
+        std::ostringstream name;
+        name << key << ".tmp." << getpid() << "." << counter++;
+        return dir / name.str();
+    }
+    void DiskCache::store(const std::string &key, const std::vector<uint8_t> &data) {
+        if (!enabled()) {
+            return;
+        }
+        auto tmp = temp_path(key);
+        {
+            std::ofstream out(tmp, std::ios::binary);
+            out.write(reinterpret_cast<const char *>(data.data()), data.size());
+            if (!out) {
+                std::error_code ec;
+                fs::remove(tmp, ec);
+                return;
+            }
+        }
+        publish(key, tmp);
+    }
+    void DiskCache::publish(const std::string &key, const fs::path &file) {
+        if (!enabled()) {
+            return;
+        }
+        std::error_code ec;
+        fs::rename(file, path(key), ec);
+        if (ec) {
+            fs::remove(file, ec);
+            return;
+        }
+        {
+            std::lock_guard<std::mutex> lock(stats_mutex);
+            _stats.writes++;
+        }
+        evict();
+    }
+    void DiskCache::evict() {
+        struct Entry {
+            fs::path path;
+            fs::file_time_type time;
+            uintmax_t size;
+        };
+        std::vector<Entry> entries;
+        uintmax_t total = 0;
+        std::error_code ec;
+        for (auto &e : fs::directory_iterator(dir, ec)) {
+            std::error_code ec2;
+            if (!e.is_regular_file(ec2) || e.path().filename().string().find(".tmp.") != std::string::npos) {
+                continue;
+            }
+            Entry entry{e.path(), e.last_write_time(ec2), e.file_size(ec2)};
+            if (ec2) {
+                continue;
+            }
+            total += entry.size;
+            entries.emplace_back(std::move(entry));
+        }
+        {
+            std::lock_guard<std::mutex> lock(stats_mutex);
+            _stats.disk_bytes = total;
+        }
+        if (total <= max_bytes) {
+            return;
+        }
+        std::sort(entries.begin(), entries.end(), [](const Entry &a, const Entry &b) { return a.time < b.time; });
+        // leave some headroom so that the next store doesn't evict again
+        auto target = max_bytes / 10 * 9;
+        for (auto &e : entries) {
+            if (total <= target) {
+                break;
+            }
+            if (fs::remove(e.path, ec)) {
+                total -= e.size;
+                std::lock_guard<std::mutex> lock(stats_mutex);
+                _stats.evictions++;
+            }
+        }
+        std::lock_guard<std::mutex> lock(stats_mutex);
+        _stats.disk_bytes = total;
+    }
+    DiskCache &nagisa_disk_cache() {
+        static DiskCache cache;
+        return cache;
+    }
+    KernelCacheStats nagisa_kernel_cache_stats() { return nagisa_disk_cache().stats(); }
+} // namespace nagisa
@@ -0,0 +1,68 @@
+// MIT License
+//
+// Copyright (c) 2020 椎名深雪
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#pragma once
+#include <nagisa/nagisa.hpp>
+#include <filesystem>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <vector>
+namespace nagisa {
+    /*
+    Content-addressed store of compiled kernels shared by all processes on the host.
+    Entries are published with an atomic rename, and a hit refreshes the entry's
+    mtime so eviction can drop the least recently used files once the cap is exceeded
+    */
+    class DiskCache {
+        std::filesystem::path dir;
+        size_t max_bytes;
+        // the backends of every context compile through the cache, the file operations are safe as they
+        // are across processes, only the stats need the lock
+        mutable std::mutex stats_mutex;
+        KernelCacheStats _stats;
+        void evict();
+
+      public:
+        // NAGISA_CACHE_DIR overrides the location, NAGISA_CACHE_SIZE the cap in bytes (0 disables the cache)
+        DiskCache();
+        bool enabled() const { return max_bytes > 0; }
+        std::filesystem::path path(const std::string &key) const { return dir / key; }
+        std::optional<std::vector<uint8_t>> load(const std::string &key);
+        // for entries the caller opens itself (e.g. with dlopen)
+        bool contains(const std::string &key);
+        void store(const std::string &key, const std::vector<uint8_t> &data);
+        // atomically moves a file written by the caller into the cache
+        void publish(const std::string &key, const std::filesystem::path &file);
+        // path in the cache directory the caller can write to before publish()
+        std::filesystem::path temp_path(const std::string &key) const;
+        void record_memory_hit() {
+            std::lock_guard<std::mutex> lock(stats_mutex);
+            _stats.memory_hits++;
+        }
+        KernelCacheStats stats() const {
+            std::lock_guard<std::mutex> lock(stats_mutex);
+            return _stats;
+        }
+    };
+    DiskCache &nagisa_disk_cache();
+} // namespace nagisa
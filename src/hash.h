@@ -0,0 +1,97 @@
+// MIT License
+//
+// Copyright (c) 2020 椎名深雪
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#pragma once
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <utility>
+namespace nagisa {
+    using KernelHash = std::pair<uint64_t, uint64_t>;
+    struct KernelHashHasher {
+        size_t operator()(const KernelHash &h) const { return (size_t)h.first; }
+    };
+
+    /*
+    Streaming 128-bit hash used to address kernels in the caches.
+    Not cryptographic, but wide enough that collisions are not a practical concern
+    */
+    class Hasher {
+        uint64_t h1 = 0x9e3779b97f4a7c15ull, h2 = 0xc2b2ae3d27d4eb4full;
+        uint64_t length = 0;
+        static uint64_t rotl(uint64_t x, int r) { return (x << r) | (x >> (64 - r)); }
+        static uint64_t fmix(uint64_t k) {
+            k ^= k >> 33;
+            k *= 0xff51afd7ed558ccdull;
+            k ^= k >> 33;
+            k *= 0xc4ceb9fe1a85ec53ull;
+            k ^= k >> 33;
+            return k;
+        }
+        void mix(uint64_t w) {
+            h1 = rotl((h1 ^ w) * 0x87c37b91114253d5ull, 31);
+            h2 = rotl((h2 ^ w) * 0x4cf5ad432745937full, 29) + h1;
+        }
+
+      public:
+        Hasher &update(const void *data, size_t bytes) {
+            auto p = static_cast<const uint8_t *>(data);
+            length += bytes;
+            for (; bytes >= 8; bytes -= 8, p += 8) {
+                uint64_t w;
+                std::memcpy(&w, p, 8);
+                mix(w);
+            }
+            if (bytes > 0) {
+                uint64_t w = 0;
+                std::memcpy(&w, p, bytes);
+                mix(w ^ (uint64_t(bytes) << 56));
+            }
+            return *this;
+        }
+        Hasher &update(std::string_view s) {
+            update(s.data(), s.size());
+            // keeps ("ab", "c") and ("a", "bc") apart
+            return update<uint64_t>(s.size());
+        }
+        template <typename T>
+        std::enable_if_t<std::is_trivially_copyable_v<T>, Hasher &> update(const T &v) {
+            return update(&v, sizeof(T));
+        }
+        KernelHash digest() const {
+            auto a = fmix(h1 ^ length), b = fmix(h2 + a);
+            return {a + b, b};
+        }
+        std::string hex() const {
+            static const char *digits = "0123456789abcdef";
+            auto [a, b] = digest();
+            std::string s(32, '0');
+            for (int i = 0; i < 16; i++) {
+                s[15 - i] = digits[(a >> (4 * i)) & 15];
+                s[31 - i] = digits[(b >> (4 * i)) & 15];
+            }
+            return s;
+        }
+    };
+} // namespace nagisa
@@ -0,0 +1,833 @@
+// MIT License
+//
+// Copyright (c) 2020 椎名深雪
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+#ifdef NAGISA_ENABLE_OPENCL
+#include "backend.h"
+#include "disk_cache.h"
+#include "hash.h"
+#include "profiler.h"
+#include "thread_pool.h"
+#include <CL/cl.hpp>
+#include <algorithm>
+#include <cctype>
+#include <cstdlib>
+#include <cstring>
+#include <future>
+#include <iostream>
+#include <mutex>
+#include <numeric>
+#include <optional>
+#include <sstream>
+#include <unordered_map>
+namespace nagisa {
+    static OpenCLDevice device_options;
+    void nagisa_set_opencl_device(const OpenCLDevice &device) { device_options = device; }
+    static cl_device_type cl_type(DeviceType type) {
+        switch (type) {
+        case DeviceType::gpu:
+            return CL_DEVICE_TYPE_GPU;
+        case DeviceType::cpu:
+            return CL_DEVICE_TYPE_CPU;
+        case DeviceType::accelerator:
+            return CL_DEVICE_TYPE_ACCELERATOR;
+        default:
+            return CL_DEVICE_TYPE_ALL;
+        }
+    }
+    static const char *type_name(cl_device_type type) {
+        if (type & CL_DEVICE_TYPE_GPU) {
+            return "gpu";
+        }
+        if (type & CL_DEVICE_TYPE_CPU) {
+            return "cpu";
+        }
+        return type & CL_DEVICE_TYPE_ACCELERATOR ? "accelerator" : "other";
+    }
+    // device_options with the NAGISA_OPENCL_* overrides applied
+    static OpenCLDevice selected_device() {
+        auto options = device_options;
+        if (auto env = std::getenv("NAGISA_OPENCL_PLATFORM")) {
+            options.platform = env;
+        }
+        if (auto env = std::getenv("NAGISA_OPENCL_DEVICE")) {
+            std::string s = env;
+            auto colon = s.find(':');
+            auto type = s.substr(0, colon);
+            if (type == "gpu") {
+                options.type = DeviceType::gpu;
+            } else if (type == "cpu") {
+                options.type = DeviceType::cpu;
+            } else if (type == "accelerator") {
+                options.type = DeviceType::accelerator;
+            } else if (type == "all") {
+                options.type = DeviceType::all;
+            } else {
+                std::cerr << "unknown NAGISA_OPENCL_DEVICE " << env << std::endl;
+                exit(1);
+            }
+            options.index = colon == std::string::npos ? 0 : std::atoi(s.c_str() + colon + 1);
+        }
+        if (auto env = std::getenv("NAGISA_OPENCL_SHARDS")) {
+            if (std::strcmp(env, "devices") == 0) {
+                options.shards = ShardMode::devices;
+            } else if (std::strcmp(env, "numa") == 0) {
+                options.shards = ShardMode::numa;
+            } else {
+                options.sub_devices = std::atoi(env);
+                options.shards = options.sub_devices > 1 ? ShardMode::sub_devices : ShardMode::none;
+            }
+        }
+        return options;
+    }
+    static bool platform_matches(const std::string &pattern, size_t index, const cl::Platform &platform) {
+        if (pattern.empty()) {
+            return true;
+        }
+        if (std::all_of(pattern.begin(), pattern.end(), [](char c) { return std::isdigit((unsigned char)c); })) {
+            return std::stoul(pattern) == index;
+        }
+        return platform.getInfo<CL_PLATFORM_NAME>().find(pattern) != std::string::npos;
+    }
+    std::vector<std::string> nagisa_opencl_devices() {
+        std::vector<std::string> lines;
+        std::vector<cl::Platform> platforms;
+        cl::Platform::get(&platforms);
+        for (size_t i = 0; i < platforms.size(); i++) {
+            lines.push_back("platform " + std::to_string(i) + ": " + platforms[i].getInfo<CL_PLATFORM_NAME>());
+            std::vector<cl::Device> devices;
+            platforms[i].getDevices(CL_DEVICE_TYPE_ALL, &devices);
+            for (size_t j = 0; j < devices.size(); j++) {
+                lines.push_back("  device " + std::to_string(j) + ": " + devices[j].getInfo<CL_DEVICE_NAME>() + ", " +
+                                type_name(devices[j].getInfo<CL_DEVICE_TYPE>()) + ", " +
+                                std::to_string(devices[j].getInfo<CL_DEVICE_MAX_COMPUTE_UNITS>()) + " units");
+            }
+        }
+        return lines;
+    }
+    struct OCLContext {
+        cl::Platform platform;
+        // the selected device, or its first shard
+        cl::Device device;
+        // the devices the range of a launch is split over, just device unless sharding
+        std::vector<cl::Device> devices;
+        cl::Context context;
+        // host transfers of the buffers, launches go to the queues of the streams
+        cl::CommandQueue queue;
+        cl_command_queue_properties props = 0;
+        // whether the queues record the timestamps of their commands, decided once by nagisa_init
+        bool profiling = false;
+        // replaces devices by the shards of the selected device, keeps it whole if it can't be split
+        void partition(const OpenCLDevice &options) {
+            std::vector<cl_device_partition_property> props;
+            if (options.shards == ShardMode::numa) {
+                props = {CL_DEVICE_PARTITION_BY_AFFINITY_DOMAIN, CL_DEVICE_AFFINITY_DOMAIN_NUMA, 0};
+            } else {
+                auto units = device.getInfo<CL_DEVICE_MAX_COMPUTE_UNITS>();
+                if (options.sub_devices < 2) {
+                    return;
+                }
+                if ((cl_uint)options.sub_devices > units) {
+                    if (nagisa_logging()) {
+                        std::cerr << "Can't split " << units << " compute units into " << options.sub_devices
+                                  << " sub-devices\n";
+                    }
+                    return;
+                }
+                props = {CL_DEVICE_PARTITION_EQUALLY, (cl_device_partition_property)(units / options.sub_devices), 0};
+            }
+            std::vector<cl::Device> sub_devices;
+            if (device.createSubDevices(props.data(), &sub_devices) != CL_SUCCESS || sub_devices.empty()) {
+                if (nagisa_logging()) {
+                    std::cerr << "The device can't be partitioned, running unsharded\n";
+                }
+                return;
+            }
+            // equal parts may leave enough units over for more sub-devices than asked for
+            if (options.shards == ShardMode::sub_devices && sub_devices.size() > (size_t)options.sub_devices) {
+                sub_devices.resize(options.sub_devices);
+            }
+            devices = sub_devices;
+            device = devices[0];
+        }
+        bool init() {
+            auto options = selected_device();
+            std::vector<cl::Platform> all_platforms;
+            cl::Platform::get(&all_platforms);
+
+            if (all_platforms.size() == 0) {
+                if (nagisa_logging()) {
+                    std::cerr << "No platforms found. Check OpenCL installation!\n";
+                }
+                return false;
+            }
+            for (size_t i = 0; i < all_platforms.size() && devices.empty(); i++) {
+                if (!platform_matches(options.platform, i, all_platforms[i])) {
+                    continue;
+                }
+                std::vector<cl::Device> candidates;
+                all_platforms[i].getDevices(cl_type(options.type), &candidates);
+                if (options.index >= 0 && (size_t)options.index < candidates.size()) {
+                    platform = all_platforms[i];
+                    device = candidates[options.index];
+                    devices = {device};
+                    if (options.shards == ShardMode::devices) {
+                        devices.assign(candidates.begin() + options.index, candidates.end());
+                    }
+                }
+            }
+            if (devices.empty()) {
+                if (nagisa_logging()) {
+                    std::cerr << "No matching devices found. Check OpenCL installation!\n";
+                }
+                return false;
+            }
+            if (nagisa_logging()) {
+                std::cerr << "Using platform: " << platform.getInfo<CL_PLATFORM_NAME>() << "\n";
+                std::cerr << "Using device: " << device.getInfo<CL_DEVICE_NAME>() << "\n";
+            }
+            if (options.shards == ShardMode::sub_devices || options.shards == ShardMode::numa) {
+                partition(options);
+            }
+            if (devices.size() > 1) {
+                if (nagisa_logging()) {
+                    std::cerr << "Sharding launches over " << devices.size() << " devices\n";
+                }
+            }
+            context = cl::Context(devices);
+            // launches are ordered by the events of the buffers they touch, so they may overlap
+            if (std::all_of(devices.begin(), devices.end(), [](const cl::Device &d) {
+                    return d.getInfo<CL_DEVICE_QUEUE_PROPERTIES>() & CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE;
+                })) {
+                props |= CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE;
+            }
+            profiling = nagisa_profiling();
+            if (profiling) {
+                props |= CL_QUEUE_PROFILING_ENABLE;
+            }
+            queue = cl::CommandQueue(context, device, props);
+            return true;
+        }
+    };
+    // events are valid across the queues of a cl::Context, so buffers order the commands of every stream
+    class OCLStream : public CommandStream {
+      public:
+        // on OCLContext::device, copies and scans go here
+        cl::CommandQueue queue;
+        // a queue per shard, the first one is queue
+        std::vector<cl::CommandQueue> shard_queues;
+    };
+    class OCLBuffer : public DeviceBuffer {
+        OCLContext *ocl_ctx;
+        cl::Buffer buffer;
+        // over host memory given to wrap_host
+        bool borrowed = false;
+        // the last command that wrote the buffer and the commands reading it since
+        cl::Event write_event;
+        std::vector<cl::Event> read_events;
+
+      public:
+        size_t _size;
+        OCLBuffer(OCLContext *ocl_ctx, Type type, size_t s)
+            : DeviceBuffer(type), ocl_ctx(ocl_ctx), buffer(ocl_ctx->context, CL_MEM_READ_WRITE, s), _size(s) {}
+        OCLBuffer(OCLContext *ocl_ctx, Type type, void *p, size_t s)
+            : DeviceBuffer(type), ocl_ctx(ocl_ctx),
+              buffer(ocl_ctx->context, CL_MEM_READ_WRITE | CL_MEM_USE_HOST_PTR, s, p), borrowed(true), _size(s) {}
+        ~OCLBuffer() {
+            if (borrowed) {
+                // the runtime keeps the buffer alive for queued commands, but not the host memory behind it
+                std::vector<cl::Event> events;
+                dependencies(true, events);
+                if (!events.empty()) {
+                    cl::Event::waitForEvents(events);
+                }
+            }
+        }
+        size_t size() override { return _size; }
+        // events a command accessing the buffer has to wait for
+        void dependencies(bool writes, std::vector<cl::Event> &events) const {
+            if (write_event() != nullptr) {
+                events.push_back(write_event);
+            }
+            if (writes) {
+                events.insert(events.end(), read_events.begin(), read_events.end());
+            }
+        }
+        void record(bool writes, const cl::Event &event) {
+            if (writes) {
+                write_event = event;
+                read_events.clear();
+                return;
+            }
+            if (read_events.size() >= 16) {
+                read_events.erase(std::remove_if(read_events.begin(), read_events.end(),
+                                                 [](const cl::Event &e) {
+                                                     return e.getInfo<CL_EVENT_COMMAND_EXECUTION_STATUS>() ==
+                                                            CL_COMPLETE;
+                                                 }),
+                                  read_events.end());
+            }
+            read_events.push_back(event);
+        }
+        void write(const uint8_t *p, size_t bytes, size_t offset) override {
+            std::vector<cl::Event> deps;
+            dependencies(true, deps);
+            cl::Event event;
+            ocl_ctx->queue.enqueueWriteBuffer(buffer, CL_TRUE, offset, bytes, p, &deps, &event);
+            record(true, event);
+        }
+        void read(uint8_t *p, size_t bytes, size_t offset) override {
+            std::vector<cl::Event> deps;
+            dependencies(false, deps);
+            ocl_ctx->queue.enqueueReadBuffer(buffer, CL_TRUE, offset, bytes, p, &deps);
+        }
+        const void *map(size_t bytes) override {
+            std::vector<cl::Event> deps;
+            dependencies(false, deps);
+            return ocl_ctx->queue.enqueueMapBuffer(buffer, CL_TRUE, CL_MAP_READ, 0, bytes, &deps);
+        }
+        void unmap(const void *p) override {
+            cl::Event event;
+            ocl_ctx->queue.enqueueUnmapMemObject(buffer, const_cast<void *>(p), nullptr, &event);
+            // writers reusing the buffer have to wait until it is unmapped
+            record(false, event);
+        }
+        void *get() override { return buffer(); }
+        const cl::Buffer &cl_buffer() const { return buffer; }
+        cl::Event copy_from(cl::CommandQueue &queue, OCLBuffer *src, size_t src_offset, size_t offset, size_t bytes) {
+            std::vector<cl::Event> deps;
+            dependencies(true, deps);
+            src->dependencies(false, deps);
+            cl::Event event;
+            queue.enqueueCopyBuffer(src->buffer, buffer, src_offset, offset, bytes, &deps, &event);
+            record(true, event);
+            src->record(false, event);
+            return event;
+        }
+    };
+    /*
+    OpenCL 1.2 only has 32-bit integer atomics, float adds retry a compare-and-swap on the bits.
+    64-bit values have none without extensions, so they can't be reduced or scatter_add'ed here
+    */
+    static const char *atomic_prelude = R"(#define atomic_add_i(p, x) atomic_add(p, x)
+#define atomic_add_u(p, x) atomic_add(p, x)
+#define atomic_max_u(p, x) atomic_max(p, x)
+#define atomic_min_u(p, x) atomic_min(p, x)
+void atomic_add_f(volatile __global float *p, float x) {
+    union { unsigned int u; float f; } old, next;
+    do {
+        old.f = *p;
+        next.f = old.f + x;
+    } while (atomic_cmpxchg((volatile __global unsigned int *)p, old.u, next.u) != old.u);
+}
+#define atomic_max_i(p, x) atomic_max(p, x)
+#define atomic_min_i(p, x) atomic_min(p, x)
+void atomic_max_f(volatile __global float *p, float x) {
+    union { unsigned int u; float f; } old, next;
+    next.f = x;
+    do {
+        old.f = *p;
+        if (!(x > old.f)) return;
+    } while (atomic_cmpxchg((volatile __global unsigned int *)p, old.u, next.u) != old.u);
+}
+void atomic_min_f(volatile __global float *p, float x) {
+    union { unsigned int u; float f; } old, next;
+    next.f = x;
+    do {
+        old.f = *p;
+        if (!(x < old.f)) return;
+    } while (atomic_cmpxchg((volatile __global unsigned int *)p, old.u, next.u) != old.u);
+}
+)";
+    /*
+    Scan in three launches: every group sums its slice, one group scans the group sums,
+    then every group scans its slice in tiles of G, starting from the sum of the slices before it.
+    T and G are defined in front of this
+    */
+    static const char *scan_source = R"(
+__kernel void scan_reduce(__global const T *in, __global T *sums, int n, int chunk) {
+    __local T l[G];
+    int lid = get_local_id(0);
+    int begin = get_group_id(0) * chunk, end = min(n, begin + chunk);
+    T s = 0;
+    for (int i = begin + lid; i < end; i += G) s += in[i];
+    l[lid] = s;
+    barrier(CLK_LOCAL_MEM_FENCE);
+    for (int k = G / 2; k > 0; k >>= 1) {
+        if (lid < k) l[lid] += l[lid + k];
+        barrier(CLK_LOCAL_MEM_FENCE);
+    }
+    if (lid == 0) sums[get_group_id(0)] = l[0];
+}
+// inclusive scan of l, every thread of the group has to call it
+void scan_local(__local T *l, int lid) {
+    for (int k = 1; k < G; k <<= 1) {
+        T x = lid >= k ? l[lid - k] : 0;
+        barrier(CLK_LOCAL_MEM_FENCE);
+        l[lid] += x;
+        barrier(CLK_LOCAL_MEM_FENCE);
+    }
+}
+__kernel void scan_sums(__global T *sums, int m) {
+    __local T l[G];
+    int lid = get_local_id(0);
+    l[lid] = lid < m ? sums[lid] : 0;
+    barrier(CLK_LOCAL_MEM_FENCE);
+    scan_local(l, lid);
+    if (lid < m) sums[lid] = lid > 0 ? l[lid - 1] : 0;
+}
+__kernel void scan_apply(__global const T *in, __global T *out, __global const T *sums, int n, int chunk, int exclusive) {
+    __local T l[G];
+    int lid = get_local_id(0);
+    int begin = get_group_id(0) * chunk, end = min(n, begin + chunk);
+    T carry = sums[get_group_id(0)];
+    for (int base = begin; base < end; base += G) {
+        int i = base + lid;
+        l[lid] = i < end ? in[i] : 0;
+        barrier(CLK_LOCAL_MEM_FENCE);
+        scan_local(l, lid);
+        if (i < end) out[i] = carry + (exclusive ? (lid > 0 ? l[lid - 1] : 0) : l[lid]);
+        carry += l[G - 1];
+        barrier(CLK_LOCAL_MEM_FENCE);
+    }
+}
+)";
+    class OCLBackend : public Backend {
+        OCLContext ocl_ctx;
+        // a program that is built or being built on compile_pool
+        struct CacheEntry {
+            std::shared_future<cl::Program> program;
+            // the first launch counts as the cache miss, even if prepare started the build
+            bool launched = false;
+        };
+        // guards kernel_cache and scan_programs, scans are built under it
+        std::mutex cache_mutex;
+        std::unordered_map<KernelHash, CacheEntry, KernelHashHasher> kernel_cache;
+        std::string device_identity;
+        // work-group size of kernels with reductions, a power of two
+        size_t group_size = 256;
+        // scan_source built for each element type
+        std::unordered_map<int, cl::Program> scan_programs;
+        // compute units of each device of ocl_ctx.devices, a sharded launch gives each a proportional slice
+        std::vector<size_t> shard_weights;
+        // fewer lanes per shard aren't worth the extra commands
+        size_t min_shard_size = 1 << 16;
+        // commands whose device timestamps are read once they are done, see OCLContext::profiling
+        struct PendingTiming {
+            cl::Event event;
+            const char *name;
+            size_t size;
+            // host time at which the command was queued
+            double queued;
+        };
+        std::mutex timings_mutex;
+        std::vector<PendingTiming> timings;
+        void time_command(const cl::Event &event, const char *name, size_t size) {
+            if (ocl_ctx.profiling && nagisa_profiling()) {
+                std::lock_guard<std::mutex> lock(timings_mutex);
+                timings.push_back({event, name, size, nagisa_now_us()});
+                if (timings.size() >= 64) {
+                    collect_timings(false);
+                }
+            }
+        }
+        // device timestamps are in ns on the device clock, only their offsets from CL_PROFILING_COMMAND_QUEUED are used
+        // with timings_mutex held
+        void collect_timings(bool all) {
+            auto done = [&](const PendingTiming &t) {
+                if (!all && t.event.getInfo<CL_EVENT_COMMAND_EXECUTION_STATUS>() != CL_COMPLETE) {
+                    return false;
+                }
+                auto queued = t.event.getProfilingInfo<CL_PROFILING_COMMAND_QUEUED>();
+                auto start = t.event.getProfilingInfo<CL_PROFILING_COMMAND_START>();
+                auto end = t.event.getProfilingInfo<CL_PROFILING_COMMAND_END>();
+                auto begin = t.queued + (start - queued) * 1e-3;
+                nagisa_record_phase(Phase::Device, t.name, begin, begin + (end - start) * 1e-3, t.size);
+                return true;
+            };
+            timings.erase(std::remove_if(timings.begin(), timings.end(), done), timings.end());
+        }
+
+        cl::Program build(const std::string &kernel_src) {
+            ScopedPhase phase(Phase::Compile, "compile");
+            nagisa_dump_kernel(kernel_src);
+            auto &disk = nagisa_disk_cache();
+            auto key = Hasher().update(kernel_src).update(device_identity).hex() + ".clbin";
+            auto binary = ocl_ctx.devices.size() == 1 ? disk.load(key) : std::nullopt;
+            if (binary) {
+                cl::Program::Binaries binaries;
+                binaries.push_back({binary->data(), binary->size()});
+                cl_int err = CL_SUCCESS;
+                cl::Program p(ocl_ctx.context, ocl_ctx.devices, binaries, nullptr, &err);
+                // a stale or truncated binary is rebuilt from source below
+                if (err == CL_SUCCESS && p.build(ocl_ctx.devices) == CL_SUCCESS) {
+                    return p;
+                }
+            }
+            cl::Program::Sources sources;
+            sources.push_back({kernel_src.c_str(), kernel_src.length()});
+            cl::Program p(ocl_ctx.context, sources);
+            if (p.build(ocl_ctx.devices) != CL_SUCCESS) {
+                std::cerr << "Error building: " << p.getBuildInfo<CL_PROGRAM_BUILD_LOG>(ocl_ctx.device) << std::endl;
+                exit(1);
+            }
+            // the binaries of several devices would need an entry each
+            if (disk.enabled() && ocl_ctx.devices.size() == 1) {
+                size_t size = 0;
+                if (clGetProgramInfo(p(), CL_PROGRAM_BINARY_SIZES, sizeof(size_t), &size, nullptr) == CL_SUCCESS &&
+                    size > 0) {
+                    std::vector<uint8_t> binary(size);
+                    auto ptr = binary.data();
+                    if (clGetProgramInfo(p(), CL_PROGRAM_BINARIES, sizeof(ptr), &ptr, nullptr) == CL_SUCCESS) {
+                        disk.store(key, binary);
+                    }
+                }
+            }
+            return p;
+        }
+
+        // declared last, so it is drained before anything its builds use goes away
+        TaskPool compile_pool{nagisa_compile_threads()};
+        // the entry of the kernel, whose build is started if there is none. With cache_mutex held
+        CacheEntry &entry(const Kernel &k) {
+            auto it = kernel_cache.find(k.hash);
+            if (it != kernel_cache.end()) {
+                return it->second;
+            }
+            auto task = std::make_shared<std::packaged_task<cl::Program()>>([this, k] {
+                std::string kernel_src;
+                {
+                    ScopedPhase phase(Phase::Codegen, "kernel source");
+                    kernel_src = kernel_source(k);
+                }
+                return build(kernel_src);
+            });
+            auto &e = kernel_cache[k.hash];
+            e.program = task->get_future().share();
+            compile_pool.submit([task] { (*task)(); });
+            return e;
+        }
+
+      public:
+        bool init() {
+            if (!ocl_ctx.init()) {
+                return false;
+            }
+            device_identity = ocl_ctx.platform.getInfo<CL_PLATFORM_NAME>() + "\n" +
+                              ocl_ctx.platform.getInfo<CL_PLATFORM_VERSION>() + "\n" +
+                              ocl_ctx.device.getInfo<CL_DEVICE_NAME>() + "\n" +
+                              ocl_ctx.device.getInfo<CL_DEVICE_VERSION>() + "\n" +
+                              ocl_ctx.device.getInfo<CL_DRIVER_VERSION>();
+            for (auto &device : ocl_ctx.devices) {
+                while (group_size > 1 && group_size > device.getInfo<CL_DEVICE_MAX_WORK_GROUP_SIZE>()) {
+                    group_size /= 2;
+                }
+                shard_weights.push_back(device.getInfo<CL_DEVICE_MAX_COMPUTE_UNITS>());
+            }
+            return true;
+        }
+        const char *name() const override { return "opencl"; }
+        void prepare(const Kernel &k) override {
+            std::lock_guard<std::mutex> lock(cache_mutex);
+            entry(k);
+        }
+        std::unique_ptr<CommandStream> create_stream() override {
+            auto stream = std::make_unique<OCLStream>();
+            for (auto &device : ocl_ctx.devices) {
+                stream->shard_queues.emplace_back(ocl_ctx.context, device, ocl_ctx.props);
+            }
+            stream->queue = stream->shard_queues[0];
+            return stream;
+        }
+        std::unique_ptr<DeviceBuffer> alloc(size_t bytes, Type type) override {
+            return std::make_unique<OCLBuffer>(&ocl_ctx, type, bytes);
+        }
+        std::unique_ptr<DeviceBuffer> wrap_host(void *p, size_t bytes, Type type) override {
+            return std::make_unique<OCLBuffer>(&ocl_ctx, type, p, bytes);
+        }
+        std::string kernel_source(const Kernel &k) const override {
+            auto &buffers = k.buffers;
+            std::ostringstream kernel;
+            bool fp64 = std::count(k.local_types.begin(), k.local_types.end(), Type::f64) > 0;
+            for (auto &s : k.stmts) {
+                if ((nagisa_is_reduction(s) || (nagisa_is_store(s) && s.inst.op == ScatterAdd)) &&
+                    get_typesize(nagisa_is_reduction(s) ? s.type : buffers[s.buffer].second) == 8) {
+                    std::cerr << "the OpenCL backend has no 64-bit atomics for reductions and scatter_add"
+                              << std::endl;
+                    exit(1);
+                }
+            }
+            for (auto &b : buffers) {
+                fp64 = fp64 || b.second == Type::f64;
+            }
+            if (fp64) {
+                kernel << "#pragma OPENCL EXTENSION cl_khr_fp64 : enable\n";
+            }
+            kernel << atomic_prelude;
+            kernel << "__kernel void main(";
+            for (size_t i = 0; i < buffers.size(); i++) {
+                kernel << "__global " << buffer_type_str(buffers[i].second) << " * buffer" << i;
+                if (i != buffers.size() - 1 || !k.params.empty()) {
+                    kernel << ", ";
+                }
+            }
+            for (size_t i = 0; i < k.params.size(); i++) {
+                kernel << param_type_str(k.params[i].type) << " p" << i;
+                if (i != k.params.size() - 1) {
+                    kernel << ", ";
+                }
+            }
+            if (!nagisa_has_reduction(k)) {
+                kernel << "){\n";
+                kernel << nagisa_emit_scalar_body(k, "get_global_id(0)");
+                kernel << "}";
+                return kernel.str();
+            }
+            /*
+            The range is padded to whole work-groups, threads past n only contribute the identity.
+            Each group folds its running values in local memory and adds one atomic per reduction
+            */
+            kernel << (buffers.empty() && k.params.empty() ? "" : ", ") << "ulong n){\n";
+            kernel << nagisa_emit_reduction_init(k);
+            for (auto &s : k.stmts) {
+                if (nagisa_is_reduction(s)) {
+                    kernel << "__local " << type_to_str(s.type) << " l" << s.var << "[" << group_size << "];\n";
+                }
+            }
+            kernel << "if (get_global_id(0) < n) {\n";
+            kernel << nagisa_emit_scalar_body(k, "get_global_id(0)");
+            kernel << "}\nint lid = get_local_id(0);\n";
+            std::ostringstream fold, combine;
+            for (auto &s : k.stmts) {
+                if (!nagisa_is_reduction(s)) {
+                    continue;
+                }
+                auto l = "l" + std::to_string(s.var);
+                kernel << l << "[lid] = r" << s.var << ";\n";
+                fold << l << "[lid] = " << nagisa_reduction_combine(s.inst.op, l + "[lid]", l + "[lid + s]") << ";\n";
+                combine << "atomic_" << nagisa_reduction_name(s.inst.op) << "_" << nagisa_type_suffix(s.type)
+                        << "(buffer" << s.buffer << ", " << l << "[0]);\n";
+            }
+            kernel << "barrier(CLK_LOCAL_MEM_FENCE);\n";
+            kernel << "for (int s = " << group_size / 2 << "; s > 0; s >>= 1) {\n";
+            kernel << "if (lid < s) {\n" << fold.str() << "}\n";
+            kernel << "barrier(CLK_LOCAL_MEM_FENCE);\n}\n";
+            kernel << "if (lid == 0) {\n" << combine.str() << "}\n}";
+            return kernel.str();
+        }
+        void launch(CommandStream *stream, const Kernel &k, const std::vector<DeviceBuffer *> &buffers) override {
+            auto &queue = static_cast<OCLStream *>(stream)->queue;
+            std::shared_future<cl::Program> built;
+            {
+                std::lock_guard<std::mutex> lock(cache_mutex);
+                auto &e = entry(k);
+                if (e.launched) {
+                    nagisa_disk_cache().record_memory_hit();
+                    nagisa_count(Counter::CacheHits);
+                } else {
+                    nagisa_count(Counter::CacheMisses);
+                    e.launched = true;
+                }
+                built = e.program;
+            }
+            // only this build is waited for, the kernels prepared after it keep building meanwhile
+            auto program = built.get();
+            ScopedPhase phase(Phase::Launch, "launch", k.size);
+            nagisa_count(Counter::Launches);
+
+            // a kernel object per launch, setArg is the one call that isn't thread-safe
+            cl::Kernel kernel(program, "main");
+            for (size_t i = 0; i < buffers.size(); i++) {
+                kernel.setArg((cl_uint)i, buffers[i]->get());
+            }
+            for (size_t i = 0; i < k.params.size(); i++) {
+                kernel.setArg((cl_uint)(buffers.size() + i), param_size(k.params[i].type), &k.params[i].bits);
+            }
+            auto global = cl::NDRange(k.size), local = cl::NullRange;
+            if (nagisa_has_reduction(k)) {
+                cl_ulong n = k.size;
+                kernel.setArg((cl_uint)(buffers.size() + k.params.size()), sizeof(n), &n);
+                global = cl::NDRange((k.size + group_size - 1) / group_size * group_size);
+                local = cl::NDRange(group_size);
+            }
+            auto writes = nagisa_buffer_writes(k);
+            std::vector<cl::Event> deps;
+            for (size_t i = 0; i < buffers.size(); i++) {
+                static_cast<OCLBuffer *>(buffers[i])->dependencies(writes[i], deps);
+            }
+            auto &shard_queues = static_cast<OCLStream *>(stream)->shard_queues;
+            // a Write only stores the element of its own lane, so the lanes can be split over the devices. Atomics and
+            // scatters can't, devices don't see the memory operations of each other until the kernels are done. Nor can
+            // a buffer the kernel also reads, the other devices only write a copy of it
+            bool sharded = shard_queues.size() > 1 && k.size >= shard_queues.size() * min_shard_size &&
+                           std::all_of(k.stmts.begin(), k.stmts.end(), [&](const KernelStmt &s) {
+                               return nagisa_writes_buffer(s) ? s.kind == StmtKind::Write
+                                                              : s.buffer < 0 || !writes[s.buffer];
+                           });
+            cl::Event event;
+            if (!sharded) {
+                queue.enqueueNDRangeKernel(kernel, cl::NDRange(0), global, local, &deps, &event);
+                // start the device now rather than at the next blocking call
+                queue.flush();
+                time_command(event, "kernel", k.size);
+            } else {
+                /*
+                Slices in proportion to the compute units, through the global offset so that get_global_id(0) stays
+                the lane. Devices writing one cl::Buffer at once is undefined even for disjoint ranges, so only the
+                first shard, on the device of queue, writes the buffers in place. The others write scratch buffers
+                of their own, whose slices queue copies back. The marker waits for the first slice and the copies
+                */
+                auto total = std::accumulate(shard_weights.begin(), shard_weights.end(), size_t(0));
+                std::vector<cl::Event> joined;
+                size_t begin = 0;
+                for (size_t i = 0; i < shard_queues.size() && begin < k.size; i++) {
+                    auto end = i + 1 == shard_queues.size() ? k.size
+                                                            : std::min(k.size, begin + k.size * shard_weights[i] / total);
+                    if (end == begin) {
+                        continue;
+                    }
+                    // released by the runtime once the commands using them are done
+                    std::vector<std::pair<size_t, cl::Buffer>> scratch;
+                    for (size_t j = 0; i > 0 && j < buffers.size(); j++) {
+                        if (writes[j]) {
+                            scratch.emplace_back(j, cl::Buffer(ocl_ctx.context, CL_MEM_READ_WRITE,
+                                                               static_cast<OCLBuffer *>(buffers[j])->size()));
+                        }
+                    }
+                    // arguments are captured at enqueue, the next shard may set them again
+                    for (size_t j = 0; j < buffers.size(); j++) {
+                        kernel.setArg((cl_uint)j, buffers[j]->get());
+                    }
+                    for (auto &[j, b] : scratch) {
+                        kernel.setArg((cl_uint)j, b);
+                    }
+                    cl::Event slice;
+                    shard_queues[i].enqueueNDRangeKernel(kernel, cl::NDRange(begin), cl::NDRange(end - begin), local,
+                                                         &deps, &slice);
+                    shard_queues[i].flush();
+                    time_command(slice, "kernel shard", end - begin);
+                    if (scratch.empty()) {
+                        joined.push_back(slice);
+                    }
+                    for (auto &[j, b] : scratch) {
+                        auto lane = get_typesize(k.buffers[j].second);
+                        // after the writes of queue so far as well, the first slice writes the same buffers
+                        auto wait = joined;
+                        wait.push_back(slice);
+                        cl::Event copy;
+                        queue.enqueueCopyBuffer(b, static_cast<OCLBuffer *>(buffers[j])->cl_buffer(), begin * lane,
+                                                begin * lane, (end - begin) * lane, &wait, &copy);
+                        time_command(copy, "shard copy", (end - begin) * lane);
+                        nagisa_count(Counter::BytesCopied, (end - begin) * lane);
+                        joined.push_back(copy);
+                    }
+                    begin = end;
+                }
+                queue.enqueueMarkerWithWaitList(&joined, &event);
+                queue.flush();
+            }
+            for (size_t i = 0; i < buffers.size(); i++) {
+                static_cast<OCLBuffer *>(buffers[i])->record(writes[i], event);
+            }
+        }
+        void copy(CommandStream *stream, DeviceBuffer *dst, size_t dst_offset, DeviceBuffer *src, size_t src_offset,
+                  size_t bytes) override {
+            auto &queue = static_cast<OCLStream *>(stream)->queue;
+            auto event = static_cast<OCLBuffer *>(dst)->copy_from(queue, static_cast<OCLBuffer *>(src), src_offset,
+                                                                  dst_offset, bytes);
+            queue.flush();
+            time_command(event, "copy", bytes);
+        }
+        void prefix_sum(CommandStream *stream, DeviceBuffer *dst, DeviceBuffer *src, size_t n,
+                        bool exclusive) override {
+            auto &queue = static_cast<OCLStream *>(stream)->queue;
+            auto d = static_cast<OCLBuffer *>(dst), s = static_cast<OCLBuffer *>(src);
+            NGS_ASSERT(s->type != Type::boolean && s->type != Type::f16);
+            cl::Program program;
+            {
+                std::lock_guard<std::mutex> lock(cache_mutex);
+                auto it = scan_programs.find((int)s->type);
+                if (it == scan_programs.end()) {
+                    std::ostringstream src_code;
+                    if (s->type == Type::f64) {
+                        src_code << "#pragma OPENCL EXTENSION cl_khr_fp64 : enable\n";
+                    }
+                    src_code << "#define T " << type_to_str(s->type) << "\n#define G " << group_size << "\n"
+                             << scan_source;
+                    it = scan_programs.emplace((int)s->type, build(src_code.str())).first;
+                }
+                program = it->second;
+            }
+            // at most one group sum per thread of the middle launch
+            int groups = (int)std::max<size_t>(1, std::min(group_size, (n + group_size - 1) / group_size));
+            int chunk = (int)((n + groups - 1) / groups), count = (int)n, excl = exclusive;
+            cl::Buffer sums(ocl_ctx.context, CL_MEM_READ_WRITE, groups * get_typesize(s->type));
+            cl::Kernel reduce(program, "scan_reduce"), scan_sums(program, "scan_sums"), apply(program, "scan_apply");
+            reduce.setArg(0, s->get());
+            reduce.setArg(1, sums());
+            reduce.setArg(2, sizeof(int), &count);
+            reduce.setArg(3, sizeof(int), &chunk);
+            scan_sums.setArg(0, sums());
+            scan_sums.setArg(1, sizeof(int), &groups);
+            apply.setArg(0, s->get());
+            apply.setArg(1, d->get());
+            apply.setArg(2, sums());
+            apply.setArg(3, sizeof(int), &count);
+            apply.setArg(4, sizeof(int), &chunk);
+            apply.setArg(5, sizeof(int), &excl);
+            std::vector<cl::Event> deps;
+            s->dependencies(false, deps);
+            cl::Event reduced, scanned, applied;
+            auto global = cl::NDRange(groups * group_size), local = cl::NDRange(group_size);
+            queue.enqueueNDRangeKernel(reduce, cl::NDRange(0), global, local, &deps, &reduced);
+            std::vector<cl::Event> after_reduce{reduced};
+            queue.enqueueNDRangeKernel(scan_sums, cl::NDRange(0), local, local, &after_reduce, &scanned);
+            deps = {scanned};
+            d->dependencies(true, deps);
+            queue.enqueueNDRangeKernel(apply, cl::NDRange(0), global, local, &deps, &applied);
+            s->record(false, applied);
+            d->record(true, applied);
+            queue.flush();
+        }
+        void synchronize(CommandStream *stream) override {
+            for (auto &queue : static_cast<OCLStream *>(stream)->shard_queues) {
+                queue.finish();
+            }
+            // the timings of other streams that are done already are collected too
+            std::lock_guard<std::mutex> lock(timings_mutex);
+            collect_timings(false);
+        }
+    };
+    std::unique_ptr<Backend> nagisa_create_opencl_backend() {
+        auto backend = std::make_unique<OCLBackend>();
+        if (!backend->init()) {
+            return nullptr;
+        }
+        return backend;
+    }
+} // namespace nagisa
+#else
+#include "backend.h"
+namespace nagisa {
+    void nagisa_set_opencl_device(const OpenCLDevice &) {}
+    std::vector<std::string> nagisa_opencl_devices() { return {}; }
+    std::unique_ptr<Backend> nagisa_create_opencl_backend() { return nullptr; }
+} // namespace nagisa
+#endif
@@ -0,0 +1,416 @@
+// MIT License
+//
+// Copyright (c) 2020 椎名深雪
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+#include "passes.h"
+#include <climits>
+#include <cmath>
+#include <cstring>
+#include <limits>
+namespace nagisa {
+    int nagisa_arity(Opcode op) {
+        switch (op) {
+        case ConstantInt:
+        case ConstantFloat:
+        case Input:
+        case Argument:
+        case Loop:
+        case If:
+            return 0;
+        case Sin:
+        case Cos:
+        case Sqrt:
+        case Neg:
+        case Cast:
+        case ReduceAdd:
+        case ReduceMax:
+        case ReduceMin:
+        case Phi:
+        case RegionOut:
+            return 1;
+        case Select:
+        case Load:
+        case Store:
+        case ScatterAdd:
+            return 3;
+        default:
+            return 2;
+        }
+    }
+    int nagisa_op_cost(Opcode op) {
+        switch (op) {
+        case ConstantInt:
+        case ConstantFloat:
+        case Input:
+        case Argument:
+        case Phi:
+        case RegionOut:
+            return 0;
+        case FDiv:
+        case Mod:
+        case Sqrt:
+            return 4;
+        // a random access, which likely misses the cache
+        case Load:
+            return 16;
+        case Sin:
+        case Cos:
+            return 20;
+        default:
+            return 1;
+        }
+    }
+    static bool is_commutative(Opcode op) { return op == FAdd || op == FMul || op == CmpEq || op == CmpNe; }
+    std::optional<InstKey> nagisa_inst_key(const Instruction &inst, Type type, size_t size) {
+        InstKey key{inst.op, type, -1, -1, -1, size};
+        if (inst.op == ConstantInt || inst.op == ConstantFloat) {
+            // every opaque constant has to stay its own kernel argument
+            if (inst.opaque) {
+                return std::nullopt;
+            }
+            if (inst.op == ConstantInt) {
+                key.a = inst.ival;
+            } else {
+                std::memcpy(&key.a, &inst.fval, sizeof(double));
+            }
+            return key;
+        }
+        if (inst.op == Load || nagisa_is_store(inst.op) || nagisa_is_reduction(inst.op) || inst.op == Input ||
+            inst.op == Argument || nagisa_is_control(inst.op)) {
+            return std::nullopt;
+        }
+        auto n = nagisa_arity(inst.op);
+        int64_t *slots[3] = {&key.a, &key.b, &key.c};
+        for (int i = 0; i < n; i++) {
+            *slots[i] = inst.operand[i];
+        }
+        if (is_commutative(inst.op) && key.a > key.b) {
+            std::swap(key.a, key.b);
+        }
+        return key;
+    }
+
+    static bool is_const(const Value *v) {
+        return v && (v->inst.op == ConstantInt || v->inst.op == ConstantFloat) && !v->inst.opaque;
+    }
+    static double const_value(const Value *v) {
+        if (v->inst.op == ConstantFloat) {
+            return v->inst.fval;
+        }
+        return v->type == Type::u64 ? (double)(uint64_t)v->inst.ival : (double)v->inst.ival;
+    }
+    static bool is_const_equal(const Value *v, double x) { return is_const(v) && const_value(v) == x; }
+    static bool is_int(Type type) {
+        return type == Type::i32 || type == Type::u32 || type == Type::i64 || type == Type::u64;
+    }
+    static bool is_signed(Type type) { return type == Type::i32 || type == Type::i64; }
+    // x modulo the width of an integer type, as its ival
+    static Instruction make_int(Type type, uint64_t x) {
+        switch (type) {
+        case Type::i32:
+            return Instruction::const_int((int32_t)(uint32_t)x);
+        case Type::u32:
+            return Instruction::const_int((uint32_t)x);
+        default:
+            return Instruction::const_int((int64_t)x);
+        }
+    }
+    static Instruction make_const(Type type, double x) {
+        if (nagisa_is_float(type)) {
+            // f16 values are computed in single precision
+            return Instruction::const_float(type == Type::f64 ? x : (float)x);
+        }
+        if (type == Type::boolean) {
+            return Instruction::const_int(x != 0);
+        }
+        return type == Type::u64 ? make_int(type, (uint64_t)x) : make_int(type, (uint64_t)(int64_t)x);
+    }
+    static std::optional<Instruction> fold_cast(Type type, const Value *a) {
+        if (nagisa_is_float(type) || type == Type::boolean || !nagisa_is_float(a->type)) {
+            if (is_int(type) && a->inst.op == ConstantInt) {
+                return make_int(type, (uint64_t)a->inst.ival);
+            }
+            return make_const(type, const_value(a));
+        }
+        // float to integer is undefined out of range, leave it to the device
+        double x = const_value(a), lo = 0, hi = 0;
+        nagisa_dispatch_type(type, [&](auto v) {
+            using T = decltype(v);
+            lo = (double)std::numeric_limits<T>::lowest() - 1;
+            hi = (double)std::numeric_limits<T>::max() + 1;
+        });
+        if (!(x > lo && x < hi)) {
+            return std::nullopt;
+        }
+        return is_signed(type) ? make_int(type, (uint64_t)(int64_t)x) : make_int(type, (uint64_t)x);
+    }
+    static std::optional<Instruction> fold(const Instruction &inst, Type type,
+                                           const std::array<const Value *, 3> &operands) {
+        auto n = nagisa_arity(inst.op);
+        if (n == 0 || inst.op == Load || inst.op == Select || nagisa_is_store(inst.op) ||
+            nagisa_is_reduction(inst.op) || nagisa_is_control(inst.op)) {
+            return std::nullopt;
+        }
+        for (int i = 0; i < n; i++) {
+            if (!is_const(operands[i])) {
+                return std::nullopt;
+            }
+        }
+        auto op = inst.op;
+        auto a = operands[0], b = operands[1];
+        if (op == Cast) {
+            return fold_cast(type, a);
+        }
+        if (op >= CmpLt && op <= CmpNe) {
+            bool r;
+            auto compare = [&](auto x, auto y) {
+                r = op == CmpLt ? x < y : op == CmpLe ? x <= y : op == CmpGe ? x >= y : op == CmpGt ? x > y
+                                                                                       : op == CmpEq ? x == y
+                                                                                                     : x != y;
+            };
+            if (nagisa_is_float(a->type) || nagisa_is_float(b->type) || a->inst.op == ConstantFloat ||
+                b->inst.op == ConstantFloat) {
+                double x = const_value(a), y = const_value(b);
+                if (a->type == Type::f32 || b->type == Type::f32) {
+                    x = (float)x;
+                    y = (float)y;
+                }
+                compare(x, y);
+            } else if (a->type == Type::u64 || b->type == Type::u64) {
+                compare((uint64_t)a->inst.ival, (uint64_t)b->inst.ival);
+            } else {
+                compare(a->inst.ival, b->inst.ival);
+            }
+            return make_const(type, r);
+        }
+        if (type == Type::f32 || type == Type::f16) {
+            // evaluate in single precision, as the kernel would
+            float x = (float)const_value(a), y = n > 1 ? (float)const_value(b) : 0.0f;
+            switch (op) {
+            case FAdd:
+                return make_const(type, x + y);
+            case FSub:
+                return make_const(type, x - y);
+            case FMul:
+                return make_const(type, x * y);
+            case FDiv:
+                return make_const(type, x / y);
+            case Mod:
+                return make_const(type, std::fmod(x, y));
+            case Sin:
+                return make_const(type, std::sin(x));
+            case Cos:
+                return make_const(type, std::cos(x));
+            case Sqrt:
+                return make_const(type, std::sqrt(x));
+            case Neg:
+                return make_const(type, -x);
+            default:
+                return std::nullopt;
+            }
+        }
+        if (type == Type::f64) {
+            double x = const_value(a), y = n > 1 ? const_value(b) : 0.0;
+            switch (op) {
+            case FAdd:
+                return make_const(type, x + y);
+            case FSub:
+                return make_const(type, x - y);
+            case FMul:
+                return make_const(type, x * y);
+            case FDiv:
+                return make_const(type, x / y);
+            case Mod:
+                return make_const(type, std::fmod(x, y));
+            case Sin:
+                return make_const(type, std::sin(x));
+            case Cos:
+                return make_const(type, std::cos(x));
+            case Sqrt:
+                return make_const(type, std::sqrt(x));
+            case Neg:
+                return make_const(type, -x);
+            default:
+                return std::nullopt;
+            }
+        }
+        if (!is_int(type) || a->inst.op != ConstantInt || (n > 1 && b->inst.op != ConstantInt)) {
+            return std::nullopt;
+        }
+        // two's complement arithmetic wraps the same in any width
+        uint64_t x = a->inst.ival, y = n > 1 ? b->inst.ival : 0;
+        switch (op) {
+        case FAdd:
+            return make_int(type, x + y);
+        case FSub:
+            return make_int(type, x - y);
+        case FMul:
+            return make_int(type, x * y);
+        case FDiv:
+        case Mod: {
+            // leave traps to the device
+            if (y == 0) {
+                return std::nullopt;
+            }
+            if (!is_signed(type)) {
+                return make_int(type, op == FDiv ? x / y : x % y);
+            }
+            int64_t sx = (int64_t)x, sy = (int64_t)y;
+            int64_t min = type == Type::i32 ? INT_MIN : std::numeric_limits<int64_t>::min();
+            if (sx == min && sy == -1) {
+                return std::nullopt;
+            }
+            return make_int(type, (uint64_t)(op == FDiv ? sx / sy : sx % sy));
+        }
+        case Neg:
+            return make_int(type, 0 - x);
+        default:
+            return std::nullopt;
+        }
+    }
+    Simplified nagisa_simplify(const Instruction &inst, Type type, const std::array<const Value *, 3> &operands) {
+        Simplified result;
+        if ((result.constant = fold(inst, type, operands))) {
+            return result;
+        }
+        auto a = operands[0], b = operands[1], c = operands[2];
+        // an operand can only stand in for the result if no conversion is implied
+        auto forward = [&](const Value *v) {
+            if (v && v->type == type && v->idx >= (int)Predefined::Total) {
+                result.forward = v->idx;
+            }
+            return result;
+        };
+        switch (inst.op) {
+        case FAdd:
+            if (is_const_equal(b, 0)) {
+                return forward(a);
+            }
+            if (is_const_equal(a, 0)) {
+                return forward(b);
+            }
+            break;
+        case FSub:
+            if (is_const_equal(b, 0)) {
+                return forward(a);
+            }
+            if (is_int(type) && a == b) {
+                result.constant = make_const(type, 0);
+            }
+            break;
+        case FMul:
+            if (is_const_equal(b, 1)) {
+                return forward(a);
+            }
+            if (is_const_equal(a, 1)) {
+                return forward(b);
+            }
+            // x * 0 is not 0 for inf and nan
+            if (is_int(type) && (is_const_equal(a, 0) || is_const_equal(b, 0))) {
+                result.constant = make_const(type, 0);
+            }
+            break;
+        case FDiv:
+            if (is_const_equal(b, 1)) {
+                return forward(a);
+            }
+            break;
+        case Cast:
+            return forward(a);
+        case Neg:
+            // deps are dropped once a is evaluated, its operand slot may be gone by then
+            if (a && a->inst.op == Neg && a->type == type && a->inst.deps[0] >= (int)Predefined::Total) {
+                result.forward = a->inst.deps[0];
+            }
+            break;
+        case Select:
+            if (is_const(a)) {
+                return forward(const_value(a) != 0 ? b : c);
+            }
+            if (b == c) {
+                return forward(b);
+            }
+            break;
+        case CmpEq:
+        case CmpLe:
+        case CmpGe:
+            if (a == b && a && !nagisa_is_float(a->type)) {
+                result.constant = make_const(type, 1);
+            }
+            break;
+        case CmpNe:
+        case CmpLt:
+        case CmpGt:
+            if (a == b && a && !nagisa_is_float(a->type)) {
+                result.constant = make_const(type, 0);
+            }
+            break;
+        default:
+            break;
+        }
+        return result;
+    }
+
+    void nagisa_eliminate_dead_code(Kernel &kernel) {
+        std::vector<bool> used(kernel.local_types.size(), false);
+        std::vector<KernelStmt> kept;
+        // loop-carried values are used before they are assigned, so regions and their Phi values are kept whole
+        int depth = 0;
+        for (auto it = kernel.stmts.rbegin(); it != kernel.stmts.rend(); it++) {
+            auto &s = *it;
+            if (s.kind == StmtKind::RegionEnd) {
+                depth++;
+            } else if (s.kind == StmtKind::LoopBegin || s.kind == StmtKind::IfBegin) {
+                depth--;
+            }
+            bool root = nagisa_writes_buffer(s) || nagisa_is_control(s) || depth > 0 ||
+                        (s.kind == StmtKind::Compute && s.inst.op == Phi);
+            if (!root && !used[s.var]) {
+                continue;
+            }
+            if (s.var >= 0) {
+                used[s.var] = true;
+            }
+            if (s.kind == StmtKind::LoopCond || s.kind == StmtKind::IfBegin || s.kind == StmtKind::PhiUpdate) {
+                used[s.inst.operand[0]] = true;
+            } else if (s.kind == StmtKind::Compute) {
+                // operand 0 of a Load names the buffer, not a value
+                for (int k = s.inst.op == Load ? 1 : 0; k < nagisa_arity(s.inst.op); k++) {
+                    used[s.inst.operand[k]] = true;
+                }
+            }
+            kept.push_back(s);
+        }
+        kernel.stmts.assign(kept.rbegin(), kept.rend());
+        // the ThreadIdx statements of a tiled kernel share the param of its offset
+        std::vector<KernelParam> params;
+        std::vector<int> renamed(kernel.params.size(), -1);
+        for (auto &s : kernel.stmts) {
+            if ((s.kind == StmtKind::Param || s.kind == StmtKind::ThreadIdx) && s.param >= 0) {
+                if (renamed[s.param] == -1) {
+                    renamed[s.param] = (int)params.size();
+                    params.push_back(kernel.params[s.param]);
+                }
+                s.param = renamed[s.param];
+            }
+        }
+        kernel.params = std::move(params);
+    }
+} // namespace nagisa
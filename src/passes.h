@@ -0,0 +1,48 @@
+// MIT License
+//
+// Copyright (c) 2020 椎名深雪
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#pragma once
+#include "context.h"
+#include <optional>
+namespace nagisa {
+    // number of value operands read by an instruction
+    int nagisa_arity(Opcode op);
+    // rough cost of one lane of an instruction in simple ALU ops, weighed against memory traffic by nagisa_eval
+    int nagisa_op_cost(Opcode op);
+
+    // key used to hash-cons `inst` over `size` lanes, nullopt if it must never be merged with an equal instruction
+    std::optional<InstKey> nagisa_inst_key(const Instruction &inst, Type type, size_t size);
+
+    /*
+    Result of simplifying an instruction against the definitions of its operands:
+    either a constant to append instead, or the index of an existing value equal to it. A predefined var is
+    never forwarded to, it has no buffer to be evaluated into
+    */
+    struct Simplified {
+        std::optional<Instruction> constant;
+        int forward = -1;
+    };
+    Simplified nagisa_simplify(const Instruction &inst, Type type, const std::array<const Value *, 3> &operands);
+
+    // drops statements whose value is never written or stored, and compacts the params they used
+    void nagisa_eliminate_dead_code(Kernel &kernel);
+} // namespace nagisa
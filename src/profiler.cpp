@@ -0,0 +1,206 @@
+// MIT License
+//
+// Copyright (c) 2020 椎名深雪
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+#include "profiler.h"
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <vector>
+namespace nagisa {
+    std::atomic<bool> nagisa_profiling_enabled{false};
+    std::atomic<bool> nagisa_dump_kernels_enabled{false};
+    std::atomic<bool> nagisa_log_enabled{false};
+    namespace {
+        const char *phase_names[] = {"schedule", "codegen", "compile", "launch", "readback", "device"};
+        struct TraceEvent {
+            std::string name;
+            Phase phase;
+            double begin, end;
+            // 0 is the device track, host threads are numbered from 1
+            int tid;
+            size_t size;
+        };
+        struct Profiler {
+            std::array<std::atomic<size_t>, (size_t)Counter::Total> counters{};
+            std::mutex mutex;
+            // the rest is guarded by mutex
+            std::array<double, (size_t)Phase::Total> times{};
+            bool tracing = false;
+            std::vector<TraceEvent> events;
+            std::vector<int> threads;
+            std::string trace_path;
+        };
+        Profiler &profiler() {
+            static Profiler p;
+            return p;
+        }
+        int thread_id() {
+            static std::atomic<int> next{1};
+            thread_local int id = next++;
+            return id;
+        }
+        void write_escaped(std::ostream &out, const std::string &s) {
+            out << '"';
+            for (auto c : s) {
+                if (c == '"' || c == '\\') {
+                    out << '\\';
+                }
+                out << c;
+            }
+            out << '"';
+        }
+    } // namespace
+    void nagisa_count_enabled(Counter c, size_t n) {
+        profiler().counters[(size_t)c].fetch_add(n, std::memory_order_relaxed);
+    }
+    double nagisa_now_us() {
+        auto t = std::chrono::steady_clock::now().time_since_epoch();
+        return std::chrono::duration<double, std::micro>(t).count();
+    }
+    void nagisa_record_phase(Phase phase, const std::string &name, double begin, double end, size_t size) {
+        auto &p = profiler();
+        int tid = phase == Phase::Device ? 0 : thread_id();
+        std::lock_guard<std::mutex> lock(p.mutex);
+        p.times[(size_t)phase] += end - begin;
+        if (!p.tracing) {
+            return;
+        }
+        p.events.push_back({name, phase, begin, end, tid, size});
+        if (std::find(p.threads.begin(), p.threads.end(), tid) == p.threads.end()) {
+            p.threads.push_back(tid);
+        }
+    }
+    void nagisa_set_profiling(bool enable) { nagisa_profiling_enabled = enable; }
+    void nagisa_set_dump_kernels(bool enable) { nagisa_dump_kernels_enabled = enable; }
+    void nagisa_set_log(bool enable) { nagisa_log_enabled = enable; }
+    ProfileStats nagisa_profile_stats() {
+        auto &p = profiler();
+        auto count = [&](Counter c) { return p.counters[(size_t)c].load(std::memory_order_relaxed); };
+        ProfileStats s;
+        s.trace_nodes = count(Counter::TraceNodes);
+        s.kernels_generated = count(Counter::KernelsGenerated);
+        s.kernel_cache_hits = count(Counter::CacheHits);
+        s.kernel_cache_misses = count(Counter::CacheMisses);
+        s.launches = count(Counter::Launches);
+        s.bytes_allocated = count(Counter::BytesAllocated);
+        s.bytes_uploaded = count(Counter::BytesUploaded);
+        s.bytes_downloaded = count(Counter::BytesDownloaded);
+        s.bytes_copied = count(Counter::BytesCopied);
+        std::lock_guard<std::mutex> lock(p.mutex);
+        auto seconds = [&](Phase phase) { return p.times[(size_t)phase] * 1e-6; };
+        s.schedule_time = seconds(Phase::Schedule);
+        s.codegen_time = seconds(Phase::Codegen);
+        s.compile_time = seconds(Phase::Compile);
+        s.launch_time = seconds(Phase::Launch);
+        s.readback_time = seconds(Phase::Readback);
+        s.device_time = seconds(Phase::Device);
+        return s;
+    }
+    void nagisa_reset_profile() {
+        auto &p = profiler();
+        for (auto &c : p.counters) {
+            c = 0;
+        }
+        std::lock_guard<std::mutex> lock(p.mutex);
+        p.times.fill(0);
+    }
+    void nagisa_start_trace() {
+        auto &p = profiler();
+        {
+            std::lock_guard<std::mutex> lock(p.mutex);
+            p.tracing = true;
+        }
+        nagisa_set_profiling(true);
+    }
+    void nagisa_write_trace(const char *path) {
+        auto &p = profiler();
+        std::lock_guard<std::mutex> lock(p.mutex);
+        std::ofstream out(path);
+        if (!out) {
+            std::cerr << "can't write trace " << path << std::endl;
+            return;
+        }
+        // complete events, timestamps in microseconds relative to the first one
+        double origin = p.events.empty() ? 0 : p.events.front().begin;
+        for (auto &e : p.events) {
+            origin = std::min(origin, e.begin);
+        }
+        out << "{\"traceEvents\":[\n";
+        for (auto tid : p.threads) {
+            out << "{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":1,\"tid\":" << tid << ",\"args\":{\"name\":\""
+                << (tid == 0 ? "device" : "host " + std::to_string(tid)) << "\"}},\n";
+        }
+        for (size_t i = 0; i < p.events.size(); i++) {
+            auto &e = p.events[i];
+            out << "{\"ph\":\"X\",\"name\":";
+            write_escaped(out, e.name);
+            out << ",\"cat\":\"" << phase_names[(size_t)e.phase] << "\",\"pid\":1,\"tid\":" << e.tid
+                << ",\"ts\":" << e.begin - origin << ",\"dur\":" << e.end - e.begin;
+            if (e.size != 0) {
+                out << ",\"args\":{\"size\":" << e.size << "}";
+            }
+            out << (i + 1 < p.events.size() ? "},\n" : "}\n");
+        }
+        out << "],\"displayTimeUnit\":\"ms\"}\n";
+        p.events.clear();
+        p.threads.clear();
+        p.tracing = false;
+    }
+    void nagisa_profiler_init() {
+        auto flag = [](const char *name) {
+            auto env = std::getenv(name);
+            return env && std::strcmp(env, "0") != 0;
+        };
+        if (flag("NAGISA_PROFILE")) {
+            nagisa_set_profiling(true);
+        }
+        if (flag("NAGISA_DUMP_KERNELS")) {
+            nagisa_set_dump_kernels(true);
+        }
+        if (flag("NAGISA_LOG")) {
+            nagisa_set_log(true);
+        }
+        if (auto env = std::getenv("NAGISA_TRACE")) {
+            // programs that never call nagisa_destroy still get their trace
+            static bool registered = std::atexit(nagisa_profiler_destroy) == 0;
+            (void)registered;
+            profiler().trace_path = env;
+            nagisa_start_trace();
+        }
+    }
+    void nagisa_profiler_destroy() {
+        auto &p = profiler();
+        if (!p.trace_path.empty()) {
+            nagisa_write_trace(p.trace_path.c_str());
+            p.trace_path.clear();
+        }
+    }
+    void nagisa_dump_kernel(const std::string &src) {
+        if (nagisa_dump_kernels_enabled.load(std::memory_order_relaxed)) {
+            std::cerr << "kernel:\n" << src << std::endl;
+        }
+    }
+} // namespace nagisa
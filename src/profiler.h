@@ -0,0 +1,92 @@
+// MIT License
+//
+// Copyright (c) 2020 椎名深雪
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#pragma once
+#include <nagisa/nagisa.hpp>
+#include <atomic>
+#include <string>
+namespace nagisa {
+    /*
+    Probes of the runtime, see nagisa_set_profiling. The state is global rather than per Context so it can be
+    enabled before nagisa_init, and probes may fire on the worker threads of the backends
+    */
+    enum class Counter {
+        TraceNodes,
+        KernelsGenerated,
+        CacheHits,
+        CacheMisses,
+        Launches,
+        BytesAllocated,
+        BytesUploaded,
+        BytesDownloaded,
+        BytesCopied,
+        Total
+    };
+    enum class Phase { Schedule, Codegen, Compile, Launch, Readback, Device, Total };
+    extern std::atomic<bool> nagisa_profiling_enabled;
+    extern std::atomic<bool> nagisa_dump_kernels_enabled;
+    extern std::atomic<bool> nagisa_log_enabled;
+    // whether to print the backend and device choices to stderr, see nagisa_set_log
+    inline bool nagisa_logging() { return nagisa_log_enabled.load(std::memory_order_relaxed); }
+    inline bool nagisa_profiling() { return nagisa_profiling_enabled.load(std::memory_order_relaxed); }
+    void nagisa_count_enabled(Counter c, size_t n);
+    inline void nagisa_count(Counter c, size_t n = 1) {
+        if (nagisa_profiling()) {
+            nagisa_count_enabled(c, n);
+        }
+    }
+    // microseconds on the steady clock
+    double nagisa_now_us();
+    /*
+    Adds [begin, end) to the total of the phase and, while tracing, to the trace under `name`. Device
+    intervals go to a track of their own, `size` is shown as an argument of the event unless 0
+    */
+    void nagisa_record_phase(Phase phase, const std::string &name, double begin, double end, size_t size = 0);
+    // times its scope, the name is only built if profiling is enabled
+    class ScopedPhase {
+        Phase phase;
+        const char *name;
+        size_t size;
+        double begin = -1;
+
+      public:
+        ScopedPhase(Phase phase, const char *name, size_t size = 0) : phase(phase), name(name), size(size) {
+            if (nagisa_profiling()) {
+                begin = nagisa_now_us();
+            }
+        }
+        ScopedPhase(const ScopedPhase &) = delete;
+        ScopedPhase &operator=(const ScopedPhase &) = delete;
+        ~ScopedPhase() {
+            if (begin >= 0) {
+                nagisa_record_phase(phase, name, begin, nagisa_now_us(), size);
+            }
+        }
+    };
+    // NAGISA_PROFILE, NAGISA_TRACE, NAGISA_DUMP_KERNELS and NAGISA_LOG, read by nagisa_init before the backend
+    // is created
+    void nagisa_profiler_init();
+    // writes the NAGISA_TRACE file, if any, also called at exit
+    void nagisa_profiler_destroy();
+    // prints a kernel the backend is about to compile, if enabled
+    void nagisa_dump_kernel(const std::string &src);
+} // namespace nagisa
@@ -0,0 +1,186 @@
+// MIT License
+//
+// Copyright (c) 2020 椎名深雪
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+#include "thread_pool.h"
+#include <algorithm>
+namespace nagisa {
+    ThreadPool::ThreadPool(size_t n_threads) {
+        n_threads = std::max<size_t>(n_threads, 1);
+        for (size_t i = 0; i + 1 < n_threads; i++) {
+            workers.emplace_back([this] { worker_loop(); });
+        }
+    }
+    ThreadPool::~ThreadPool() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stop = true;
+        }
+        cv.notify_all();
+        for (auto &w : workers) {
+            w.join();
+        }
+    }
+    void ThreadPool::run_chunks() {
+        size_t i;
+        while ((i = next_chunk.fetch_add(1)) < job_chunks) {
+            size_t begin = i * job_chunk;
+            (*job)(begin, std::min(begin + job_chunk, job_count));
+        }
+    }
+    void ThreadPool::worker_loop() {
+        uint64_t seen = 0;
+        while (true) {
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                cv.wait(lock, [&] { return stop || generation != seen; });
+                if (stop) {
+                    return;
+                }
+                seen = generation;
+            }
+            run_chunks();
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                if (--busy == 0) {
+                    done_cv.notify_one();
+                }
+            }
+        }
+    }
+    void ThreadPool::parallel_for(size_t count, size_t chunk, const std::function<void(size_t, size_t)> &f) {
+        chunk = std::max<size_t>(chunk, 1);
+        size_t n_chunks = (count + chunk - 1) / chunk;
+        if (n_chunks <= 1 || workers.empty()) {
+            if (count > 0) {
+                f(0, count);
+            }
+            return;
+        }
+        std::lock_guard<std::mutex> run(run_mutex);
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            job = &f;
+            job_count = count;
+            job_chunk = chunk;
+            job_chunks = n_chunks;
+            next_chunk = 0;
+            busy = workers.size();
+            generation++;
+        }
+        cv.notify_all();
+        run_chunks();
+        std::unique_lock<std::mutex> lock(mutex);
+        done_cv.wait(lock, [&] { return busy == 0; });
+        job = nullptr;
+    }
+    TaskQueue::TaskQueue() : worker([this] { worker_loop(); }) {}
+    TaskQueue::~TaskQueue() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stop = true;
+        }
+        cv.notify_one();
+        worker.join();
+    }
+    void TaskQueue::worker_loop() {
+        while (true) {
+            std::function<void()> task;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                cv.wait(lock, [&] { return stop || !tasks.empty(); });
+                if (tasks.empty()) {
+                    return;
+                }
+                task = std::move(tasks.front());
+                tasks.pop_front();
+            }
+            task();
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                completed.fetch_add(1, std::memory_order_release);
+            }
+            done_cv.notify_all();
+        }
+    }
+    uint64_t TaskQueue::submit(std::function<void()> f) {
+        uint64_t ticket;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            tasks.push_back(std::move(f));
+            ticket = ++submitted;
+        }
+        cv.notify_one();
+        return ticket;
+    }
+    void TaskQueue::wait(uint64_t ticket) {
+        if (done(ticket)) {
+            return;
+        }
+        std::unique_lock<std::mutex> lock(mutex);
+        done_cv.wait(lock, [&] { return done(ticket); });
+    }
+    void TaskQueue::wait_all() {
+        uint64_t ticket;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            ticket = submitted;
+        }
+        wait(ticket);
+    }
+    TaskPool::TaskPool(size_t n_threads) {
+        n_threads = std::max<size_t>(n_threads, 1);
+        for (size_t i = 0; i < n_threads; i++) {
+            workers.emplace_back([this] { worker_loop(); });
+        }
+    }
+    TaskPool::~TaskPool() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stop = true;
+        }
+        cv.notify_all();
+        for (auto &w : workers) {
+            w.join();
+        }
+    }
+    void TaskPool::worker_loop() {
+        while (true) {
+            std::function<void()> task;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                cv.wait(lock, [&] { return stop || !tasks.empty(); });
+                if (tasks.empty()) {
+                    return;
+                }
+                task = std::move(tasks.front());
+                tasks.pop_front();
+            }
+            task();
+        }
+    }
+    void TaskPool::submit(std::function<void()> f) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            tasks.push_back(std::move(f));
+        }
+        cv.notify_one();
+    }
+} // namespace nagisa
@@ -0,0 +1,103 @@
+// MIT License
+//
+// Copyright (c) 2020 椎名深雪
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+namespace nagisa {
+    /*
+    A fixed set of workers that cooperatively drain the chunks of a parallel_for.
+    The calling thread participates, so a pool of size 1 runs everything inline.
+    Concurrent parallel_for calls take turns.
+    */
+    class ThreadPool {
+        std::vector<std::thread> workers;
+        // held for a whole parallel_for, the job fields below describe a single job
+        std::mutex run_mutex;
+        std::mutex mutex;
+        std::condition_variable cv, done_cv;
+        const std::function<void(size_t, size_t)> *job = nullptr;
+        size_t job_count = 0;
+        size_t job_chunk = 0;
+        size_t job_chunks = 0;
+        std::atomic<size_t> next_chunk{0};
+        size_t busy = 0;
+        uint64_t generation = 0;
+        bool stop = false;
+        void run_chunks();
+        void worker_loop();
+
+      public:
+        explicit ThreadPool(size_t n_threads = std::thread::hardware_concurrency());
+        ~ThreadPool();
+        size_t num_threads() const { return workers.size() + 1; }
+        // calls f(begin, end) over [0, count) split into chunks of at most `chunk` items
+        void parallel_for(size_t count, size_t chunk, const std::function<void(size_t, size_t)> &f);
+    };
+    /*
+    A single worker that runs tasks in submission order. submit returns a ticket,
+    wait(ticket) returns once that task and every task before it has finished.
+    The destructor drains the queue.
+    */
+    class TaskQueue {
+        std::mutex mutex;
+        std::condition_variable cv, done_cv;
+        std::deque<std::function<void()>> tasks;
+        uint64_t submitted = 0;
+        std::atomic<uint64_t> completed{0};
+        bool stop = false;
+        // last, so the worker starts after everything it touches is constructed
+        std::thread worker;
+        void worker_loop();
+
+      public:
+        TaskQueue();
+        ~TaskQueue();
+        uint64_t submit(std::function<void()> f);
+        bool done(uint64_t ticket) const { return completed.load(std::memory_order_acquire) >= ticket; }
+        void wait(uint64_t ticket);
+        void wait_all();
+    };
+    /*
+    Workers that take tasks in submission order and run them concurrently, for tasks that mostly wait,
+    such as on a compiler process. The destructor drains the pool.
+    */
+    class TaskPool {
+        std::mutex mutex;
+        std::condition_variable cv;
+        std::deque<std::function<void()>> tasks;
+        bool stop = false;
+        std::vector<std::thread> workers;
+        void worker_loop();
+
+      public:
+        explicit TaskPool(size_t n_threads);
+        ~TaskPool();
+        void submit(std::function<void()> f);
+    };
+} // namespace nagisa
@@ -0,0 +1,494 @@
+// MIT License
+//
+// Copyright (c) 2020 椎名深雪
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+/*
+Regression checks, one process per case: `nagisa_tests <case>` runs it on the backend nagisa_init picks
+(ctest sets NAGISA_BACKEND=cpu) and exits non-zero on the first failed CHECK. A case returning kSkip is
+reported as skipped, for features the device at hand doesn't have
+*/
+#include <nagisa/nagisa.hpp>
+#include <cmath>
+#include <iostream>
+#include <map>
+#include <numeric>
+#include <thread>
+using namespace nagisa;
+using Float = GPUArray<float>;
+using Int = GPUArray<int32_t>;
+
+#define CHECK(expr)                                                                                                    \
+    do {                                                                                                               \
+        if (!(expr)) {                                                                                                 \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #expr);                                   \
+            std::exit(1);                                                                                              \
+        }                                                                                                              \
+    } while (0)
+
+static constexpr int kSkip = 77;
+static std::map<std::string, int (*)()> &cases() {
+    static std::map<std::string, int (*)()> m;
+    return m;
+}
+struct Register {
+    Register(const char *name, int (*f)()) { cases()[name] = f; }
+};
+#define TEST_CASE(name)                                                                                                \
+    static int test_##name();                                                                                          \
+    static Register register_##name(#name, test_##name);                                                               \
+    static int test_##name()
+
+TEST_CASE(eval) {
+    Float x = Float(range<Int>(1000)) * 2.0f + 1.0f;
+    auto &d = x.data();
+    CHECK(d.size() == 1000);
+    for (int i = 0; i < 1000; i++) {
+        CHECK(d[i] == 2.0f * i + 1.0f);
+    }
+    return 0;
+}
+
+// a size that is not a multiple of any vector width exercises the scalar tail
+TEST_CASE(simd_tail) {
+    Float x = Float(range<Int>(37));
+    Float y = sqrt(x * x + 1.0f);
+    auto &d = y.data();
+    for (int i = 0; i < 37; i++) {
+        CHECK(std::abs(d[i] - std::sqrt((float)i * i + 1.0f)) < 1e-5f);
+    }
+    return 0;
+}
+
+TEST_CASE(disk_cache) {
+    auto run = [] { return (Float(range<Int>(64)) * 3.0f - 5.0f).data()[10]; };
+    CHECK(run() == 25.0f);
+    nagisa_destroy();
+    auto before = nagisa_kernel_cache_stats();
+    nagisa_init();
+    CHECK(run() == 25.0f);
+    CHECK(nagisa_kernel_cache_stats().disk_hits > before.disk_hits);
+    return 0;
+}
+
+// the last kernel differs from the one before only in the value of its opaque scalar, so it is found in memory
+TEST_CASE(opaque_scalars) {
+    auto run = [](float s) { return (Float(range<Int>(16)) * Float::opaque(s)).data()[3]; };
+    CHECK(run(2.0f) == 6.0f);
+    CHECK(run(3.0f) == 9.0f);
+    auto before = nagisa_kernel_cache_stats();
+    CHECK(run(5.0f) == 15.0f);
+    auto after = nagisa_kernel_cache_stats();
+    CHECK(after.misses == before.misses && after.disk_hits == before.disk_hits);
+    return 0;
+}
+
+TEST_CASE(simplify) {
+    Float x = Float(range<Int>(8)) * 2.0f;
+    CHECK((x * 1.0f).index().i == x.index().i);
+    CHECK((x + 0.0f).index().i == x.index().i);
+    // folded to a single constant
+    Float c = (Float(2.0f) * Float(3.0f) + Float(1.0f)) * Float(1.0f, 4);
+    CHECK(c.data()[3] == 7.0f);
+    // never forwarded to ThreadIdx, which can't be evaluated
+    Int r = range<Int>(5) + 0;
+    CHECK(r.data()[4] == 4);
+    // equal instructions over other lanes are other vars
+    Int a = range<Int>(3) + 1, b = range<Int>(6) + 1;
+    CHECK(a.data().size() == 3 && b.data().size() == 6 && b.data()[5] == 6);
+    // nor is a size-1 var resized by an operand over more lanes
+    Float one = Float(1.0f);
+    Float ones = one * Float(1.0f, 4);
+    CHECK(ones.index().i != one.index().i && ones.data().size() == 4 && ones.data()[3] == 1.0f);
+    return 0;
+}
+
+TEST_CASE(slot_table) {
+    Float x = Float(range<Int>(100));
+    Float acc = x;
+    for (int i = 0; i < 200; i++) {
+        Float tmp = acc + 1.0f;
+        acc = tmp;
+    }
+    CHECK(acc.data()[7] == 207.0f);
+    // equal instructions are hash-consed, also after the slots around them were recycled
+    Float y = Float(range<Int>(100)) * 3.0f;
+    Float z = Float(range<Int>(100)) * 3.0f;
+    CHECK((int)y.index() == (int)z.index());
+    CHECK(z.data()[5] == 15.0f);
+    return 0;
+}
+
+TEST_CASE(multi_size_schedule) {
+    Float a = Float(range<Int>(10)) + 1.0f;
+    Float b = Float(range<Int>(20)) * 2.0f;
+    nagisa_eval();
+    CHECK(a.data()[9] == 10.0f);
+    CHECK(b.data()[19] == 38.0f);
+    return 0;
+}
+
+TEST_CASE(async_readback) {
+    Float a = Float(range<Int>(4096)) + 1.0f;
+    nagisa_eval();
+    Float b = a * 2.0f;
+    nagisa_eval();
+    CHECK(b.data()[4095] == 8192.0f);
+    CHECK(a.data()[4095] == 4096.0f);
+    return 0;
+}
+
+TEST_CASE(buffer_pool) {
+    {
+        Float a = Float(range<Int>(1000)) + 1.0f;
+        nagisa_eval();
+        a.data();
+    }
+    auto reuses = nagisa_memory_stats().reuses;
+    Float b = Float(range<Int>(1000)) + 2.0f;
+    CHECK(b.data()[0] == 2.0f);
+    CHECK(nagisa_memory_stats().reuses > reuses);
+    return 0;
+}
+
+// a kernel over other buffers of the same shape is found in the cache
+TEST_CASE(stable_buffer_ids) {
+    Float a = Float(range<Int>(32)) + 1.0f;
+    Float b = Float(range<Int>(32)) + 2.0f;
+    // both are read from buffers from here on
+    CHECK(a.data()[0] == 1.0f && b.data()[0] == 2.0f);
+    CHECK((a * 2.0f).data()[0] == 2.0f);
+    auto before = nagisa_kernel_cache_stats();
+    CHECK((b * 2.0f).data()[31] == 66.0f);
+    auto after = nagisa_kernel_cache_stats();
+    CHECK(after.misses == before.misses && after.disk_hits == before.disk_hits);
+    return 0;
+}
+
+TEST_CASE(host_memory) {
+    std::vector<float> h(100);
+    std::iota(h.begin(), h.end(), 0.0f);
+    Float a = Float::from_host(h.data(), h.size());
+    Float b = a + 1.0f;
+    nagisa_eval();
+    auto span = b.map();
+    CHECK(span.size() == 100 && span[99] == 100.0f);
+    return 0;
+}
+
+TEST_CASE(gather_scatter) {
+    Int i = range<Int>(10);
+    Float src = Float(i) * 10.0f;
+    Float g = src.gather(9 - i, i < 5);
+    auto &d = g.data();
+    CHECK(d[0] == 90.0f && d[4] == 50.0f && d[5] == 0.0f);
+    Float t = Float(0.0f, 10);
+    scatter(t, 9 - i, Float(i));
+    CHECK(t.data()[9] == 0.0f && t.data()[0] == 9.0f);
+    Int hist = Int(0, 4);
+    nagisa_eval();
+    scatter_add(hist, i % 4, Int(1, 10));
+    auto &h = hist.data();
+    CHECK(h[0] == 3 && h[1] == 3 && h[2] == 2 && h[3] == 2);
+    // a single element source is broadcast over the lanes of the index
+    Float s = 2.0f;
+    Float sg = s.gather(range<Int>(10));
+    CHECK(sg.size() == 10 && sg.data()[9] == 2.0f);
+    // gathering from a var that simplify could have forwarded to ThreadIdx
+    Int r = range<Int>(5) + 0;
+    CHECK(r.gather(4 - range<Int>(5)).data()[0] == 4);
+    return 0;
+}
+
+TEST_CASE(reductions) {
+    Float x = Float(range<Int>(100));
+    CHECK(hsum(x).data()[0] == 4950.0f);
+    CHECK(hmax(x).data()[0] == 99.0f);
+    CHECK(hmin(x + 3.0f).data()[0] == 3.0f);
+    CHECK(count(x < 10.0f).data()[0] == 10);
+    CHECK(any(x > 98.0f).data()[0] && !all(x > 0.0f).data()[0]);
+    // a reduction is a single element, gathering from it broadcasts
+    Int i = range<Int>(10);
+    Float total = hsum(x).gather(i, i < 3);
+    auto &td = total.data();
+    CHECK(total.size() == 10 && td[2] == 4950.0f && td[3] == 0.0f);
+    Float all_total = hsum(x).gather(i);
+    CHECK(all_total.size() == 10 && all_total.data()[9] == 4950.0f);
+    return 0;
+}
+
+TEST_CASE(prefix_sum) {
+    Int x = range<Int>(10) + 1;
+    Int sum = prefix_sum(x);
+    auto &d = sum.data();
+    CHECK(d.size() == 10 && d[0] == 0 && d[9] == 45);
+    Int indices = compress(range<Int>(10) % 3 == 0);
+    auto &c = indices.data();
+    CHECK(c.size() == 4 && c[0] == 0 && c[3] == 9);
+    // broadcasts and ranges are written out over every lane first
+    Int ones = prefix_sum(Int(1, 6));
+    auto &o = ones.data();
+    CHECK(o.size() == 6 && o[5] == 5);
+    Int ramp = prefix_sum(range<Int>(6), false);
+    auto &r = ramp.data();
+    CHECK(r.size() == 6 && r[5] == 15);
+    Int single = prefix_sum(hsum(x), false);
+    CHECK(single.data().size() == 1 && single.data()[0] == 55);
+    return 0;
+}
+
+TEST_CASE(control_flow) {
+    Int n = range<Int>(8);
+    Int steps = Int(0, 8);
+    Int v = n;
+    loop(std::tie(v, steps), [&] { return v > 0; },
+         [&] {
+             v = v - 1;
+             steps = steps + 1;
+         });
+    CHECK(steps.data()[7] == 7 && v.data()[7] == 0);
+    Float y = Float(range<Int>(8)) + 1.0f;
+    if_(n % 2 == 0, std::tie(y), [&] { y = y * 10.0f; });
+    CHECK(y.data()[2] == 30.0f && y.data()[3] == 4.0f);
+    return 0;
+}
+
+TEST_CASE(function) {
+    Function<Var<float>(Var<float>, Var<float>)> f([](Var<float> a, Var<float> b) { return a * b + 1.0f; });
+    auto fn = f.compile();
+    CHECK(fn(3.0f, 4.0f) == 13.0f);
+    auto vf = f.vectorize<4>().compile();
+    auto r = vf(vec<float, 4>{{1, 2, 3, 4}}, vec<float, 4>{{2, 2, 2, 2}});
+    CHECK(r[0] == 3.0f && r[3] == 9.0f);
+    Function<Var<int>(Var<int>, Var<bool>)> g([](Var<int> a, Var<bool> c) { return select(c, a * 2, a - 1); });
+    auto gn = g.compile();
+    CHECK(gn(5, true) == 10 && gn(5, false) == 4 && gn(-7, true) == -14);
+    Function<Var<bool>(Var<int>)> positive([](Var<int> a) { return a > 0; });
+    auto pn = positive.compile();
+    CHECK(pn(3) && !pn(0) && !pn(-3));
+    // 19 lanes leave a partial vector of every SIMD width
+    auto vg = g.vectorize<19>().compile();
+    vec<int, 19> a;
+    vec<bool, 19> c;
+    for (int i = 0; i < 19; i++) {
+        a[i] = i;
+        c[i] = i % 3 == 0;
+    }
+    auto vr = vg(a, c);
+    for (int i = 0; i < 19; i++) {
+        CHECK(vr[i] == (i % 3 == 0 ? 2 * i : i - 1));
+    }
+    return 0;
+}
+
+struct Particle {
+    vec<float, 3> p;
+    float w;
+};
+NGS_STRUCT(Particle, p, w);
+
+TEST_CASE(struct_array) {
+    std::vector<Particle> host(6);
+    for (int i = 0; i < 6; i++) {
+        host[i] = Particle{{{(float)i, 2.0f * i, 3.0f * i}}, 1.0f};
+    }
+    for (auto layout : {Layout::soa, Layout::aos, Layout::aos4}) {
+        auto a = StructArray<Particle>::upload(host.data(), host.size(), layout);
+        auto e = a.gather(5 - range<Int>(6));
+        e.w = e.p[1] + 0.5f;
+        a.scatter(range<Int>(6), e);
+        auto out = a.to_host();
+        CHECK(out[0].p[0] == 5.0f && out[0].w == 10.5f && out[5].p[2] == 0.0f);
+    }
+    return 0;
+}
+
+TEST_CASE(types) {
+    GPUArray<double> d = GPUArray<double>(range<Int>(4)) / 3.0;
+    CHECK(std::abs(d.data()[1] - 1.0 / 3.0) < 1e-15);
+    GPUArray<half> h = cast<half>(Float(range<Int>(4)) * 0.5f);
+    CHECK((float)h.data()[3] == 1.5f);
+    GPUArray<uint32_t> u = cast<uint32_t>(range<Int>(4)) * 3000000000u;
+    CHECK(u.data()[1] == 3000000000u);
+    GPUArray<int64_t> l = cast<int64_t>(range<Int>(4)) * (int64_t)1000000000000;
+    CHECK(l.data()[3] == 3000000000000);
+    // a range is a Cast of ThreadIdx, it can be read back and the same cast over other lanes is another var
+    CHECK(range<Int>(5).data()[3] == 3);
+    Float small = Float(range<Int>(10)), large = Float(range<Int>(40));
+    CHECK(small.data().size() == 10 && large.data().size() == 40 && large.data()[39] == 39.0f);
+    return 0;
+}
+
+TEST_CASE(tiling) {
+    nagisa_set_tile_budget(64 * 1024);
+    size_t n = 100000;
+    Float x = Float(range<Int>(n)) * 2.0f;
+    auto &d = x.data();
+    CHECK(nagisa_memory_stats().spilled_bytes >= n * sizeof(float));
+    CHECK(d[0] == 0.0f && d[4097] == 8194.0f && d[n - 1] == 2.0f * (n - 1));
+    Float y = x + 1.0f;
+    CHECK(y.data()[n - 1] == 2.0f * (n - 1) + 1.0f);
+    return 0;
+}
+
+TEST_CASE(tiled_reduction) {
+    nagisa_set_tile_budget(size_t(1) << 30);
+    nagisa_set_profiling(true);
+    nagisa_reset_profile();
+    // four tiles of 2^30 lanes, the last two start past the 32-bit thread index
+    size_t n = (size_t(3) << 30) + 5;
+    auto r = range<GPUArray<int64_t>>(n);
+    auto hi = hmax(r), lo = hmin(r);
+    eval(hi, lo);
+    CHECK(nagisa_profile_stats().launches == 4);
+    CHECK(hi.data()[0] == (int64_t)n - 1 && lo.data()[0] == 0);
+    return 0;
+}
+
+TEST_CASE(cost_model) {
+    Float x = Float(range<Int>(100)) + 1.0f;
+    nagisa_eval();
+    // cheap enough to be recomputed by its users
+    CHECK(nagisa_buffer_id(x.index()) == -1);
+    eval(x);
+    CHECK(nagisa_buffer_id(x.index()) != -1);
+    CHECK(x.data()[99] == 100.0f);
+    return 0;
+}
+
+TEST_CASE(profiling) {
+    nagisa_set_profiling(true);
+    nagisa_reset_profile();
+    Float x = Float(range<Int>(100)) * 3.0f;
+    x.data();
+    auto s = nagisa_profile_stats();
+    CHECK(s.launches >= 1 && s.kernels_generated >= 1 && s.trace_nodes >= 1);
+    CHECK(s.bytes_downloaded == 100 * sizeof(float));
+    return 0;
+}
+
+TEST_CASE(graph) {
+    Float s = Float(2.0f);
+    Float y;
+    auto g = capture([&] { y = Float(range<Int>(16)) * s; }, s);
+    CHECK(y.data()[3] == 6.0f);
+    Float t = Float(5.0f);
+    g.replay(t);
+    CHECK(y.data()[3] == 15.0f);
+    return 0;
+}
+
+TEST_CASE(thread_contexts) {
+    std::vector<float> results(4);
+    std::vector<std::thread> threads;
+    for (int k = 0; k < 4; k++) {
+        threads.emplace_back([&, k] {
+            ThreadContext c;
+            Float x = Float(range<Int>(1000)) * (float)(k + 1);
+            results[k] = hsum(x).data()[0];
+        });
+    }
+    for (auto &t : threads) {
+        t.join();
+    }
+    for (int k = 0; k < 4; k++) {
+        CHECK(results[k] == 499500.0f * (k + 1));
+    }
+    return 0;
+}
+
+TEST_CASE(opencl_devices) {
+    if (nagisa_opencl_devices().empty()) {
+        return kSkip;
+    }
+    nagisa_destroy();
+    OpenCLDevice d;
+    d.type = DeviceType::all;
+    nagisa_set_opencl_device(d);
+    nagisa_init(BackendType::opencl);
+    CHECK(hsum(Float(range<Int>(1000))).data()[0] == 499500.0f);
+    return 0;
+}
+
+// ctest runs this case with NAGISA_OPENCL_SHARDS=2: launches are split over two sub-devices of the OpenCL CPU
+// device, and the second one writes scratch buffers that are copied back
+TEST_CASE(opencl_sharded) {
+    if (nagisa_opencl_devices().empty() || std::thread::hardware_concurrency() < 2) {
+        return kSkip;
+    }
+    nagisa_destroy();
+    nagisa_set_profiling(true);
+    OpenCLDevice d;
+    d.type = DeviceType::cpu;
+    nagisa_set_opencl_device(d);
+    nagisa_init(BackendType::opencl);
+    nagisa_reset_profile();
+    int n = 1 << 20;
+    Float x = Float(range<Int>(n)) * 2.0f + 1.0f;
+    Float y = x * x;
+    eval(x, y);
+    CHECK(nagisa_profile_stats().bytes_copied > 0);
+    // a sharded kernel reading the outputs of the last one
+    Float z = y - x;
+    auto &dx = x.data(), &dy = y.data(), &dz = z.data();
+    for (int i = 0; i < n; i++) {
+        float e = 2.0f * i + 1.0f;
+        CHECK(dx[i] == e && dy[i] == e * e && dz[i] == dy[i] - dx[i]);
+    }
+    // reductions stay on the first device
+    CHECK(count(x > 1.0f).data()[0] == n - 1);
+    return 0;
+}
+
+TEST_CASE(compile_pool) {
+    // several sizes make several kernels, built at once
+    std::vector<Float> xs;
+    for (int k = 1; k <= 4; k++) {
+        xs.push_back(Float(range<Int>(10 * k)) * (float)k);
+        schedule(xs.back());
+    }
+    nagisa_eval();
+    for (int k = 1; k <= 4; k++) {
+        CHECK(xs[k - 1].data()[9] == 9.0f * k);
+    }
+    nagisa_set_background_compile(2);
+    Float y = Float(range<Int>(50));
+    for (int i = 0; i < 10; i++) {
+        y = y * 2.0f + 1.0f;
+    }
+    nagisa_precompile();
+    CHECK(y.data()[0] == 1023.0f);
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    if (argc != 2 || !cases().count(argv[1])) {
+        std::cerr << "usage: nagisa_tests <case>, one of:";
+        for (auto &c : cases()) {
+            std::cerr << " " << c.first;
+        }
+        std::cerr << std::endl;
+        return 2;
+    }
+    nagisa_init();
+    int r = cases()[argv[1]]();
+    nagisa_destroy();
+    return r;
+}